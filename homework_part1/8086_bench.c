@@ -0,0 +1,484 @@
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#include "8086_decode.h"
+
+// Generates a random but valid instruction stream with a chosen mix of encodings and times the decoder over it.
+// Results can be saved as a baseline and later runs are compared against it.
+
+//*****************************************************************************
+// Corpus Generator
+//*****************************************************************************
+typedef enum {
+    EncodingRegister = 0, // mod 11
+    EncodingMemory,       // mod 00 through a register
+    EncodingByteDisplacement,
+    EncodingWordDisplacement,
+    EncodingDirect,    // mod 00 r/m 110 and the accumulator forms
+    EncodingImmediate, // Immediate to register/accumulator/memory
+    EncodingMisc,      // Single byte instructions and short jumps
+    EncodingCount,
+} Encoding_t;
+
+const char *EncodingNames[EncodingCount] = {"reg", "mem", "disp8", "disp16", "direct", "imm", "misc"};
+
+typedef struct {
+    uint32_t Weights[EncodingCount];
+    uint64_t Seed;
+} CorpusMix_t;
+
+// xorshift64, good enough to scatter encodings and never 0 for a non-zero seed
+uint64_t NextRandom(uint64_t *State) {
+    uint64_t x = *State;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *State = x;
+    return x;
+}
+
+// Opcodes that take a mod r/m byte plus a register: the ALU ops, test, xchg and mov.
+static const uint8_t ModRMOpcodes[] = {
+    0x00, 0x01, 0x02, 0x03, 0x08, 0x09, 0x0a, 0x0b, 0x10, 0x11, 0x12, 0x13, 0x18, 0x19, 0x1a, 0x1b, 0x20, 0x21,
+    0x22, 0x23, 0x28, 0x29, 0x2a, 0x2b, 0x30, 0x31, 0x32, 0x33, 0x38, 0x39, 0x3a, 0x3b, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x8b, 0x88, 0x89, 0x8a, 0x8b, // mov twice, it dominates real code
+};
+
+// Single byte instructions that don't need anything after them
+static const uint8_t MiscOpcodes[] = {
+    0x40, 0x43, 0x48, 0x4e, 0x50, 0x53, 0x56, 0x58, 0x5b, 0x5e, 0x90, 0x98, 0x99, 0x9c, 0x9d, 0xa4, 0xa5, 0xaa,
+    0xab, 0xac, 0xad, 0xc3, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xd7, 0x9e, 0x9f,
+};
+
+// Writes one instruction of the given encoding to Out and returns its length.
+uint32_t GenerateInstruction(uint8_t *Out, const Encoding_t Encoding, uint64_t *Random) {
+    const uint64_t r = NextRandom(Random);
+    const uint8_t Reg = (r >> 8) & 0x7;
+    uint8_t RegMem = (r >> 11) & 0x7;
+
+    switch (Encoding) {
+    case EncodingRegister:
+    case EncodingMemory:
+    case EncodingByteDisplacement:
+    case EncodingWordDisplacement: {
+        static const uint8_t Modes[] = {RegisterMode, MemNoDispalcement, MemByteDispalcement, MemWordDispalcement};
+        const uint8_t Mode = Modes[Encoding - EncodingRegister];
+        if ((Mode == MemNoDispalcement) && (RegMem == EffectiveAddressDirect)) {
+            RegMem = 7; // Would be a direct address instead
+        }
+        Out[0] = ModRMOpcodes[(r >> 16) % sizeof(ModRMOpcodes)];
+        Out[1] = (Mode << 6) | (Reg << 3) | RegMem;
+        Out[2] = r >> 24;
+        Out[3] = r >> 32;
+        return 2 + GetDisplacementLength(Out[1]);
+    }
+    case EncodingDirect:
+        if (r & 0x1) {
+            // a0-a3 accumulator to/from memory
+            Out[0] = 0xa0 | ((r >> 1) & 0x3);
+            Out[1] = r >> 24;
+            Out[2] = r >> 32;
+            return 3;
+        }
+        Out[0] = ModRMOpcodes[(r >> 16) % sizeof(ModRMOpcodes)];
+        Out[1] = (Reg << 3) | EffectiveAddressDirect;
+        Out[2] = r >> 24;
+        Out[3] = r >> 32;
+        return 4;
+    case EncodingImmediate:
+        switch ((r >> 1) & 0x3) {
+        case 0:
+            // b0-bf mov register, immediate
+            Out[0] = 0xb0 | ((r >> 16) & 0xf);
+            Out[1] = r >> 24;
+            Out[2] = r >> 32;
+            return (Out[0] & 0x8) ? 3 : 2;
+        case 1:
+            // 04/05, 0c/0d... ALU op on the accumulator
+            Out[0] = (Reg << 3) | 0x4 | ((r >> 16) & 0x1);
+            Out[1] = r >> 24;
+            Out[2] = r >> 32;
+            return (Out[0] & 0x1) ? 3 : 2;
+        default: {
+            // 80-83 group 1 and c6/c7 mov on a register or memory operand with any mod
+            static const uint8_t Opcodes[] = {0x80, 0x81, 0x83, 0xc6, 0xc7};
+            Out[0] = Opcodes[(r >> 16) % sizeof(Opcodes)];
+            Out[1] = ((r >> 40) & 0xc0) | (((Out[0] & 0xc0) == 0xc0) ? 0 : (Reg << 3)) | RegMem;
+            const uint32_t ImmediateOffset = 2 + GetDisplacementLength(Out[1]);
+            Out[2] = r >> 24;
+            Out[3] = r >> 32;
+            Out[ImmediateOffset] = r >> 48;
+            Out[ImmediateOffset + 1] = r >> 56;
+            return ImmediateOffset + (((Out[0] == 0x81) || (Out[0] == 0xc7)) ? 2 : 1);
+        }
+        }
+    case EncodingMisc:
+    default:
+        if (r & 0x1) {
+            // 70-7f jcc and eb jmp short
+            Out[0] = ((r >> 1) & 0x7) ? (0x70 | ((r >> 16) & 0xf)) : 0xeb;
+            Out[1] = r >> 24;
+            return 2;
+        }
+        Out[0] = MiscOpcodes[(r >> 16) % sizeof(MiscOpcodes)];
+        return 1;
+    }
+}
+
+// Builds Size bytes of instructions, each encoding picked with probability Weight / sum of weights. The stream always
+// ends on an instruction boundary so every byte decodes.
+FileInfo_t GenerateCorpus(const size_t Size, const CorpusMix_t Mix) {
+    uint8_t *Bin = malloc(Size + MaxInstructionLength);
+    if (!Bin) {
+        printf("[%s] ERROR: Could not malloc %lu bytes for the corpus.\n", __func__, Size);
+        exit(1);
+    }
+
+    uint32_t TotalWeight = 0;
+    for (int e = 0; e < EncodingCount; e++) {
+        TotalWeight += Mix.Weights[e];
+    }
+    if (!TotalWeight) {
+        printf("[%s] ERROR: Every encoding has a weight of 0.\n", __func__);
+        exit(1);
+    }
+
+    uint64_t Random = Mix.Seed ? Mix.Seed : 1;
+    size_t Used = 0;
+    while (Used < Size) {
+        uint32_t Pick = NextRandom(&Random) % TotalWeight;
+        int Encoding = 0;
+        while (Pick >= Mix.Weights[Encoding]) {
+            Pick -= Mix.Weights[Encoding++];
+        }
+
+        uint8_t Instruction[MaxInstructionLength];
+        const uint32_t Length = GenerateInstruction(Instruction, Encoding, &Random);
+        if ((Used + Length) > Size) {
+            break;
+        }
+        memcpy(Bin + Used, Instruction, Length);
+        Used += Length;
+    }
+
+    FileInfo_t Info = {Used, Bin, 0};
+    return Info;
+}
+
+// "reg=30,mem=10,..." sets the weights it names and leaves the rest alone.
+void ParseMix(CorpusMix_t *Mix, const char *Spec) {
+    char Copy[256];
+    snprintf(Copy, sizeof(Copy), "%s", Spec);
+    for (char *Token = strtok(Copy, ","); Token; Token = strtok(NULL, ",")) {
+        char *Equals = strchr(Token, '=');
+        int Found = 0;
+        for (int e = 0; Equals && (e < EncodingCount); e++) {
+            if (!strncmp(Token, EncodingNames[e], Equals - Token) && !EncodingNames[e][Equals - Token]) {
+                Mix->Weights[e] = atoi(Equals + 1);
+                Found = 1;
+            }
+        }
+        if (!Found) {
+            printf("ERROR: Bad mix entry %s, expected <encoding>=<weight>\n", Token);
+            exit(1);
+        }
+    }
+}
+
+//*****************************************************************************
+// Counters
+//*****************************************************************************
+// Branch counts come from the kernel's hardware counters when it lets us have them. Containers and VMs often don't,
+// in which case the column just says so.
+typedef struct {
+    int GroupFd;
+    int MissFd;
+} BranchCounters_t;
+
+int OpenCounter(const uint64_t Config, const int GroupFd) {
+    struct perf_event_attr Attr;
+    memset(&Attr, 0, sizeof(Attr));
+    Attr.type = PERF_TYPE_HARDWARE;
+    Attr.size = sizeof(Attr);
+    Attr.config = Config;
+    Attr.disabled = GroupFd < 0;
+    Attr.exclude_kernel = 1;
+    Attr.exclude_hv = 1;
+    Attr.read_format = PERF_FORMAT_GROUP;
+    return syscall(SYS_perf_event_open, &Attr, 0, -1, GroupFd, 0);
+}
+
+BranchCounters_t OpenBranchCounters(void) {
+    BranchCounters_t Counters = {-1, -1};
+    Counters.GroupFd = OpenCounter(PERF_COUNT_HW_BRANCH_INSTRUCTIONS, -1);
+    if (Counters.GroupFd >= 0) {
+        Counters.MissFd = OpenCounter(PERF_COUNT_HW_BRANCH_MISSES, Counters.GroupFd);
+        if (Counters.MissFd < 0) {
+            close(Counters.GroupFd);
+            Counters.GroupFd = -1;
+        }
+    }
+    return Counters;
+}
+
+void StartBranchCounters(const BranchCounters_t Counters) {
+    if (Counters.GroupFd >= 0) {
+        ioctl(Counters.GroupFd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(Counters.GroupFd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+// Returns the miss rate as a fraction of branches, or -1 when there are no counters.
+double StopBranchCounters(const BranchCounters_t Counters) {
+    if (Counters.GroupFd < 0) {
+        return -1;
+    }
+    ioctl(Counters.GroupFd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    struct {
+        uint64_t Count;
+        uint64_t Values[2];
+    } Group;
+    if ((read(Counters.GroupFd, &Group, sizeof(Group)) != sizeof(Group)) || !Group.Values[0]) {
+        return -1;
+    }
+    return (double)Group.Values[1] / (double)Group.Values[0];
+}
+
+//*****************************************************************************
+// Benchmarks
+//*****************************************************************************
+typedef enum {
+    MethodLength = 0, // Table dispatch plus GetInstructionLength, no records
+    MethodPrescan,    // PrescanLengths then ResolveInstructionLengths, no records
+    MethodDecode,     // DecodeRange into records
+    MethodFormat,     // DecodeRange then format every record into a buffer
+    MethodCount,
+} Method_t;
+
+const char *MethodNames[MethodCount] = {"length", "prescan", "decode", "decode+format"};
+
+typedef struct {
+    double InstructionsPerSecond;
+    double BytesPerSecond;
+    double CyclesPerInstruction;
+    double BranchMissRate;
+} BenchmarkResult_t;
+
+// Returns the number of instructions processed. Checksum keeps the compiler from dropping work it thinks is unused,
+// it ends up in BenchmarkSink.
+uint64_t RunMethod(const Method_t Method, const FileInfo_t Corpus, OutputBuffer_t *Output, uint64_t *Checksum) {
+    if (Method == MethodLength) {
+        uint64_t Instructions = 0;
+        uint64_t ip = 0;
+        while (ip < Corpus.FileSize) {
+            const OpcodeEntry_t Entry = OpcodeTable[Corpus.Bin[ip]];
+            ip += GetInstructionLength(ip, Entry, Corpus);
+            Instructions++;
+        }
+        *Checksum += ip;
+        return Instructions;
+    }
+    if (Method == MethodPrescan) {
+        // The output buffer is always bigger than the corpus, so it doubles as room for the lengths
+        uint8_t *Lengths = (uint8_t *)Output->Data;
+        uint64_t ResolvedSize;
+        PrescanLengths(Corpus, 0, Corpus.FileSize, Lengths);
+        const uint64_t Instructions = ResolveInstructionLengths(Lengths, Corpus.FileSize, &ResolvedSize);
+        *Checksum += ResolvedSize;
+        return Instructions;
+    }
+
+    size_t Count;
+    Instruction_t *Records = DecodeBin(Corpus, &Count);
+    *Checksum += Count ? Records[Count - 1].Mnemonic : 0;
+    if (Method == MethodFormat) {
+        Output->Used = 0;
+        for (size_t i = 0; i < Count; i++) {
+            FormatInstruction(Output, &Records[i]);
+        }
+        *Checksum += Output->Used;
+    }
+    free(Records);
+    return Count;
+}
+
+volatile uint64_t BenchmarkSink;
+
+// Reruns a method until MinSeconds have gone by and keeps the fastest pass, the same way a repetition tester does,
+// so one unlucky pass (page faults on the first run, a context switch) doesn't skew it.
+BenchmarkResult_t BenchmarkMethod(const Method_t Method, const FileInfo_t Corpus, const BranchCounters_t Counters) {
+    const double MinSeconds = 0.5;
+    const size_t LargestCount = Corpus.FileSize;
+    OutputBuffer_t Output = CreateOutputBuffer(LargestCount);
+
+    BenchmarkResult_t Best = {0, 0, 0, -1};
+    uint64_t Checksum = 0;
+    const double Start = GetSeconds();
+    while ((GetSeconds() - Start) < MinSeconds) {
+        StartBranchCounters(Counters);
+        const double PassStart = GetSeconds();
+        const uint64_t StartCycles = __rdtsc();
+        const uint64_t Instructions = RunMethod(Method, Corpus, &Output, &Checksum);
+        const uint64_t Cycles = __rdtsc() - StartCycles;
+        const double Elapsed = GetSeconds() - PassStart;
+        const double MissRate = StopBranchCounters(Counters);
+
+        if (((double)Instructions / Elapsed) > Best.InstructionsPerSecond) {
+            Best.InstructionsPerSecond = (double)Instructions / Elapsed;
+            Best.BytesPerSecond = (double)Corpus.FileSize / Elapsed;
+            Best.CyclesPerInstruction = (double)Cycles / (double)Instructions;
+            Best.BranchMissRate = MissRate;
+        }
+    }
+    BenchmarkSink += Checksum;
+    free(Output.Data);
+    return Best;
+}
+
+//*****************************************************************************
+// Baseline
+//*****************************************************************************
+// A "corpus <description>" line then one "<method> <instructions/sec>" line per method. Anything more than
+// RegressionThreshold slower is called out. A baseline taken on a different corpus is ignored.
+#define RegressionThreshold 0.05
+
+void DescribeCorpus(char *Description, const size_t DescriptionSize, const FileInfo_t Corpus, const CorpusMix_t Mix) {
+    int Used = snprintf(Description, DescriptionSize, "size=%lu,seed=%lu", Corpus.FileSize, Mix.Seed);
+    for (int e = 0; e < EncodingCount; e++) {
+        Used += snprintf(Description + Used, DescriptionSize - Used, ",%s=%u", EncodingNames[e], Mix.Weights[e]);
+    }
+}
+
+int LoadBaseline(const char *BaselineFile, const char *Description, double Baseline[MethodCount]) {
+    FILE *Stream = fopen(BaselineFile, "r");
+    if (!Stream) {
+        return 0;
+    }
+    char Name[32];
+    char Value[256];
+    int Loaded = 0;
+    int SameCorpus = 0;
+    while (fscanf(Stream, "%31s %255s", Name, Value) == 2) {
+        if (!strcmp(Name, "corpus")) {
+            SameCorpus = !strcmp(Value, Description);
+        }
+        for (int m = 0; m < MethodCount; m++) {
+            if (!strcmp(Name, MethodNames[m])) {
+                Baseline[m] = atof(Value);
+                Loaded = 1;
+            }
+        }
+    }
+    fclose(Stream);
+    if (Loaded && !SameCorpus) {
+        printf("Baseline in %s was taken on a different corpus, not comparing\n", BaselineFile);
+    }
+    return Loaded && SameCorpus;
+}
+
+void SaveBaseline(const char *BaselineFile, const char *Description, const BenchmarkResult_t Results[MethodCount]) {
+    FILE *Stream = fopen(BaselineFile, "w");
+    if (!Stream) {
+        printf("[%s] ERROR: Could not open %s for write\n", __func__, BaselineFile);
+        exit(1);
+    }
+    fprintf(Stream, "corpus %s\n", Description);
+    for (int m = 0; m < MethodCount; m++) {
+        fprintf(Stream, "%s %.0f\n", MethodNames[m], Results[m].InstructionsPerSecond);
+    }
+    fclose(Stream);
+}
+
+int main(int argc, char *argv[]) {
+    size_t CorpusSize = 1024 * 1024;
+    CorpusMix_t Mix = {{30, 15, 15, 10, 10, 15, 5}, 1};
+    const char *BaselineFile = NULL;
+    const char *GenerateFile = NULL;
+    int SaveAsBaseline = 0;
+    for (int ArgIndex = 1; ArgIndex < argc; ArgIndex++) {
+        if (!strcmp(argv[ArgIndex], "--size") && ((ArgIndex + 1) < argc)) {
+            CorpusSize = strtoull(argv[++ArgIndex], NULL, 0);
+        } else if (!strcmp(argv[ArgIndex], "--seed") && ((ArgIndex + 1) < argc)) {
+            Mix.Seed = strtoull(argv[++ArgIndex], NULL, 0);
+        } else if (!strcmp(argv[ArgIndex], "--mix") && ((ArgIndex + 1) < argc)) {
+            ParseMix(&Mix, argv[++ArgIndex]);
+        } else if (!strcmp(argv[ArgIndex], "--baseline") && ((ArgIndex + 1) < argc)) {
+            BaselineFile = argv[++ArgIndex];
+        } else if (!strcmp(argv[ArgIndex], "--save-baseline")) {
+            SaveAsBaseline = 1;
+        } else if (!strcmp(argv[ArgIndex], "--generate") && ((ArgIndex + 1) < argc)) {
+            GenerateFile = argv[++ArgIndex];
+        } else {
+            printf("ERROR: Unknown option %s\n", argv[ArgIndex]);
+            printf("Usage: %s [--size <bytes>] [--seed <n>] [--mix reg=30,mem=15,disp8=15,disp16=10,direct=10,imm=15,misc=5]\n"
+                   "       [--baseline <file>] [--save-baseline] [--generate <bin>]\n",
+                   argv[0]);
+            printf("       --generate writes the corpus to a bin for the decoders instead of benchmarking\n");
+            exit(1);
+        }
+    }
+
+    // Smaller than one instruction and there is nothing to time
+    if (CorpusSize < MaxInstructionLength) {
+        printf("ERROR: --size has to be at least %d bytes\n", MaxInstructionLength);
+        exit(1);
+    }
+
+    const FileInfo_t Corpus = GenerateCorpus(CorpusSize, Mix);
+    if (GenerateFile) {
+        FILE *Stream = fopen(GenerateFile, "wb");
+        if (!Stream || (fwrite(Corpus.Bin, 1, Corpus.FileSize, Stream) != Corpus.FileSize)) {
+            printf("ERROR: Could not write corpus to %s\n", GenerateFile);
+            exit(1);
+        }
+        fclose(Stream);
+        UnloadBin(Corpus);
+        return 0;
+    }
+
+    char Description[256];
+    DescribeCorpus(Description, sizeof(Description), Corpus, Mix);
+    printf("Corpus: %s\n", Description);
+
+    double Baseline[MethodCount] = {0};
+    const int HaveBaseline = BaselineFile && !SaveAsBaseline && LoadBaseline(BaselineFile, Description, Baseline);
+    const BranchCounters_t Counters = OpenBranchCounters();
+
+    BenchmarkResult_t Results[MethodCount];
+    int Regressions = 0;
+    printf("%-14s %12s %10s %13s %12s\n", "method", "M instr/s", "MB/s", "cycles/instr", "branch miss");
+    for (int m = 0; m < MethodCount; m++) {
+        Results[m] = BenchmarkMethod(m, Corpus, Counters);
+        printf("%-14s %12.1f %10.1f %13.2f ", MethodNames[m], Results[m].InstructionsPerSecond / 1e6,
+               Results[m].BytesPerSecond / 1e6, Results[m].CyclesPerInstruction);
+        if (Results[m].BranchMissRate >= 0) {
+            printf("%11.2f%%", Results[m].BranchMissRate * 100);
+        } else {
+            printf("%12s", "n/a");
+        }
+        if (HaveBaseline && Baseline[m]) {
+            const double Change = (Results[m].InstructionsPerSecond / Baseline[m]) - 1;
+            printf("  %+.1f%% vs baseline%s", Change * 100, (Change < -RegressionThreshold) ? "  REGRESSION" : "");
+            Regressions += Change < -RegressionThreshold;
+        }
+        printf("\n");
+    }
+
+    // Never overwrite a baseline without being asked to, even one from another corpus
+    if (BaselineFile && (SaveAsBaseline || access(BaselineFile, F_OK))) {
+        SaveBaseline(BaselineFile, Description, Results);
+        printf("Saved baseline to %s\n", BaselineFile);
+    }
+
+    if (Regressions) {
+        printf("%d method(s) more than %.0f%% slower than the baseline\n", Regressions, RegressionThreshold * 100);
+    }
+    UnloadBin(Corpus);
+    return Regressions ? 1 : 0;
+}
@@ -0,0 +1,1621 @@
+#include <fcntl.h>
+#include <immintrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "8086_decode.h"
+#include "8086_profile.h"
+
+#define MNEMONIC_TEXT(Name, Text, Class) Text,
+const char *const MnemonicStrs[] = {MNEMONICS(MNEMONIC_TEXT)};
+#undef MNEMONIC_TEXT
+
+#define MNEMONIC_CLASS(Name, Text, Class) Class,
+const uint8_t MnemonicClasses[] = {MNEMONICS(MNEMONIC_CLASS)};
+#undef MNEMONIC_CLASS
+
+//*****************************************************************************
+// Helper Functions
+//*****************************************************************************
+// Pipes, stdin and anything else that can't be mapped gets read into a buffer that grows as needed.
+FileInfo_t ReadBin(const int Fd, const char *BinFile, size_t Capacity) {
+    uint8_t *Bin = malloc(Capacity);
+    if (!Bin) {
+        printf("ERROR: Could not malloc %lu bytes for binary.\n", Capacity);
+        exit(1);
+    }
+
+    size_t FileSize = 0;
+    for (;;) {
+        if (FileSize == Capacity) {
+            Capacity *= 2;
+            Bin = realloc(Bin, Capacity);
+            if (!Bin) {
+                printf("ERROR: Could not grow binary buffer to %lu bytes.\n", Capacity);
+                exit(1);
+            }
+        }
+        const ssize_t Result = read(Fd, Bin + FileSize, Capacity - FileSize);
+        if (Result < 0) {
+            printf("[%s] ERROR: Could not read %s\n", __func__, BinFile);
+            exit(1);
+        }
+        if (!Result) {
+            break;
+        }
+        FileSize += Result;
+    }
+
+    FileInfo_t Info = {FileSize, Bin, 0};
+    return Info;
+}
+
+// "-" is stdin.
+int OpenBin(const char *BinFile) {
+    if (!strcmp(BinFile, "-")) {
+        return STDIN_FILENO;
+    }
+    const int Fd = open(BinFile, O_RDONLY);
+    if (Fd < 0) {
+        printf("[%s] ERROR: Could not open %s for read\n", __func__, BinFile);
+        exit(1);
+    }
+    return Fd;
+}
+
+// Maps the bin straight into memory when it's a regular file so there's no copy before decoding starts.
+FileInfo_t LoadBin(const char *BinFile) {
+    TimeFunction;
+    const int Fd = OpenBin(BinFile);
+
+    struct stat Stat;
+    const int IsRegular = !fstat(Fd, &Stat) && S_ISREG(Stat.st_mode);
+    void *Mapping = MAP_FAILED;
+    if (IsRegular && (Stat.st_size > 0)) {
+        Mapping = mmap(NULL, Stat.st_size, PROT_READ, MAP_PRIVATE, Fd, 0);
+    }
+    if (Mapping != MAP_FAILED) {
+        // Decoding walks the bin front to back so let the kernel read ahead aggressively
+        madvise(Mapping, Stat.st_size, MADV_SEQUENTIAL);
+        close(Fd);
+        fprintf(stderr, "Binary %s is 0x%lx bytes\n", BinFile, (size_t)Stat.st_size);
+
+        FileInfo_t Info = {Stat.st_size, Mapping, 1};
+        return Info;
+    }
+
+    const size_t DefaultCapacity = 64 * 1024;
+    FileInfo_t Info = ReadBin(Fd, BinFile, (IsRegular && (Stat.st_size > 0)) ? Stat.st_size : DefaultCapacity);
+    if (Fd != STDIN_FILENO) {
+        close(Fd);
+    }
+    fprintf(stderr, "Binary %s is 0x%lx bytes\n", BinFile, Info.FileSize);
+    return Info;
+}
+
+void UnloadBin(const FileInfo_t FileInfo) {
+    if (FileInfo.IsMapped) {
+        munmap((void *)FileInfo.Bin, FileInfo.FileSize);
+    } else {
+        free((void *)FileInfo.Bin);
+    }
+}
+
+uint8_t GetByteFromBin(const FileInfo_t FileInfo, const uint64_t Address) {
+    if (Address >= FileInfo.FileSize) {
+        printf("[%s] ERROR: Attempted to access address 0x%lx which is beyond the size of the bin 0x%lx\n", __func__,
+               Address, FileInfo.FileSize);
+        exit(1);
+    }
+    return FileInfo.Bin[Address];
+}
+
+uint16_t GetWordFromBin(const FileInfo_t FileInfo, const uint64_t Address) {
+    if ((Address + 1) >= FileInfo.FileSize) {
+        printf("[%s] ERROR: Attempted to access address 0x%lx which is beyond the size of the bin 0x%lx\n", __func__,
+               Address, FileInfo.FileSize);
+        exit(1);
+    }
+    // Instructions don't line words up, memcpy is the legal unaligned load and still compiles to a single mov
+    uint16_t Word;
+    memcpy(&Word, FileInfo.Bin + Address, sizeof(Word));
+    return Word;
+}
+
+double GetSeconds(void) {
+    struct timespec Now;
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return (double)Now.tv_sec + ((double)Now.tv_nsec / 1e9);
+}
+
+const char *GetRegisterStr(uint8_t Base, uint8_t IsWord) {
+    const uint8_t Index = Base | (IsWord << 3);
+    // Table 4-9 Page 263
+    static const char *const RegNames[] = {
+        "al", "cl", "dl", "bl", "ah", "ch", "dh", "bh", "ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+    };
+    return RegNames[Index];
+}
+
+const char *GetSegmentRegisterStr(uint8_t Index) {
+    static const char *const RegNames[] = {"es", "cs", "ss", "ds"};
+    return RegNames[Index & 0x3];
+}
+
+// Table 4-10
+const char *GetEffectiveAddressStr(const uint8_t RegMem) {
+    static const char *const Strings[] = {"bx + si", "bx + di", "bp + si", "bp + di", "si", "di", "direct", "bx"};
+    return Strings[RegMem];
+}
+
+// Table 4-10
+const char *GetDisplacementEffectiveAddressStr(const uint8_t RegMem) {
+    static const char *const Strings[] = {"bx + si", "bx + di", "bp + si", "bp + di", "si", "di", "bp", "bx"};
+    return Strings[RegMem];
+}
+
+//*****************************************************************************
+// Operand Decoding
+//*****************************************************************************
+// Every Fetch reads the next byte(s) of the instruction and counts them towards its length.
+uint8_t FetchByte(const uint64_t ip, const FileInfo_t FileInfo, Instruction_t *Instruction) {
+    return GetByteFromBin(FileInfo, ip + Instruction->Length++);
+}
+
+uint16_t FetchWord(const uint64_t ip, const FileInfo_t FileInfo, Instruction_t *Instruction) {
+    const uint16_t Word = GetWordFromBin(FileInfo, ip + Instruction->Length);
+    Instruction->Length += 2;
+    return Word;
+}
+
+// Reads the mod r/m byte plus any displacement and turns the r/m field into an operand. The reg field is left in
+// Instruction->ModRM for the caller.
+Operand_t DecodeModRM(const uint64_t ip, const FileInfo_t FileInfo, Instruction_t *Instruction) {
+    const RegMemToFromRegMod_t Mod = {FetchByte(ip, FileInfo, Instruction)};
+    Instruction->ModRM = Mod.val;
+
+    Operand_t RegMem = {OperandMemory, Mod.Fields.RegMem};
+    switch (Mod.Fields.Mode) {
+    case MemNoDispalcement:
+        if (Mod.Fields.RegMem == EffectiveAddressDirect) {
+            Instruction->Displacement = FetchWord(ip, FileInfo, Instruction);
+        }
+        break;
+    case MemByteDispalcement:
+        RegMem.Index += EffectiveAddressDisplacement;
+        Instruction->Displacement = (int8_t)FetchByte(ip, FileInfo, Instruction);
+        break;
+    case MemWordDispalcement:
+        RegMem.Index += EffectiveAddressDisplacement;
+        Instruction->Displacement = FetchWord(ip, FileInfo, Instruction);
+        break;
+    case RegisterMode:
+        RegMem.Type = OperandRegister;
+        RegMem.Index = Mod.Fields.RegMem | ((Instruction->Flags & InstWide) ? 0x8 : 0);
+        break;
+    }
+    return RegMem;
+}
+
+// Reads a byte or word immediate depending on the W bit already in Instruction->Flags.
+Operand_t DecodeImmediate(const uint64_t ip, const FileInfo_t FileInfo, Instruction_t *Instruction) {
+    if (Instruction->Flags & InstWide) {
+        Instruction->Immediate = FetchWord(ip, FileInfo, Instruction);
+        return (Operand_t){OperandImmediate, ImmediateWord};
+    }
+    Instruction->Immediate = FetchByte(ip, FileInfo, Instruction);
+    return (Operand_t){OperandImmediate, ImmediateByte};
+}
+
+Operand_t GetRegisterOperand(const uint8_t Reg, const uint8_t IsWord) {
+    return (Operand_t){OperandRegister, Reg | (IsWord << 3)};
+}
+
+//*****************************************************************************
+// Opcode Table
+//*****************************************************************************
+
+// Instructions that share an opcode byte and are picked by the reg field of the mod r/m byte. MnemonicDb marks reg
+// values that aren't defined on the 8086.
+typedef enum {
+    Group1 = 0, // 80-83 immediate arithmetic
+    Group2,     // d0-d3 shifts and rotates
+    Group3,     // f6-f7
+    Group4,     // fe
+    Group5,     // ff
+    GroupPop,   // 8f
+} OpcodeGroup_t;
+
+static const uint8_t GroupMnemonics[][8] = {
+    [Group1] = {MnemonicAdd, MnemonicOr, MnemonicAdc, MnemonicSbb, MnemonicAnd, MnemonicSub, MnemonicXor, MnemonicCmp},
+    [Group2] = {MnemonicRol, MnemonicRor, MnemonicRcl, MnemonicRcr, MnemonicShl, MnemonicShr, MnemonicDb, MnemonicSar},
+    [Group3] = {MnemonicTest, MnemonicTest, MnemonicNot, MnemonicNeg, MnemonicMul, MnemonicImul, MnemonicDiv,
+                MnemonicIdiv},
+    [Group4] = {MnemonicInc, MnemonicDec, MnemonicDb, MnemonicDb, MnemonicDb, MnemonicDb, MnemonicDb, MnemonicDb},
+    [Group5] = {MnemonicInc, MnemonicDec, MnemonicCall, MnemonicCall, MnemonicJmp, MnemonicJmp, MnemonicPush,
+                MnemonicDb},
+    [GroupPop] = {MnemonicPop, MnemonicDb, MnemonicDb, MnemonicDb, MnemonicDb, MnemonicDb, MnemonicDb, MnemonicDb},
+};
+
+// Bytes the table doesn't know about come out as a single db so the rest of the bin still decodes.
+void DecodeUnknown(const uint64_t ip, const FileInfo_t FileInfo, const OpcodeEntry_t *Entry,
+                   Instruction_t *Instruction) {
+    TimeFunction;
+    Instruction->Mnemonic = MnemonicDb;
+    Instruction->Flags &= ~(InstLock | InstRep | InstRepne | InstSegment);
+    Instruction->Length = 1;
+    Instruction->Immediate = GetByteFromBin(FileInfo, ip);
+    Instruction->Operands[0] = (Operand_t){OperandImmediate, ImmediateUnsigned};
+    Instruction->Operands[1] = (Operand_t){OperandNone, 0};
+}
+
+// mod reg r/m with the D and W bits: mov, the arithmetic/logic ops, test, xchg.
+void DecodeRegMemWithRegister(const uint64_t ip, const FileInfo_t FileInfo, const OpcodeEntry_t *Entry,
+                              Instruction_t *Instruction) {
+    TimeFunction;
+    const RegMemToFromRegOpcode_t Opcode = {Instruction->Opcode};
+    Instruction->Flags |= Opcode.Fields.Word ? InstWide : 0;
+
+    const Operand_t RegMem = DecodeModRM(ip, FileInfo, Instruction);
+    const RegMemToFromRegMod_t Mod = {Instruction->ModRM};
+    const Operand_t Register = GetRegisterOperand(Mod.Fields.Register, Opcode.Fields.Word);
+
+    // test and xchg reuse the D bit as part of the opcode
+    const uint8_t HasDirection = (Entry->Mnemonic != MnemonicTest) && (Entry->Mnemonic != MnemonicXchg);
+    if (HasDirection && Opcode.Fields.Direction) {
+        Instruction->Operands[0] = Register;
+        Instruction->Operands[1] = RegMem;
+    } else {
+        Instruction->Operands[0] = RegMem;
+        Instruction->Operands[1] = Register;
+    }
+}
+
+// lea, lds, les. Always a word register destination.
+void DecodeLoadAddress(const uint64_t ip, const FileInfo_t FileInfo, const OpcodeEntry_t *Entry,
+                       Instruction_t *Instruction) {
+    TimeFunction;
+    Instruction->Flags |= InstWide;
+    const Operand_t RegMem = DecodeModRM(ip, FileInfo, Instruction);
+    const RegMemToFromRegMod_t Mod = {Instruction->ModRM};
+    Instruction->Operands[0] = GetRegisterOperand(Mod.Fields.Register, 1);
+    Instruction->Operands[1] = RegMem;
+}
+
+// 8c and 8e, mov to and from a segment register.
+void DecodeSegmentRegMem(const uint64_t ip, const FileInfo_t FileInfo, const OpcodeEntry_t *Entry,
+                         Instruction_t *Instruction) {
+    TimeFunction;
+    Instruction->Flags |= InstWide;
+    const Operand_t RegMem = DecodeModRM(ip, FileInfo, Instruction);
+    const RegMemToFromRegMod_t Mod = {Instruction->ModRM};
+    const Operand_t Segment = {OperandSegmentRegister, Mod.Fields.Register & 0x3};
+
+    if (Instruction->Opcode & 0x2) {
+        Instruction->Operands[0] = Segment;
+        Instruction->Operands[1] = RegMem;
+    } else {
+        Instruction->Operands[0] = RegMem;
+        Instruction->Operands[1] = Segment;
+    }
+}
+
+// Immediate to register/memory: c6-c7 mov and group 1 (80-83).
+void DecodeRegMemWithImmediate(const uint64_t ip, const FileInfo_t FileInfo, const OpcodeEntry_t *Entry,
+                               Instruction_t *Instruction) {
+    TimeFunction;
+    const RegMemToFromRegOpcode_t Opcode = {Instruction->Opcode};
+    Instruction->Flags |= Opcode.Fields.Word ? InstWide : 0;
+
+    Instruction->Operands[0] = DecodeModRM(ip, FileInfo, Instruction);
+    const RegMemToFromRegMod_t Mod = {Instruction->ModRM};
+    if (Entry->Class == ClassGroup) {
+        Instruction->Mnemonic = GroupMnemonics[Entry->Mnemonic][Mod.Fields.Register];
+    }
+
+    // For group 1 the S bit sits where D is and means a byte of data is sign extended to a word
+    if ((Entry->Class == ClassGroup) && Opcode.Fields.Direction && Opcode.Fields.Word) {
+        Instruction->Immediate = (int16_t)(int8_t)FetchByte(ip, FileInfo, Instruction);
+        Instruction->Operands[1] = (Operand_t){OperandImmediate, ImmediateWord};
+    } else {
+        Instruction->Operands[1] = DecodeImmediate(ip, FileInfo, Instruction);
+    }
+}
+
+// Opcodes with a single r/m operand picked by the reg field: groups 2-5 and pop (8f).
+void DecodeRegMemGroup(const uint64_t ip, const FileInfo_t FileInfo, const OpcodeEntry_t *Entry,
+                       Instruction_t *Instruction) {
+    TimeFunction;
+    const RegMemToFromRegOpcode_t Opcode = {Instruction->Opcode};
+    Instruction->Flags |= Opcode.Fields.Word ? InstWide : 0;
+
+    Instruction->Operands[0] = DecodeModRM(ip, FileInfo, Instruction);
+    const RegMemToFromRegMod_t Mod = {Instruction->ModRM};
+    const uint8_t Reg = Mod.Fields.Register;
+    Instruction->Mnemonic = GroupMnemonics[Entry->Mnemonic][Reg];
+    if (Instruction->Mnemonic == MnemonicDb) {
+        DecodeUnknown(ip, FileInfo, Entry, Instruction);
+        return;
+    }
+
+    switch (Entry->Mnemonic) {
+    case Group2:
+        // V bit picks between shifting by 1 and by cl
+        if (Opcode.Fields.Direction) {
+            Instruction->Operands[1] = GetRegisterOperand(1, 0);
+        } else {
+            Instruction->Immediate = 1;
+            Instruction->Operands[1] = (Operand_t){OperandImmediate, ImmediateUnsigned};
+        }
+        break;
+    case Group3:
+        if (Instruction->Mnemonic == MnemonicTest) {
+            Instruction->Operands[1] = DecodeImmediate(ip, FileInfo, Instruction);
+        }
+        break;
+    case Group5:
+        // call/jmp through memory are always word sized and odd reg values are the far versions
+        if ((Instruction->Mnemonic == MnemonicCall) || (Instruction->Mnemonic == MnemonicJmp)) {
+            Instruction->Flags |= (Reg & 0x1) ? InstFar : 0;
+        }
+        break;
+    }
+}
+
+// Escape to coprocessor. The external opcode is the low 3 bits of the opcode byte and the reg field.
+void DecodeEscape(const uint64_t ip, const FileInfo_t FileInfo, const OpcodeEntry_t *Entry,
+                  Instruction_t *Instruction) {
+    TimeFunction;
+    Instruction->Flags |= InstWide;
+    Instruction->Operands[1] = DecodeModRM(ip, FileInfo, Instruction);
+    const RegMemToFromRegMod_t Mod = {Instruction->ModRM};
+    Instruction->Immediate = ((Instruction->Opcode & 0x7) << 3) | Mod.Fields.Register;
+    Instruction->Operands[0] = (Operand_t){OperandImmediate, ImmediateUnsigned};
+}
+
+// b0-bf, mov immediate to register.
+void DecodeImmediateToRegister(const uint64_t ip, const FileInfo_t FileInfo, const OpcodeEntry_t *Entry,
+                               Instruction_t *Instruction) {
+    TimeFunction;
+    const ImmediateToReg_t Opcode = {Instruction->Opcode};
+    Instruction->Flags |= Opcode.Fields.Word ? InstWide : 0;
+    Instruction->Operands[0] = GetRegisterOperand(Opcode.Fields.Reg, Opcode.Fields.Word);
+    Instruction->Operands[1] = DecodeImmediate(ip, FileInfo, Instruction);
+}
+
+// Immediate to al/ax for the arithmetic/logic ops and test.
+void DecodeImmediateToAccumulator(const uint64_t ip, const FileInfo_t FileInfo, const OpcodeEntry_t *Entry,
+                                  Instruction_t *Instruction) {
+    TimeFunction;
+    const MemoryToAccumulatorOpcode_t Opcode = {Instruction->Opcode};
+    Instruction->Flags |= Opcode.Fields.Word ? InstWide : 0;
+    Instruction->Operands[0] = GetRegisterOperand(0, Opcode.Fields.Word);
+    Instruction->Operands[1] = DecodeImmediate(ip, FileInfo, Instruction);
+}
+
+// a0-a3. Bit 1 picks the direction the same way D does but the other way around.
+void DecodeAccumulatorMemory(const uint64_t ip, const FileInfo_t FileInfo, const OpcodeEntry_t *Entry,
+                             Instruction_t *Instruction) {
+    TimeFunction;
+    const MemoryToAccumulatorOpcode_t Opcode = {Instruction->Opcode};
+    Instruction->Flags |= Opcode.Fields.Word ? InstWide : 0;
+    Instruction->Displacement = FetchWord(ip, FileInfo, Instruction);
+
+    const Operand_t Accumulator = GetRegisterOperand(0, Opcode.Fields.Word);
+    const Operand_t Memory = {OperandMemory, EffectiveAddressDirect};
+    if (Instruction->Opcode & 0x2) {
+        Instruction->Operands[0] = Memory;
+        Instruction->Operands[1] = Accumulator;
+    } else {
+        Instruction->Operands[0] = Accumulator;
+        Instruction->Operands[1] = Memory;
+    }
+}
+
+// in/out with a fixed port (e4-e7) or the port in dx (ec-ef).
+void DecodeInOut(const uint64_t ip, const FileInfo_t FileInfo, const OpcodeEntry_t *Entry, Instruction_t *Instruction) {
+    TimeFunction;
+    const MemoryToAccumulatorOpcode_t Opcode = {Instruction->Opcode};
+    Instruction->Flags |= Opcode.Fields.Word ? InstWide : 0;
+
+    const Operand_t Accumulator = GetRegisterOperand(0, Opcode.Fields.Word);
+    Operand_t Port = GetRegisterOperand(2, 1);
+    if (Entry->Layout == OperandsImm8) {
+        Instruction->Immediate = FetchByte(ip, FileInfo, Instruction);
+        Port = (Operand_t){OperandImmediate, ImmediateUnsigned};
+    }
+
+    if (Entry->Mnemonic == MnemonicOut) {
+        Instruction->Operands[0] = Port;
+        Instruction->Operands[1] = Accumulator;
+    } else {
+        Instruction->Operands[0] = Accumulator;
+        Instruction->Operands[1] = Port;
+    }
+}
+
+// inc/dec/push/pop of a word register and xchg with ax, register in the low 3 bits.
+void DecodeRegisterInOpcode(const uint64_t ip, const FileInfo_t FileInfo, const OpcodeEntry_t *Entry,
+                            Instruction_t *Instruction) {
+    TimeFunction;
+    Instruction->Flags |= InstWide;
+    const Operand_t Register = GetRegisterOperand(Instruction->Opcode & 0x7, 1);
+    if (Entry->Mnemonic == MnemonicXchg) {
+        Instruction->Operands[0] = GetRegisterOperand(0, 1);
+        Instruction->Operands[1] = Register;
+    } else {
+        Instruction->Operands[0] = Register;
+    }
+}
+
+// push/pop of a segment register, which is in bits 3-4.
+void DecodeSegmentInOpcode(const uint64_t ip, const FileInfo_t FileInfo, const OpcodeEntry_t *Entry,
+                           Instruction_t *Instruction) {
+    TimeFunction;
+    Instruction->Flags |= InstWide;
+    Instruction->Operands[0] = (Operand_t){OperandSegmentRegister, (Instruction->Opcode >> 3) & 0x3};
+}
+
+// Jumps, calls and loops relative to the end of the instruction.
+void DecodeRelative(const uint64_t ip, const FileInfo_t FileInfo, const OpcodeEntry_t *Entry,
+                    Instruction_t *Instruction) {
+    TimeFunction;
+    if (Entry->Layout == OperandsImm16) {
+        Instruction->Immediate = FetchWord(ip, FileInfo, Instruction);
+    } else {
+        Instruction->Immediate = (int16_t)(int8_t)FetchByte(ip, FileInfo, Instruction);
+    }
+    Instruction->Operands[0] = (Operand_t){OperandRelative, 0};
+}
+
+// 9a and ea, direct intersegment call/jmp.
+void DecodeFarPointer(const uint64_t ip, const FileInfo_t FileInfo, const OpcodeEntry_t *Entry,
+                      Instruction_t *Instruction) {
+    TimeFunction;
+    Instruction->Flags |= InstFar;
+    Instruction->Immediate = FetchWord(ip, FileInfo, Instruction);
+    Instruction->Segment = FetchWord(ip, FileInfo, Instruction);
+    Instruction->Operands[0] = (Operand_t){OperandFarPointer, 0};
+}
+
+// ret/retf with a stack adjustment, int, aam and aad.
+void DecodeImmediateOnly(const uint64_t ip, const FileInfo_t FileInfo, const OpcodeEntry_t *Entry,
+                         Instruction_t *Instruction) {
+    TimeFunction;
+    if (Entry->Layout == OperandsImm16) {
+        Instruction->Immediate = FetchWord(ip, FileInfo, Instruction);
+    } else {
+        Instruction->Immediate = FetchByte(ip, FileInfo, Instruction);
+    }
+    // aam and aad always carry a base of 10 that the assembler adds for us
+    if ((Entry->Mnemonic != MnemonicAam) && (Entry->Mnemonic != MnemonicAad)) {
+        Instruction->Operands[0] = (Operand_t){OperandImmediate, ImmediateUnsigned};
+    }
+}
+
+// Single byte instructions. String ops use the W bit for their size.
+void DecodeNoOperands(const uint64_t ip, const FileInfo_t FileInfo, const OpcodeEntry_t *Entry,
+                      Instruction_t *Instruction) {
+    TimeFunction;
+    if (Entry->Class == ClassString) {
+        Instruction->Flags |= (Instruction->Opcode & 0x1) ? InstWide : 0;
+    }
+}
+
+// lock, rep/repne and segment overrides. Handled by DecodeInstruction before the table lookup of the real opcode.
+void DecodePrefix(const uint64_t ip, const FileInfo_t FileInfo, const OpcodeEntry_t *Entry,
+                  Instruction_t *Instruction) {
+    TimeFunction;
+    switch (Instruction->Opcode) {
+    case 0xf0:
+        Instruction->Flags |= InstLock;
+        break;
+    case 0xf2:
+        Instruction->Flags |= InstRepne;
+        break;
+    case 0xf3:
+        Instruction->Flags |= InstRep;
+        break;
+    default:
+        Instruction->Flags |= InstSegment;
+        Instruction->SegmentOverride = (Instruction->Opcode >> 3) & 0x3;
+        break;
+    }
+}
+
+#define ALU_ENTRIES(Base, Name)                                                                                        \
+    [Base ... Base + 3] = {DecodeRegMemWithRegister, Mnemonic##Name, ClassArithmetic, OperandsModRM},                  \
+    [Base + 4] = {DecodeImmediateToAccumulator, Mnemonic##Name, ClassArithmetic, OperandsImm8},                        \
+    [Base + 5] = {DecodeImmediateToAccumulator, Mnemonic##Name, ClassArithmetic, OperandsImm16}
+
+// Table 4-12. Indexed by the first byte of an instruction so dispatch is a single load. Bytes not listed here are
+// zero initialized and have a NULL handler.
+const OpcodeEntry_t OpcodeTable[256] = {
+    ALU_ENTRIES(0x00, Add),
+    [0x06] = {DecodeSegmentInOpcode, MnemonicPush, ClassStack, OperandsNone},
+    [0x07] = {DecodeSegmentInOpcode, MnemonicPop, ClassStack, OperandsNone},
+    ALU_ENTRIES(0x08, Or),
+    [0x0e] = {DecodeSegmentInOpcode, MnemonicPush, ClassStack, OperandsNone},
+    [0x0f] = {DecodeSegmentInOpcode, MnemonicPop, ClassStack, OperandsNone},
+    ALU_ENTRIES(0x10, Adc),
+    [0x16] = {DecodeSegmentInOpcode, MnemonicPush, ClassStack, OperandsNone},
+    [0x17] = {DecodeSegmentInOpcode, MnemonicPop, ClassStack, OperandsNone},
+    ALU_ENTRIES(0x18, Sbb),
+    [0x1e] = {DecodeSegmentInOpcode, MnemonicPush, ClassStack, OperandsNone},
+    [0x1f] = {DecodeSegmentInOpcode, MnemonicPop, ClassStack, OperandsNone},
+    ALU_ENTRIES(0x20, And),
+    [0x26] = {DecodePrefix, MnemonicDb, ClassPrefix, OperandsPrefix},
+    [0x27] = {DecodeNoOperands, MnemonicDaa, ClassArithmetic, OperandsNone},
+    ALU_ENTRIES(0x28, Sub),
+    [0x2e] = {DecodePrefix, MnemonicDb, ClassPrefix, OperandsPrefix},
+    [0x2f] = {DecodeNoOperands, MnemonicDas, ClassArithmetic, OperandsNone},
+    ALU_ENTRIES(0x30, Xor),
+    [0x36] = {DecodePrefix, MnemonicDb, ClassPrefix, OperandsPrefix},
+    [0x37] = {DecodeNoOperands, MnemonicAaa, ClassArithmetic, OperandsNone},
+    ALU_ENTRIES(0x38, Cmp),
+    [0x3e] = {DecodePrefix, MnemonicDb, ClassPrefix, OperandsPrefix},
+    [0x3f] = {DecodeNoOperands, MnemonicAas, ClassArithmetic, OperandsNone},
+    [0x40 ... 0x47] = {DecodeRegisterInOpcode, MnemonicInc, ClassArithmetic, OperandsNone},
+    [0x48 ... 0x4f] = {DecodeRegisterInOpcode, MnemonicDec, ClassArithmetic, OperandsNone},
+    [0x50 ... 0x57] = {DecodeRegisterInOpcode, MnemonicPush, ClassStack, OperandsNone},
+    [0x58 ... 0x5f] = {DecodeRegisterInOpcode, MnemonicPop, ClassStack, OperandsNone},
+    [0x70] = {DecodeRelative, MnemonicJo, ClassConditionalJump, OperandsImm8},
+    [0x71] = {DecodeRelative, MnemonicJno, ClassConditionalJump, OperandsImm8},
+    [0x72] = {DecodeRelative, MnemonicJb, ClassConditionalJump, OperandsImm8},
+    [0x73] = {DecodeRelative, MnemonicJnb, ClassConditionalJump, OperandsImm8},
+    [0x74] = {DecodeRelative, MnemonicJe, ClassConditionalJump, OperandsImm8},
+    [0x75] = {DecodeRelative, MnemonicJne, ClassConditionalJump, OperandsImm8},
+    [0x76] = {DecodeRelative, MnemonicJbe, ClassConditionalJump, OperandsImm8},
+    [0x77] = {DecodeRelative, MnemonicJa, ClassConditionalJump, OperandsImm8},
+    [0x78] = {DecodeRelative, MnemonicJs, ClassConditionalJump, OperandsImm8},
+    [0x79] = {DecodeRelative, MnemonicJns, ClassConditionalJump, OperandsImm8},
+    [0x7a] = {DecodeRelative, MnemonicJp, ClassConditionalJump, OperandsImm8},
+    [0x7b] = {DecodeRelative, MnemonicJnp, ClassConditionalJump, OperandsImm8},
+    [0x7c] = {DecodeRelative, MnemonicJl, ClassConditionalJump, OperandsImm8},
+    [0x7d] = {DecodeRelative, MnemonicJnl, ClassConditionalJump, OperandsImm8},
+    [0x7e] = {DecodeRelative, MnemonicJle, ClassConditionalJump, OperandsImm8},
+    [0x7f] = {DecodeRelative, MnemonicJg, ClassConditionalJump, OperandsImm8},
+    [0x80] = {DecodeRegMemWithImmediate, Group1, ClassGroup, OperandsModRMImm8},
+    [0x81] = {DecodeRegMemWithImmediate, Group1, ClassGroup, OperandsModRMImm16},
+    [0x82] = {DecodeRegMemWithImmediate, Group1, ClassGroup, OperandsModRMImm8},
+    [0x83] = {DecodeRegMemWithImmediate, Group1, ClassGroup, OperandsModRMImm8},
+    [0x84 ... 0x85] = {DecodeRegMemWithRegister, MnemonicTest, ClassLogic, OperandsModRM},
+    [0x86 ... 0x87] = {DecodeRegMemWithRegister, MnemonicXchg, ClassMov, OperandsModRM},
+    [0x88 ... 0x8b] = {DecodeRegMemWithRegister, MnemonicMov, ClassMov, OperandsModRM},
+    [0x8c] = {DecodeSegmentRegMem, MnemonicMov, ClassMov, OperandsModRM},
+    [0x8d] = {DecodeLoadAddress, MnemonicLea, ClassMov, OperandsModRM},
+    [0x8e] = {DecodeSegmentRegMem, MnemonicMov, ClassMov, OperandsModRM},
+    [0x8f] = {DecodeRegMemGroup, GroupPop, ClassGroup, OperandsModRM},
+    [0x90] = {DecodeNoOperands, MnemonicNop, ClassControl, OperandsNone},
+    [0x91 ... 0x97] = {DecodeRegisterInOpcode, MnemonicXchg, ClassMov, OperandsNone},
+    [0x98] = {DecodeNoOperands, MnemonicCbw, ClassArithmetic, OperandsNone},
+    [0x99] = {DecodeNoOperands, MnemonicCwd, ClassArithmetic, OperandsNone},
+    [0x9a] = {DecodeFarPointer, MnemonicCall, ClassCall, OperandsFarPointer},
+    [0x9b] = {DecodeNoOperands, MnemonicWait, ClassControl, OperandsNone},
+    [0x9c] = {DecodeNoOperands, MnemonicPushf, ClassStack, OperandsNone},
+    [0x9d] = {DecodeNoOperands, MnemonicPopf, ClassStack, OperandsNone},
+    [0x9e] = {DecodeNoOperands, MnemonicSahf, ClassFlag, OperandsNone},
+    [0x9f] = {DecodeNoOperands, MnemonicLahf, ClassFlag, OperandsNone},
+    [0xa0 ... 0xa3] = {DecodeAccumulatorMemory, MnemonicMov, ClassMov, OperandsAddress16},
+    [0xa4 ... 0xa5] = {DecodeNoOperands, MnemonicMovs, ClassString, OperandsNone},
+    [0xa6 ... 0xa7] = {DecodeNoOperands, MnemonicCmps, ClassString, OperandsNone},
+    [0xa8] = {DecodeImmediateToAccumulator, MnemonicTest, ClassLogic, OperandsImm8},
+    [0xa9] = {DecodeImmediateToAccumulator, MnemonicTest, ClassLogic, OperandsImm16},
+    [0xaa ... 0xab] = {DecodeNoOperands, MnemonicStos, ClassString, OperandsNone},
+    [0xac ... 0xad] = {DecodeNoOperands, MnemonicLods, ClassString, OperandsNone},
+    [0xae ... 0xaf] = {DecodeNoOperands, MnemonicScas, ClassString, OperandsNone},
+    [0xb0 ... 0xb7] = {DecodeImmediateToRegister, MnemonicMov, ClassMov, OperandsImm8},
+    [0xb8 ... 0xbf] = {DecodeImmediateToRegister, MnemonicMov, ClassMov, OperandsImm16},
+    [0xc2] = {DecodeImmediateOnly, MnemonicRet, ClassReturn, OperandsImm16},
+    [0xc3] = {DecodeNoOperands, MnemonicRet, ClassReturn, OperandsNone},
+    [0xc4] = {DecodeLoadAddress, MnemonicLes, ClassMov, OperandsModRM},
+    [0xc5] = {DecodeLoadAddress, MnemonicLds, ClassMov, OperandsModRM},
+    [0xc6] = {DecodeRegMemWithImmediate, MnemonicMov, ClassMov, OperandsModRMImm8},
+    [0xc7] = {DecodeRegMemWithImmediate, MnemonicMov, ClassMov, OperandsModRMImm16},
+    [0xca] = {DecodeImmediateOnly, MnemonicRetf, ClassReturn, OperandsImm16},
+    [0xcb] = {DecodeNoOperands, MnemonicRetf, ClassReturn, OperandsNone},
+    [0xcc] = {DecodeNoOperands, MnemonicInt3, ClassInterrupt, OperandsNone},
+    [0xcd] = {DecodeImmediateOnly, MnemonicInt, ClassInterrupt, OperandsImm8},
+    [0xce] = {DecodeNoOperands, MnemonicInto, ClassInterrupt, OperandsNone},
+    [0xcf] = {DecodeNoOperands, MnemonicIret, ClassReturn, OperandsNone},
+    [0xd0 ... 0xd3] = {DecodeRegMemGroup, Group2, ClassGroup, OperandsModRM},
+    [0xd4] = {DecodeImmediateOnly, MnemonicAam, ClassArithmetic, OperandsImm8},
+    [0xd5] = {DecodeImmediateOnly, MnemonicAad, ClassArithmetic, OperandsImm8},
+    [0xd7] = {DecodeNoOperands, MnemonicXlat, ClassMov, OperandsNone},
+    [0xd8 ... 0xdf] = {DecodeEscape, MnemonicEsc, ClassControl, OperandsModRM},
+    [0xe0] = {DecodeRelative, MnemonicLoopnz, ClassConditionalJump, OperandsImm8},
+    [0xe1] = {DecodeRelative, MnemonicLoopz, ClassConditionalJump, OperandsImm8},
+    [0xe2] = {DecodeRelative, MnemonicLoop, ClassConditionalJump, OperandsImm8},
+    [0xe3] = {DecodeRelative, MnemonicJcxz, ClassConditionalJump, OperandsImm8},
+    [0xe4 ... 0xe5] = {DecodeInOut, MnemonicIn, ClassIO, OperandsImm8},
+    [0xe6 ... 0xe7] = {DecodeInOut, MnemonicOut, ClassIO, OperandsImm8},
+    [0xe8] = {DecodeRelative, MnemonicCall, ClassCall, OperandsImm16},
+    [0xe9] = {DecodeRelative, MnemonicJmp, ClassJump, OperandsImm16},
+    [0xea] = {DecodeFarPointer, MnemonicJmp, ClassJump, OperandsFarPointer},
+    [0xeb] = {DecodeRelative, MnemonicJmp, ClassJump, OperandsImm8},
+    [0xec ... 0xed] = {DecodeInOut, MnemonicIn, ClassIO, OperandsNone},
+    [0xee ... 0xef] = {DecodeInOut, MnemonicOut, ClassIO, OperandsNone},
+    [0xf0] = {DecodePrefix, MnemonicDb, ClassPrefix, OperandsPrefix},
+    [0xf2 ... 0xf3] = {DecodePrefix, MnemonicDb, ClassPrefix, OperandsPrefix},
+    [0xf4] = {DecodeNoOperands, MnemonicHlt, ClassControl, OperandsNone},
+    [0xf5] = {DecodeNoOperands, MnemonicCmc, ClassFlag, OperandsNone},
+    [0xf6] = {DecodeRegMemGroup, Group3, ClassGroup, OperandsGroup3Imm8},
+    [0xf7] = {DecodeRegMemGroup, Group3, ClassGroup, OperandsGroup3Imm16},
+    [0xf8] = {DecodeNoOperands, MnemonicClc, ClassFlag, OperandsNone},
+    [0xf9] = {DecodeNoOperands, MnemonicStc, ClassFlag, OperandsNone},
+    [0xfa] = {DecodeNoOperands, MnemonicCli, ClassFlag, OperandsNone},
+    [0xfb] = {DecodeNoOperands, MnemonicSti, ClassFlag, OperandsNone},
+    [0xfc] = {DecodeNoOperands, MnemonicCld, ClassFlag, OperandsNone},
+    [0xfd] = {DecodeNoOperands, MnemonicStd, ClassFlag, OperandsNone},
+    [0xfe] = {DecodeRegMemGroup, Group4, ClassGroup, OperandsModRM},
+    [0xff] = {DecodeRegMemGroup, Group5, ClassGroup, OperandsModRM},
+};
+
+#undef ALU_ENTRIES
+
+
+// Decodes the instruction starting at ip, including any prefixes, and returns its length.
+uint16_t DecodeInstruction(const uint64_t ip, const FileInfo_t FileInfo, Instruction_t *Instruction) {
+    TimeFunction;
+    memset(Instruction, 0, sizeof(*Instruction));
+
+    const OpcodeEntry_t *Entry;
+    do {
+        Instruction->Opcode = FetchByte(ip, FileInfo, Instruction);
+        Entry = &OpcodeTable[Instruction->Opcode];
+        if (Entry->Class == ClassPrefix) {
+            DecodePrefix(ip, FileInfo, Entry, Instruction);
+        }
+    } while ((Entry->Class == ClassPrefix) && (Instruction->Length <= MaxPrefixes));
+
+    // A run of more prefixes than any real instruction needs is treated as data
+    if (!Entry->Handler || (Entry->Class == ClassPrefix)) {
+        DecodeUnknown(ip, FileInfo, Entry, Instruction);
+        return Instruction->Length;
+    }
+
+    Instruction->Mnemonic = Entry->Mnemonic;
+    Entry->Handler(ip, FileInfo, Entry, Instruction);
+    return Instruction->Length;
+}
+
+InstructionClass_t GetInstructionClass(const Instruction_t *Instruction) {
+    return MnemonicClasses[Instruction->Mnemonic];
+}
+
+// Table 4-8. Number of displacement bytes that follow a mod r/m byte.
+uint16_t GetDisplacementLength(const uint8_t ModByte) {
+    const RegMemToFromRegMod_t Mod = {ModByte};
+    switch (Mod.Fields.Mode) {
+    case MemNoDispalcement:
+        return (Mod.Fields.RegMem == EffectiveAddressDirect) ? 2 : 0;
+    case MemByteDispalcement:
+        return 1;
+    case MemWordDispalcement:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+// Works out the size of an instruction from the operand layout alone. Prefixes count as their own 1 byte step.
+// Returns 0 for bytes that aren't in the table.
+uint16_t GetInstructionLength(const uint64_t ip, const OpcodeEntry_t Entry, const FileInfo_t FileInfo) {
+    switch (Entry.Layout) {
+    case OperandsNone:
+        return Entry.Handler ? 1 : 0;
+    case OperandsModRM:
+        return 2 + GetDisplacementLength(GetByteFromBin(FileInfo, ip + 1));
+    case OperandsModRMImm8:
+        return 3 + GetDisplacementLength(GetByteFromBin(FileInfo, ip + 1));
+    case OperandsModRMImm16:
+        return 4 + GetDisplacementLength(GetByteFromBin(FileInfo, ip + 1));
+    case OperandsGroup3Imm8:
+    case OperandsGroup3Imm16: {
+        const RegMemToFromRegMod_t Mod = {GetByteFromBin(FileInfo, ip + 1)};
+        const uint16_t ImmediateLength = (Mod.Fields.Register > 1) ? 0 : (Entry.Layout == OperandsGroup3Imm8) ? 1 : 2;
+        return 2 + GetDisplacementLength(Mod.val) + ImmediateLength;
+    }
+    case OperandsImm8:
+        return 2;
+    case OperandsImm16:
+    case OperandsAddress16:
+        return 3;
+    case OperandsFarPointer:
+        return 5;
+    case OperandsPrefix:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+//*****************************************************************************
+// Decoding
+//*****************************************************************************
+// Decodes every instruction that starts in [Start, End) into one contiguous array of records, assuming Start is an
+// instruction boundary. The last one may run past End. DecodedEnd, if given, gets the offset after it. The caller
+// frees the array.
+Instruction_t *DecodeRange(const FileInfo_t FileInfo, const uint64_t Start, const uint64_t End, size_t *Count,
+                           uint64_t *DecodedEnd) {
+    TimeBandwidth(__func__, End - Start);
+    // Most 8086 instructions are 2-4 bytes so this rarely has to grow
+    size_t Capacity = ((End - Start) / 2) + 1;
+    Instruction_t *Instructions = malloc(Capacity * sizeof(Instruction_t));
+    if (!Instructions) {
+        printf("[%s] ERROR: Could not malloc %lu instruction records.\n", __func__, Capacity);
+        exit(1);
+    }
+
+    size_t Used = 0;
+    uint64_t ip = Start;
+    while (ip < End) {
+        if (Used == Capacity) {
+            Capacity *= 2;
+            Instructions = realloc(Instructions, Capacity * sizeof(Instruction_t));
+            if (!Instructions) {
+                printf("[%s] ERROR: Could not grow to %lu instruction records.\n", __func__, Capacity);
+                exit(1);
+            }
+        }
+        ip += DecodeInstruction(ip, FileInfo, &Instructions[Used++]);
+    }
+
+    *Count = Used;
+    if (DecodedEnd) {
+        *DecodedEnd = ip;
+    }
+    return Instructions;
+}
+
+Instruction_t *DecodeBin(const FileInfo_t FileInfo, size_t *Count) {
+    return DecodeRange(FileInfo, 0, FileInfo.FileSize, Count, NULL);
+}
+
+//*****************************************************************************
+// Encoding
+//*****************************************************************************
+// Turns a record back into machine code, the bytes following the opcode come from its layout in Table 4-12 the same
+// way GetInstructionLength counts them. Prefixes come out once each in lock, rep, segment order, so a record decoded
+// from repeated or differently ordered prefixes encodes shorter or reordered but still decodes to the same record.
+// Bytes has to have room for MaxInstructionLength. Returns the number of bytes written.
+uint16_t EncodeInstruction(const Instruction_t *Instruction, uint8_t *Bytes) {
+    TimeFunction;
+    // db is the byte the decoder gave up on, prefix or not
+    if (Instruction->Mnemonic == MnemonicDb) {
+        Bytes[0] = Instruction->Immediate;
+        return 1;
+    }
+
+    uint16_t Length = 0;
+    if (Instruction->Flags & InstLock) {
+        Bytes[Length++] = 0xf0;
+    }
+    if (Instruction->Flags & InstRepne) {
+        Bytes[Length++] = 0xf2;
+    }
+    if (Instruction->Flags & InstRep) {
+        Bytes[Length++] = 0xf3;
+    }
+    if (Instruction->Flags & InstSegment) {
+        Bytes[Length++] = 0x26 | (Instruction->SegmentOverride << 3);
+    }
+    Bytes[Length++] = Instruction->Opcode;
+
+    const OpcodeEntry_t Entry = OpcodeTable[Instruction->Opcode];
+    uint16_t ImmediateLength = 0;
+    switch (Entry.Layout) {
+    case OperandsGroup3Imm8:
+    case OperandsGroup3Imm16:
+        // Only test carries data
+        if (((Instruction->ModRM >> 3) & 0x7) <= 1) {
+            ImmediateLength = (Entry.Layout == OperandsGroup3Imm8) ? 1 : 2;
+        }
+        // Fall through
+    case OperandsModRM:
+    case OperandsModRMImm8:
+    case OperandsModRMImm16: {
+        Bytes[Length++] = Instruction->ModRM;
+        const uint16_t DisplacementLength = GetDisplacementLength(Instruction->ModRM);
+        if (DisplacementLength) {
+            Bytes[Length++] = Instruction->Displacement;
+        }
+        if (DisplacementLength == 2) {
+            Bytes[Length++] = (uint16_t)Instruction->Displacement >> 8;
+        }
+        ImmediateLength += (Entry.Layout == OperandsModRMImm8) ? 1 : (Entry.Layout == OperandsModRMImm16) ? 2 : 0;
+        break;
+    }
+    case OperandsImm8:
+        ImmediateLength = 1;
+        break;
+    case OperandsImm16:
+        ImmediateLength = 2;
+        break;
+    case OperandsAddress16:
+        Bytes[Length++] = Instruction->Displacement;
+        Bytes[Length++] = (uint16_t)Instruction->Displacement >> 8;
+        break;
+    case OperandsFarPointer:
+        Bytes[Length++] = Instruction->Immediate;
+        Bytes[Length++] = Instruction->Immediate >> 8;
+        Bytes[Length++] = Instruction->Segment;
+        Bytes[Length++] = Instruction->Segment >> 8;
+        break;
+    }
+
+    if (ImmediateLength) {
+        Bytes[Length++] = Instruction->Immediate;
+    }
+    if (ImmediateLength == 2) {
+        Bytes[Length++] = Instruction->Immediate >> 8;
+    }
+    return Length;
+}
+
+//*****************************************************************************
+// Length Prescan
+//*****************************************************************************
+// Works out, for every byte of a range, how long the instruction would be if one started there. Nothing but the
+// opcode byte and the byte after it is needed for that, so it's done 32 positions at a time with pshufb lookups and
+// the real boundaries are found afterwards by ResolveInstructionLengths hopping from one length to the next.
+//
+// Each opcode gets a PrescanTable byte:
+//   bits 0-2  length not counting the displacement or a group 3 immediate, 0 for a prefix
+//   bit 3     mod r/m follows, Table 4-8 adds a displacement
+//   bits 4-5  size of the immediate group 3 has when reg is test (000/001)
+//   bit 7     not in the table, comes out as a 1 byte db
+// and the prescanned value is that with the displacement and immediate added in, or PrescanUnknown when the reg
+// field is one a group doesn't define.
+#define PrescanHasModRM 0x08
+#define PrescanUnknown 0x81
+#define PrescanBlockSize 32
+
+static uint8_t PrescanTable[256] __attribute__((aligned(16)));
+static uint8_t PrescanInvalidRegs[256] __attribute__((aligned(16))); // Reg values that make a group a db
+static uint8_t PrescanInvalidRows[16];                                // High nibbles with any invalid regs
+static uint8_t PrescanInvalidRowCount;
+static const uint8_t PrescanRegBits[16] __attribute__((aligned(16))) = {1, 2, 4, 8, 16, 32, 64, 128};
+
+// Built before main from the opcode table so the two can't drift apart. Read only after that.
+__attribute__((constructor)) static void BuildPrescanTables(void) {
+    for (int Opcode = 0; Opcode < 256; Opcode++) {
+        const OpcodeEntry_t Entry = OpcodeTable[Opcode];
+        static const uint8_t Lengths[] = {
+            [OperandsNone] = 1,
+            [OperandsModRM] = 2 | PrescanHasModRM,
+            [OperandsModRMImm8] = 3 | PrescanHasModRM,
+            [OperandsModRMImm16] = 4 | PrescanHasModRM,
+            [OperandsGroup3Imm8] = 2 | PrescanHasModRM | (1 << 4),
+            [OperandsGroup3Imm16] = 2 | PrescanHasModRM | (2 << 4),
+            [OperandsImm8] = 2,
+            [OperandsImm16] = 3,
+            [OperandsAddress16] = 3,
+            [OperandsFarPointer] = 5,
+            [OperandsPrefix] = 0,
+        };
+        PrescanTable[Opcode] = Entry.Handler ? Lengths[Entry.Layout] : PrescanUnknown;
+
+        if (Entry.Handler == DecodeRegMemGroup) {
+            for (int Reg = 0; Reg < 8; Reg++) {
+                PrescanInvalidRegs[Opcode] |= (GroupMnemonics[Entry.Mnemonic][Reg] == MnemonicDb) << Reg;
+            }
+        }
+    }
+    for (int Row = 0; Row < 16; Row++) {
+        uint8_t Any = 0;
+        for (int Column = 0; Column < 16; Column++) {
+            Any |= PrescanInvalidRegs[(Row << 4) | Column];
+        }
+        if (Any) {
+            PrescanInvalidRows[PrescanInvalidRowCount++] = Row;
+        }
+    }
+}
+
+void PrescanLengthsScalar(const FileInfo_t FileInfo, const uint64_t Start, const uint64_t End, uint8_t *Lengths) {
+    for (uint64_t ip = Start; ip < End; ip++) {
+        const uint8_t Opcode = FileInfo.Bin[ip];
+        // Past the end the decoder would stop with an error anyway, any length that runs off the bin will do
+        const uint8_t ModRM = ((ip + 1) < FileInfo.FileSize) ? FileInfo.Bin[ip + 1] : 0;
+        const uint8_t Table = PrescanTable[Opcode];
+        uint8_t Length = Table & 0x87;
+        if (Table & PrescanHasModRM) {
+            Length += GetDisplacementLength(ModRM);
+            Length += (ModRM & 0x30) ? 0 : (Table >> 4) & 0x3;
+            Length = (PrescanInvalidRegs[Opcode] & PrescanRegBits[(ModRM >> 3) & 0x7]) ? PrescanUnknown : Length;
+        }
+        Lengths[ip - Start] = Length;
+    }
+}
+
+__attribute__((target("ssse3"))) void PrescanLengthsSsse3(const FileInfo_t FileInfo, const uint64_t Start,
+                                                           const uint64_t End, uint8_t *Lengths) {
+    const __m128i LowNibble = _mm_set1_epi8(0x0f);
+    const __m128i RegBits = _mm_load_si128((const __m128i *)PrescanRegBits);
+    uint64_t ip = Start;
+    // One bounds check per block. The mod r/m load reads a byte past the block so the last block leaves room for it.
+    for (; ((ip + PrescanBlockSize) <= End) && ((ip + PrescanBlockSize) < FileInfo.FileSize); ip += PrescanBlockSize) {
+        for (int Half = 0; Half < PrescanBlockSize; Half += 16) {
+            const __m128i Opcode = _mm_loadu_si128((const __m128i *)(FileInfo.Bin + ip + Half));
+            const __m128i ModRM = _mm_loadu_si128((const __m128i *)(FileInfo.Bin + ip + Half + 1));
+            const __m128i Low = _mm_and_si128(Opcode, LowNibble);
+            const __m128i High = _mm_and_si128(_mm_srli_epi16(Opcode, 4), LowNibble);
+
+            // 256 entry lookup as 16 row lookups, each kept only where the high nibble picks that row
+            __m128i Table = _mm_setzero_si128();
+            for (int Row = 0; Row < 16; Row++) {
+                const __m128i Entries = _mm_load_si128((const __m128i *)(PrescanTable + (Row << 4)));
+                const __m128i InRow = _mm_cmpeq_epi8(High, _mm_set1_epi8(Row));
+                Table = _mm_or_si128(Table, _mm_and_si128(InRow, _mm_shuffle_epi8(Entries, Low)));
+            }
+            __m128i InvalidRegs = _mm_setzero_si128();
+            for (int i = 0; i < PrescanInvalidRowCount; i++) {
+                const int Row = PrescanInvalidRows[i];
+                const __m128i Entries = _mm_load_si128((const __m128i *)(PrescanInvalidRegs + (Row << 4)));
+                const __m128i InRow = _mm_cmpeq_epi8(High, _mm_set1_epi8(Row));
+                InvalidRegs = _mm_or_si128(InvalidRegs, _mm_and_si128(InRow, _mm_shuffle_epi8(Entries, Low)));
+            }
+
+            // Table 4-8: mod 01 is a byte, mod 10 and mod 00 r/m 110 are a word
+            const __m128i Mod = _mm_and_si128(ModRM, _mm_set1_epi8(0xc0));
+            const __m128i ByteDisplacement = _mm_cmpeq_epi8(Mod, _mm_set1_epi8(0x40));
+            const __m128i WordDisplacement = _mm_or_si128(
+                _mm_cmpeq_epi8(Mod, _mm_set1_epi8(0x80)),
+                _mm_cmpeq_epi8(_mm_and_si128(ModRM, _mm_set1_epi8(0xc7)), _mm_set1_epi8(EffectiveAddressDirect)));
+            const __m128i HasModRM = _mm_cmpeq_epi8(_mm_and_si128(Table, _mm_set1_epi8(PrescanHasModRM)),
+                                                    _mm_set1_epi8(PrescanHasModRM));
+            const __m128i Displacement =
+                _mm_and_si128(HasModRM, _mm_or_si128(_mm_and_si128(ByteDisplacement, _mm_set1_epi8(1)),
+                                                     _mm_and_si128(WordDisplacement, _mm_set1_epi8(2))));
+            const __m128i IsTest = _mm_cmpeq_epi8(_mm_and_si128(ModRM, _mm_set1_epi8(0x30)), _mm_setzero_si128());
+            const __m128i Immediate =
+                _mm_and_si128(IsTest, _mm_and_si128(_mm_srli_epi16(Table, 4), _mm_set1_epi8(0x3)));
+            const __m128i Length = _mm_add_epi8(_mm_and_si128(Table, _mm_set1_epi8(0x87)),
+                                                _mm_add_epi8(Displacement, Immediate));
+
+            const __m128i Reg = _mm_and_si128(_mm_srli_epi16(ModRM, 3), _mm_set1_epi8(0x7));
+            const __m128i Invalid = _mm_xor_si128(
+                _mm_cmpeq_epi8(_mm_and_si128(InvalidRegs, _mm_shuffle_epi8(RegBits, Reg)), _mm_setzero_si128()),
+                _mm_set1_epi8(-1));
+            const __m128i Result = _mm_or_si128(_mm_andnot_si128(Invalid, Length),
+                                                _mm_and_si128(Invalid, _mm_set1_epi8(PrescanUnknown)));
+            _mm_storeu_si128((__m128i *)(Lengths + (ip - Start) + Half), Result);
+        }
+    }
+    PrescanLengthsScalar(FileInfo, ip, End, Lengths + (ip - Start));
+}
+
+__attribute__((target("avx2"))) void PrescanLengthsAvx2(const FileInfo_t FileInfo, const uint64_t Start,
+                                                         const uint64_t End, uint8_t *Lengths) {
+    const __m256i LowNibble = _mm256_set1_epi8(0x0f);
+    const __m256i RegBits = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)PrescanRegBits));
+    uint64_t ip = Start;
+    for (; ((ip + PrescanBlockSize) <= End) && ((ip + PrescanBlockSize) < FileInfo.FileSize); ip += PrescanBlockSize) {
+        const __m256i Opcode = _mm256_loadu_si256((const __m256i *)(FileInfo.Bin + ip));
+        const __m256i ModRM = _mm256_loadu_si256((const __m256i *)(FileInfo.Bin + ip + 1));
+        const __m256i Low = _mm256_and_si256(Opcode, LowNibble);
+        const __m256i High = _mm256_and_si256(_mm256_srli_epi16(Opcode, 4), LowNibble);
+
+        // pshufb only looks within each 128 bit lane, so every row goes into both
+        __m256i Table = _mm256_setzero_si256();
+        for (int Row = 0; Row < 16; Row++) {
+            const __m256i Entries =
+                _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)(PrescanTable + (Row << 4))));
+            const __m256i InRow = _mm256_cmpeq_epi8(High, _mm256_set1_epi8(Row));
+            Table = _mm256_or_si256(Table, _mm256_and_si256(InRow, _mm256_shuffle_epi8(Entries, Low)));
+        }
+        __m256i InvalidRegs = _mm256_setzero_si256();
+        for (int i = 0; i < PrescanInvalidRowCount; i++) {
+            const int Row = PrescanInvalidRows[i];
+            const __m256i Entries =
+                _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)(PrescanInvalidRegs + (Row << 4))));
+            const __m256i InRow = _mm256_cmpeq_epi8(High, _mm256_set1_epi8(Row));
+            InvalidRegs = _mm256_or_si256(InvalidRegs, _mm256_and_si256(InRow, _mm256_shuffle_epi8(Entries, Low)));
+        }
+
+        const __m256i Mod = _mm256_and_si256(ModRM, _mm256_set1_epi8(0xc0));
+        const __m256i ByteDisplacement = _mm256_cmpeq_epi8(Mod, _mm256_set1_epi8(0x40));
+        const __m256i Direct =
+            _mm256_cmpeq_epi8(_mm256_and_si256(ModRM, _mm256_set1_epi8(0xc7)), _mm256_set1_epi8(EffectiveAddressDirect));
+        const __m256i WordDisplacement = _mm256_or_si256(_mm256_cmpeq_epi8(Mod, _mm256_set1_epi8(0x80)), Direct);
+        const __m256i HasModRM = _mm256_cmpeq_epi8(_mm256_and_si256(Table, _mm256_set1_epi8(PrescanHasModRM)),
+                                                   _mm256_set1_epi8(PrescanHasModRM));
+        const __m256i Displacement =
+            _mm256_and_si256(HasModRM, _mm256_or_si256(_mm256_and_si256(ByteDisplacement, _mm256_set1_epi8(1)),
+                                                       _mm256_and_si256(WordDisplacement, _mm256_set1_epi8(2))));
+        const __m256i IsTest =
+            _mm256_cmpeq_epi8(_mm256_and_si256(ModRM, _mm256_set1_epi8(0x30)), _mm256_setzero_si256());
+        const __m256i Immediate =
+            _mm256_and_si256(IsTest, _mm256_and_si256(_mm256_srli_epi16(Table, 4), _mm256_set1_epi8(0x3)));
+        const __m256i Length = _mm256_add_epi8(_mm256_and_si256(Table, _mm256_set1_epi8(0x87)),
+                                               _mm256_add_epi8(Displacement, Immediate));
+
+        const __m256i Reg = _mm256_and_si256(_mm256_srli_epi16(ModRM, 3), _mm256_set1_epi8(0x7));
+        const __m256i Valid = _mm256_cmpeq_epi8(_mm256_and_si256(InvalidRegs, _mm256_shuffle_epi8(RegBits, Reg)),
+                                                _mm256_setzero_si256());
+        const __m256i Result = _mm256_blendv_epi8(_mm256_set1_epi8(PrescanUnknown), Length, Valid);
+        _mm256_storeu_si256((__m256i *)(Lengths + (ip - Start)), Result);
+    }
+    PrescanLengthsScalar(FileInfo, ip, End, Lengths + (ip - Start));
+}
+
+// Lengths needs room for End - Start values.
+void PrescanLengths(const FileInfo_t FileInfo, const uint64_t Start, const uint64_t End, uint8_t *Lengths) {
+    TimeBandwidth(__func__, End - Start);
+    if (__builtin_cpu_supports("avx2")) {
+        PrescanLengthsAvx2(FileInfo, Start, End, Lengths);
+    } else if (__builtin_cpu_supports("ssse3")) {
+        PrescanLengthsSsse3(FileInfo, Start, End, Lengths);
+    } else {
+        PrescanLengthsScalar(FileInfo, Start, End, Lengths);
+    }
+}
+
+// Walks the prescanned lengths from the first byte the way DecodeInstruction would, folding prefixes into the
+// instruction after them, and overwrites the front of Lengths with the length of each instruction in turn. Writes
+// never get ahead of reads since every instruction is at least a byte. Stops early at an instruction that would run
+// off the end. Returns the number of instructions, ResolvedSize gets the offset after the last one.
+uint64_t ResolveInstructionLengths(uint8_t *Lengths, const uint64_t Size, uint64_t *ResolvedSize) {
+    TimeBandwidth(__func__, Size);
+    uint64_t Count = 0;
+    uint64_t ip = 0;
+    while (ip < Size) {
+        uint64_t Prefixes = 0;
+        while (((ip + Prefixes) < Size) && !Lengths[ip + Prefixes] && (Prefixes <= MaxPrefixes)) {
+            Prefixes++;
+        }
+        uint64_t Length = 1;
+        if (Prefixes <= MaxPrefixes) {
+            if ((ip + Prefixes) == Size) {
+                break;
+            }
+            const uint8_t Prescanned = Lengths[ip + Prefixes];
+            Length = (Prescanned & 0x80) ? 1 : Prefixes + Prescanned;
+        }
+        if ((ip + Length) > Size) {
+            break;
+        }
+        Lengths[Count++] = Length;
+        ip += Length;
+    }
+    *ResolvedSize = ip;
+    return Count;
+}
+
+//*****************************************************************************
+// Clock Estimates
+//*****************************************************************************
+// Table 2-20. Index is the OperandMemory index, so 6 is a direct address and 8-15 carry a displacement.
+uint8_t GetEffectiveAddressClocks(const Instruction_t *Instruction, const Operand_t Operand) {
+    static const uint8_t Clocks[16] = {7, 8, 8, 7, 5, 5, 6, 5, 11, 12, 12, 11, 9, 9, 9, 9};
+    return Clocks[Operand.Index] + ((Instruction->Flags & InstSegment) ? 2 : 0);
+}
+
+// Table 2-21. Transfers only counts word reads/writes through the memory operand or the string addresses, stack
+// traffic is assumed to be aligned.
+InstructionClocks_t GetInstructionClocks(const Instruction_t *Instruction) {
+    const Operand_t Destination = Instruction->Operands[0];
+    const Operand_t Source = Instruction->Operands[1];
+    const int ToMemory = Destination.Type == OperandMemory;
+    const int FromMemory = Source.Type == OperandMemory;
+    const int FromImmediate = Source.Type == OperandImmediate;
+    const int Wide = Instruction->Flags & InstWide;
+
+    InstructionClocks_t Clocks = {0};
+    if (ToMemory || FromMemory) {
+        Clocks.EffectiveAddress = GetEffectiveAddressClocks(Instruction, ToMemory ? Destination : Source);
+    }
+
+    switch (Instruction->Mnemonic) {
+    case MnemonicMov:
+        if ((Instruction->Opcode & 0xfc) == 0xa0) {
+            // The accumulator forms have the address built in
+            Clocks.Base = 10;
+            Clocks.EffectiveAddress = 0;
+        } else if (FromImmediate) {
+            Clocks.Base = ToMemory ? 10 : 4;
+        } else {
+            Clocks.Base = ToMemory ? 9 : FromMemory ? 8 : 2;
+        }
+        Clocks.Transfers = ToMemory || FromMemory;
+        break;
+    case MnemonicAdd:
+    case MnemonicAdc:
+    case MnemonicSub:
+    case MnemonicSbb:
+    case MnemonicAnd:
+    case MnemonicOr:
+    case MnemonicXor:
+    case MnemonicCmp: {
+        // cmp only reads its destination so it skips the write back
+        const int Compare = Instruction->Mnemonic == MnemonicCmp;
+        if (FromImmediate) {
+            Clocks.Base = ToMemory ? (Compare ? 10 : 17) : 4;
+        } else {
+            Clocks.Base = ToMemory ? (Compare ? 9 : 16) : FromMemory ? 9 : 3;
+        }
+        Clocks.Transfers = ToMemory ? (Compare ? 1 : 2) : FromMemory;
+        break;
+    }
+    case MnemonicTest:
+        if (FromImmediate) {
+            Clocks.Base = ToMemory ? 11 : ((Instruction->Opcode & 0xfe) == 0xa8) ? 4 : 5;
+        } else {
+            Clocks.Base = (ToMemory || FromMemory) ? 9 : 3;
+        }
+        Clocks.Transfers = ToMemory || FromMemory;
+        break;
+    case MnemonicInc:
+    case MnemonicDec:
+        Clocks.Base = ToMemory ? 15 : ((Instruction->Opcode & 0xf0) == 0x40) ? 2 : 3;
+        Clocks.Transfers = ToMemory ? 2 : 0;
+        break;
+    case MnemonicNeg:
+    case MnemonicNot:
+        Clocks.Base = ToMemory ? 16 : 3;
+        Clocks.Transfers = ToMemory ? 2 : 0;
+        break;
+    case MnemonicShl:
+    case MnemonicShr:
+    case MnemonicSar:
+    case MnemonicRol:
+    case MnemonicRor:
+    case MnemonicRcl:
+    case MnemonicRcr:
+        if (Source.Type == OperandRegister) {
+            Clocks.Base = ToMemory ? 20 : 8;
+            Clocks.PerRepetition = 4;
+        } else {
+            Clocks.Base = ToMemory ? 15 : 2;
+        }
+        Clocks.Transfers = ToMemory ? 2 : 0;
+        break;
+    case MnemonicMul:
+        Clocks.Base = (Wide ? 118 : 70) + (ToMemory ? 6 : 0);
+        Clocks.Transfers = ToMemory;
+        break;
+    case MnemonicImul:
+        Clocks.Base = (Wide ? 128 : 80) + (ToMemory ? 6 : 0);
+        Clocks.Transfers = ToMemory;
+        break;
+    case MnemonicDiv:
+        Clocks.Base = (Wide ? 144 : 80) + (ToMemory ? 6 : 0);
+        Clocks.Transfers = ToMemory;
+        break;
+    case MnemonicIdiv:
+        Clocks.Base = (Wide ? 165 : 101) + (ToMemory ? 6 : 0);
+        Clocks.Transfers = ToMemory;
+        break;
+    case MnemonicPush:
+        Clocks.Base = ToMemory ? 16 : (Destination.Type == OperandSegmentRegister) ? 10 : 11;
+        Clocks.Transfers = ToMemory;
+        break;
+    case MnemonicPop:
+        Clocks.Base = ToMemory ? 17 : 8;
+        Clocks.Transfers = ToMemory;
+        break;
+    case MnemonicXchg:
+        Clocks.Base = (ToMemory || FromMemory) ? 17 : ((Instruction->Opcode & 0xf8) == 0x90) ? 3 : 4;
+        Clocks.Transfers = (ToMemory || FromMemory) ? 2 : 0;
+        break;
+    case MnemonicLea:
+        Clocks.Base = 2;
+        break;
+    case MnemonicLds:
+    case MnemonicLes:
+        Clocks.Base = 16;
+        Clocks.Transfers = 2;
+        break;
+    case MnemonicXlat:
+        Clocks.Base = 11;
+        break;
+    case MnemonicLahf:
+    case MnemonicSahf:
+    case MnemonicAaa:
+    case MnemonicAas:
+    case MnemonicDaa:
+    case MnemonicDas:
+        Clocks.Base = 4;
+        break;
+    case MnemonicPushf:
+        Clocks.Base = 10;
+        break;
+    case MnemonicPopf:
+        Clocks.Base = 8;
+        break;
+    case MnemonicIn:
+    case MnemonicOut:
+        Clocks.Base = ((Destination.Type == OperandImmediate) || FromImmediate) ? 10 : 8;
+        break;
+    case MnemonicAam:
+        Clocks.Base = 83;
+        break;
+    case MnemonicAad:
+        Clocks.Base = 60;
+        break;
+    case MnemonicCbw:
+        Clocks.Base = 2;
+        break;
+    case MnemonicCwd:
+        Clocks.Base = 5;
+        break;
+    case MnemonicMovs:
+    case MnemonicCmps:
+    case MnemonicScas:
+    case MnemonicLods:
+    case MnemonicStos: {
+        // Single and per repetition clocks for movs cmps scas lods stos
+        static const uint8_t Single[] = {18, 22, 15, 12, 11};
+        static const uint8_t Repeated[] = {17, 22, 15, 13, 10};
+        const int String = Instruction->Mnemonic - MnemonicMovs;
+        if (Instruction->Flags & (InstRep | InstRepne)) {
+            Clocks.Base = 9;
+            Clocks.PerRepetition = Repeated[String];
+        } else {
+            Clocks.Base = Single[String];
+        }
+        Clocks.Transfers = ((Instruction->Mnemonic == MnemonicMovs) || (Instruction->Mnemonic == MnemonicCmps)) ? 2 : 1;
+        break;
+    }
+    case MnemonicCall:
+        if (Destination.Type == OperandRelative) {
+            Clocks.Base = 19;
+        } else if (Destination.Type == OperandFarPointer) {
+            Clocks.Base = 28;
+        } else if (ToMemory) {
+            Clocks.Base = (Instruction->Flags & InstFar) ? 37 : 21;
+            Clocks.Transfers = (Instruction->Flags & InstFar) ? 2 : 1;
+        } else {
+            Clocks.Base = 16;
+        }
+        break;
+    case MnemonicJmp:
+        if ((Destination.Type == OperandRelative) || (Destination.Type == OperandFarPointer)) {
+            Clocks.Base = 15;
+        } else if (ToMemory) {
+            Clocks.Base = (Instruction->Flags & InstFar) ? 24 : 18;
+            Clocks.Transfers = (Instruction->Flags & InstFar) ? 2 : 1;
+        } else {
+            Clocks.Base = 11;
+        }
+        break;
+    case MnemonicRet:
+        Clocks.Base = (Destination.Type == OperandImmediate) ? 12 : 8;
+        break;
+    case MnemonicRetf:
+        Clocks.Base = (Destination.Type == OperandImmediate) ? 17 : 18;
+        break;
+    case MnemonicJo ... MnemonicJg:
+        Clocks.Base = 4;
+        Clocks.Taken = 16;
+        break;
+    case MnemonicLoop:
+        Clocks.Base = 5;
+        Clocks.Taken = 17;
+        break;
+    case MnemonicLoopz:
+        Clocks.Base = 6;
+        Clocks.Taken = 18;
+        break;
+    case MnemonicLoopnz:
+        Clocks.Base = 5;
+        Clocks.Taken = 19;
+        break;
+    case MnemonicJcxz:
+        Clocks.Base = 6;
+        Clocks.Taken = 18;
+        break;
+    case MnemonicInt:
+        Clocks.Base = 51;
+        break;
+    case MnemonicInt3:
+        Clocks.Base = 52;
+        break;
+    case MnemonicInto:
+        Clocks.Base = 4;
+        Clocks.Taken = 53;
+        break;
+    case MnemonicIret:
+        Clocks.Base = 24;
+        break;
+    case MnemonicNop:
+    case MnemonicWait:
+        Clocks.Base = 3;
+        break;
+    case MnemonicEsc:
+        Clocks.Base = FromMemory ? 8 : 2;
+        break;
+    case MnemonicDb:
+        break;
+    default:
+        // Flag operations and hlt
+        Clocks.Base = 2;
+        break;
+    }
+
+    // lock is a 2 clock prefix of its own. Byte operands never pay the odd address penalty.
+    if (Instruction->Flags & InstLock) {
+        Clocks.Base += 2;
+    }
+    if (!Wide) {
+        Clocks.Transfers = 0;
+    }
+    return Clocks;
+}
+
+// Whether the memory operand is a direct address that is odd. Anything register based can only be known at run time.
+int HasOddDirectAddress(const Instruction_t *Instruction) {
+    for (int i = 0; i < 2; i++) {
+        if ((Instruction->Operands[i].Type == OperandMemory) &&
+            (Instruction->Operands[i].Index == EffectiveAddressDirect)) {
+            return Instruction->Displacement & 0x1;
+        }
+    }
+    return 0;
+}
+
+//*****************************************************************************
+// Formatting
+//*****************************************************************************
+// Operand and mnemonic text is put together once at startup from the Get*Str functions. FormatInstruction copies
+// each piece out in one fixed size move and then advances by the real length, so only displacement and immediate
+// digits get produced per instruction. The moves can write past the end of the text but never further than
+// MaxInstructionTextLength past where the instruction started, which is what every output buffer leaves room for.
+#define MemoryTextWidth 32
+#define MnemonicTextWidth 8
+#define MemorySizeCount 4    // No keyword, byte, word, far
+#define MemorySegmentCount 5 // No override, then es, cs, ss, ds
+#define MemoryTextCount (MemorySizeCount * MemorySegmentCount * 16)
+
+// "word [es:bx + si + " up to where the displacement goes, or the whole operand when there isn't one
+typedef struct {
+    char Text[MemoryTextWidth - 1];
+    uint8_t Length;
+} MemoryText_t;
+
+typedef struct {
+    char Text[MnemonicTextWidth - 1];
+    uint8_t Length;
+} MnemonicText_t;
+
+static MemoryText_t MemoryTexts[MemoryTextCount] __attribute__((aligned(MemoryTextWidth)));
+static MnemonicText_t MnemonicTexts[MnemonicCount] __attribute__((aligned(MnemonicTextWidth)));
+static char RegisterTexts[16][2];
+static char SegmentRegisterTexts[4][2];
+
+_Static_assert(sizeof(MemoryText_t) == MemoryTextWidth, "Memory text is copied MemoryTextWidth bytes at a time");
+_Static_assert(sizeof(MnemonicText_t) == MnemonicTextWidth, "Mnemonic text is copied MnemonicTextWidth at a time");
+
+uint32_t GetMemoryTextIndex(const Instruction_t *Instruction, const Operand_t Operand, const uint8_t NeedsSize) {
+    uint32_t Size = NeedsSize ? (1 + !!(Instruction->Flags & InstWide)) : 0;
+    Size = (Instruction->Flags & InstFar) ? 3 : Size;
+    const uint32_t Segment = (Instruction->Flags & InstSegment) ? (1 + Instruction->SegmentOverride) : 0;
+    return (((Size * MemorySegmentCount) + Segment) << 4) | Operand.Index;
+}
+
+__attribute__((constructor)) static void BuildTextTables(void) {
+    static const char *const SizeStrs[MemorySizeCount] = {"", "byte ", "word ", "far "};
+    for (uint32_t Size = 0; Size < MemorySizeCount; Size++) {
+        for (uint32_t Segment = 0; Segment < MemorySegmentCount; Segment++) {
+            for (uint32_t Index = 0; Index < 16; Index++) {
+                MemoryText_t *Entry = &MemoryTexts[(((Size * MemorySegmentCount) + Segment) << 4) | Index];
+                char Text[64];
+                int Length;
+                const char *Segments = Segment ? GetSegmentRegisterStr(Segment - 1) : "";
+                const char *Colon = Segment ? ":" : "";
+                if (Index == EffectiveAddressDirect) {
+                    Length = snprintf(Text, sizeof(Text), "%s[%s%s", SizeStrs[Size], Segments, Colon);
+                } else if (Index < EffectiveAddressDisplacement) {
+                    Length = snprintf(Text, sizeof(Text), "%s[%s%s%s]", SizeStrs[Size], Segments, Colon,
+                                      GetEffectiveAddressStr(Index));
+                } else {
+                    Length = snprintf(Text, sizeof(Text), "%s[%s%s%s + ", SizeStrs[Size], Segments, Colon,
+                                      GetDisplacementEffectiveAddressStr(Index - EffectiveAddressDisplacement));
+                }
+                memcpy(Entry->Text, Text, Length);
+                Entry->Length = Length;
+            }
+        }
+    }
+    for (int Mnemonic = 0; Mnemonic < MnemonicCount; Mnemonic++) {
+        const size_t Length = strlen(MnemonicStrs[Mnemonic]);
+        memcpy(MnemonicTexts[Mnemonic].Text, MnemonicStrs[Mnemonic], Length);
+        MnemonicTexts[Mnemonic].Length = Length;
+    }
+    for (int Index = 0; Index < 16; Index++) {
+        memcpy(RegisterTexts[Index], GetRegisterStr(Index & 0x7, Index >> 3), 2);
+    }
+    for (int Index = 0; Index < 4; Index++) {
+        memcpy(SegmentRegisterTexts[Index], GetSegmentRegisterStr(Index), 2);
+    }
+}
+
+OutputBuffer_t CreateOutputBuffer(const size_t InstructionCount) {
+    const size_t Size = (InstructionCount * MaxInstructionTextLength) + 1;
+    char *Data = malloc(Size);
+    if (!Data) {
+        printf("[%s] ERROR: Could not malloc %lu bytes for output.\n", __func__, Size);
+        exit(1);
+    }
+    OutputBuffer_t Output = {Data, 0, Size};
+    return Output;
+}
+
+// The buffer is sized up front for every instruction so none of the Append functions check for space.
+void AppendChar(OutputBuffer_t *Output, const char Char) { Output->Data[Output->Used++] = Char; }
+
+void AppendStr(OutputBuffer_t *Output, const char *Str) {
+    while (*Str) {
+        Output->Data[Output->Used++] = *Str++;
+    }
+}
+
+void AppendUnsigned(OutputBuffer_t *Output, uint64_t Value) {
+    // Digits come out backwards so build them at the end of a scratch buffer
+    char Digits[20];
+    char *Start = Digits + sizeof(Digits);
+    do {
+        *--Start = '0' + (Value % 10);
+        Value /= 10;
+    } while (Value);
+
+    const size_t Length = (Digits + sizeof(Digits)) - Start;
+    memcpy(Output->Data + Output->Used, Start, Length);
+    Output->Used += Length;
+}
+
+void AppendSigned(OutputBuffer_t *Output, const int32_t Value) {
+    if (Value < 0) {
+        AppendChar(Output, '-');
+        AppendUnsigned(Output, -(int64_t)Value);
+    } else {
+        AppendUnsigned(Output, Value);
+    }
+}
+
+// Writes everything that has been formatted in one go.
+void FlushOutput(OutputBuffer_t *Output, const int Fd) {
+    TimeBandwidth(__func__, Output->Used);
+    // Anything printed through stdio has to land before the buffer does
+    fflush(stdout);
+
+    size_t Written = 0;
+    while (Written < Output->Used) {
+        const ssize_t Result = write(Fd, Output->Data + Written, Output->Used - Written);
+        if (Result < 0) {
+            printf("[%s] ERROR: Could not write output.\n", __func__);
+            exit(1);
+        }
+        Written += Result;
+    }
+    Output->Used = 0;
+}
+
+void FormatOperand(OutputBuffer_t *Output, const Instruction_t *Instruction, const Operand_t Operand,
+                   const uint8_t NeedsSize) {
+    char *Out = Output->Data + Output->Used;
+    switch (Operand.Type) {
+    case OperandRegister:
+        memcpy(Out, RegisterTexts[Operand.Index & 0xf], 2);
+        Output->Used += 2;
+        break;
+    case OperandSegmentRegister:
+        memcpy(Out, SegmentRegisterTexts[Operand.Index & 0x3], 2);
+        Output->Used += 2;
+        break;
+    case OperandMemory: {
+        const MemoryText_t *Text = &MemoryTexts[GetMemoryTextIndex(Instruction, Operand, NeedsSize)];
+        memcpy(Out, Text->Text, MemoryTextWidth);
+        Output->Used += Text->Length;
+        if (Operand.Index == EffectiveAddressDirect) {
+            AppendUnsigned(Output, (uint16_t)Instruction->Displacement);
+            AppendChar(Output, ']');
+        } else if (Operand.Index >= EffectiveAddressDisplacement) {
+            AppendSigned(Output, Instruction->Displacement);
+            AppendChar(Output, ']');
+        }
+        break;
+    }
+    case OperandImmediate:
+        if (Operand.Index == ImmediateByte) {
+            AppendSigned(Output, (int8_t)Instruction->Immediate);
+        } else if (Operand.Index == ImmediateWord) {
+            AppendSigned(Output, (int16_t)Instruction->Immediate);
+        } else {
+            AppendUnsigned(Output, Instruction->Immediate);
+        }
+        break;
+    case OperandRelative: {
+        // nasm's $ is the start of the instruction, the offset is from the end
+        const int32_t Offset = (int16_t)Instruction->Immediate + Instruction->Length;
+        AppendStr(Output, (Offset < 0) ? "$" : "$+");
+        AppendSigned(Output, Offset);
+        break;
+    }
+    case OperandFarPointer:
+        AppendUnsigned(Output, Instruction->Segment);
+        AppendChar(Output, ':');
+        AppendUnsigned(Output, Instruction->Immediate);
+        break;
+    }
+}
+
+void FormatInstruction(OutputBuffer_t *Output, const Instruction_t *Instruction) {
+    TimeFunction;
+    if (Instruction->Flags & InstLock) {
+        AppendStr(Output, "lock ");
+    }
+    if (Instruction->Flags & InstRep) {
+        AppendStr(Output, "rep ");
+    } else if (Instruction->Flags & InstRepne) {
+        AppendStr(Output, "repne ");
+    }
+    // A memory operand prints the override inside its brackets. String ops and xlat have no operand to carry it, so
+    // it goes ahead of the mnemonic the way nasm takes it.
+    const Operand_t *Operands = Instruction->Operands;
+    if ((Instruction->Flags & InstSegment) && (Operands[0].Type != OperandMemory) &&
+        (Operands[1].Type != OperandMemory)) {
+        memcpy(Output->Data + Output->Used, SegmentRegisterTexts[Instruction->SegmentOverride & 0x3], 2);
+        Output->Used += 2;
+        AppendChar(Output, ' ');
+    }
+
+    const MnemonicText_t *Mnemonic = &MnemonicTexts[Instruction->Mnemonic];
+    memcpy(Output->Data + Output->Used, Mnemonic->Text, MnemonicTextWidth);
+    Output->Used += Mnemonic->Length;
+    if (GetInstructionClass(Instruction) == ClassString) {
+        AppendChar(Output, (Instruction->Flags & InstWide) ? 'w' : 'b');
+    }
+
+    // A memory operand needs a size when nothing else in the instruction gives one. Shift counts don't count.
+    const uint8_t HasRegister = ((Operands[0].Type == OperandRegister) || (Operands[1].Type == OperandRegister) ||
+                                 (Operands[0].Type == OperandSegmentRegister) ||
+                                 (Operands[1].Type == OperandSegmentRegister)) &&
+                                (GetInstructionClass(Instruction) != ClassShift);
+    for (int i = 0; (i < 2) && (Operands[i].Type != OperandNone); i++) {
+        AppendStr(Output, i ? ", " : " ");
+        FormatOperand(Output, Instruction, Operands[i], !HasRegister);
+    }
+    AppendChar(Output, '\n');
+}
+
+//*****************************************************************************
+// Legacy Dispatch
+//*****************************************************************************
+// The mask/compare chain main() used before the opcode table existed. It only knows the mov encodings and is only
+// kept so the benchmark has something to compare against.
+OpcodeEntry_t DispatchByMaskChain(const uint8_t OpcodeByte) {
+    // Table 4-12
+    const uint8_t ImmediateToRegisterMask = 0xf0;
+    const uint8_t ImmediateToRegisterOpcode = 0xb0;
+    const uint8_t RegisterMemToFromRegisterMask = 0xfc;
+    const uint8_t RegisterMemToFromRegisterOpcode = 0x88;
+    const uint8_t ImmediateToRegisterMemMask = 0xfe;
+    const uint8_t ImmediateToRegisterMemOpcode = 0xc6;
+    const uint8_t MemoryToAccumulatorMask = 0xfe;
+    const uint8_t MemoryToAccumulatorOpcode = 0xa0;
+    const uint8_t AccumulatorToMemoryMask = 0xfe;
+    const uint8_t AccumulatorToMemoryOpcode = 0xa2;
+
+    OpcodeEntry_t Entry = {NULL, MnemonicDb, ClassInvalid, OperandsNone};
+    if ((OpcodeByte & ImmediateToRegisterMask) == ImmediateToRegisterOpcode) {
+        Entry = (OpcodeEntry_t){DecodeImmediateToRegister, MnemonicMov, ClassMov,
+                                (OpcodeByte & 0x8) ? OperandsImm16 : OperandsImm8};
+    } else if ((OpcodeByte & RegisterMemToFromRegisterMask) == RegisterMemToFromRegisterOpcode) {
+        Entry = (OpcodeEntry_t){DecodeRegMemWithRegister, MnemonicMov, ClassMov, OperandsModRM};
+    } else if ((OpcodeByte & ImmediateToRegisterMemMask) == ImmediateToRegisterMemOpcode) {
+        Entry = (OpcodeEntry_t){DecodeRegMemWithImmediate, MnemonicMov, ClassMov,
+                                (OpcodeByte & 0x1) ? OperandsModRMImm16 : OperandsModRMImm8};
+    } else if ((OpcodeByte & MemoryToAccumulatorMask) == MemoryToAccumulatorOpcode) {
+        Entry = (OpcodeEntry_t){DecodeAccumulatorMemory, MnemonicMov, ClassMov, OperandsAddress16};
+    } else if ((OpcodeByte & AccumulatorToMemoryMask) == AccumulatorToMemoryOpcode) {
+        Entry = (OpcodeEntry_t){DecodeAccumulatorMemory, MnemonicMov, ClassMov, OperandsAddress16};
+    }
+    return Entry;
+}
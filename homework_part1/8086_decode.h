@@ -0,0 +1,187 @@
+#ifndef DECODE_8086_H
+#define DECODE_8086_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lib8086decode.h"
+
+typedef struct {
+    size_t FileSize;
+    const uint8_t *const Bin;
+    const int IsMapped; // Bin is an mmap of the file rather than a malloc'd copy
+} FileInfo_t;
+
+// Table 4-8
+typedef enum {
+    MemNoDispalcement = 0,
+    MemByteDispalcement = 1,
+    MemWordDispalcement = 2,
+    RegisterMode = 3,
+} ModeField_t;
+
+//*****************************************************************************
+// Unions
+//*****************************************************************************
+// Figure 4-20, page 262
+typedef union {
+    uint8_t val;
+    struct __attribute__((packed)) {
+        uint8_t Word : 1;
+        uint8_t Direction : 1;
+        uint8_t Opcode : 6;
+    } Fields;
+} RegMemToFromRegOpcode_t;
+
+typedef union {
+    uint8_t val;
+    struct __attribute__((packed)) {
+        uint8_t RegMem : 3;
+        uint8_t Register : 3;
+        ModeField_t Mode : 2;
+    } Fields;
+} RegMemToFromRegMod_t;
+
+typedef union {
+    uint8_t val;
+    struct __attribute__((packed)) {
+        uint8_t Reg : 3;
+        uint8_t Word : 1;
+        uint8_t Opcode : 4;
+    } Fields;
+} ImmediateToReg_t;
+
+typedef union {
+    uint8_t val;
+    struct __attribute__((packed)) {
+        uint8_t Word : 1;
+        uint8_t Opcode : 7;
+    } Fields;
+} MemoryToAccumulatorOpcode_t;
+
+//*****************************************************************************
+// Instruction Records
+//*****************************************************************************
+typedef enum {
+    ClassInvalid = 0,
+    ClassPrefix,
+    ClassGroup, // Real class depends on the reg field of the mod r/m byte
+    ClassMov,
+    ClassStack,
+    ClassArithmetic,
+    ClassLogic,
+    ClassShift,
+    ClassString,
+    ClassConditionalJump,
+    ClassJump,
+    ClassCall,
+    ClassReturn,
+    ClassInterrupt,
+    ClassIO,
+    ClassFlag,
+    ClassControl,
+} InstructionClass_t;
+
+extern const char *const MnemonicStrs[];
+extern const uint8_t MnemonicClasses[];
+
+// Clock estimate for one instruction from Table 2-21. Ranges in the table (mul, div) use the low end.
+typedef struct {
+    uint16_t Base;             // Clocks not counting EffectiveAddress, and the not taken cost for conditional transfers
+    uint16_t Taken;            // Total clocks when a conditional transfer or into is taken, 0 otherwise
+    uint16_t PerRepetition;    // Added per rep iteration, or per bit for a shift/rotate by cl
+    uint8_t EffectiveAddress;  // Table 2-20, including 2 for a segment override
+    uint8_t Transfers;         // Word transfers through the memory operand, 4 more clocks each at an odd address
+} InstructionClocks_t;
+
+#define OddTransferClocks 4
+
+//*****************************************************************************
+// Opcode Table
+//*****************************************************************************
+typedef struct OpcodeEntry OpcodeEntry_t;
+typedef void (*OpcodeHandler_t)(const uint64_t ip, const FileInfo_t FileInfo, const OpcodeEntry_t *Entry,
+                                Instruction_t *Instruction);
+
+// Describes which bytes follow the opcode byte so the length of an instruction can be known without decoding it.
+typedef enum {
+    OperandsNone = 0,
+    OperandsModRM,       // mod reg r/m [disp-lo] [disp-hi]
+    OperandsModRMImm8,   // mod 000 r/m [disp-lo] [disp-hi] data
+    OperandsModRMImm16,  // mod 000 r/m [disp-lo] [disp-hi] data-lo data-hi
+    OperandsGroup3Imm8,  // Like OperandsModRMImm8 but only test (reg 000/001) has the data byte
+    OperandsGroup3Imm16, // Like OperandsModRMImm16 but only test (reg 000/001) has the data bytes
+    OperandsImm8,        // data
+    OperandsImm16,       // data-lo data-hi
+    OperandsAddress16,   // addr-lo addr-hi
+    OperandsFarPointer,  // offset-lo offset-hi seg-lo seg-hi
+    OperandsPrefix,      // Decoding carries on with the next byte
+} OperandLayout_t;
+
+struct OpcodeEntry {
+    OpcodeHandler_t Handler;
+    uint8_t Mnemonic; // For ClassGroup this is the index into GroupMnemonics instead
+    uint8_t Class;
+    uint8_t Layout;
+};
+
+// Table 4-12, indexed by the first byte of an instruction
+extern const OpcodeEntry_t OpcodeTable[256];
+
+// The 8086 will take any number of prefixes but lock + rep + segment is all that means anything. Capping the run
+// keeps MaxInstructionLength small enough for callers that need to know how far ahead decoding can read.
+#define MaxPrefixes 4
+#define MaxInstructionLength (MaxPrefixes + 6)
+
+typedef struct {
+    char *Data;
+    size_t Used;
+    size_t Size;
+} OutputBuffer_t;
+
+//*****************************************************************************
+// Functions
+//*****************************************************************************
+FileInfo_t ReadBin(const int Fd, const char *BinFile, size_t Capacity);
+int OpenBin(const char *BinFile);
+FileInfo_t LoadBin(const char *BinFile);
+void UnloadBin(const FileInfo_t FileInfo);
+uint8_t GetByteFromBin(const FileInfo_t FileInfo, const uint64_t Address);
+uint16_t GetWordFromBin(const FileInfo_t FileInfo, const uint64_t Address);
+double GetSeconds(void);
+
+const char *GetRegisterStr(uint8_t Base, uint8_t IsWord);
+const char *GetSegmentRegisterStr(uint8_t Index);
+const char *GetEffectiveAddressStr(const uint8_t RegMem);
+const char *GetDisplacementEffectiveAddressStr(const uint8_t RegMem);
+
+uint16_t DecodeInstruction(const uint64_t ip, const FileInfo_t FileInfo, Instruction_t *Instruction);
+InstructionClass_t GetInstructionClass(const Instruction_t *Instruction);
+uint16_t GetDisplacementLength(const uint8_t ModByte);
+uint16_t GetInstructionLength(const uint64_t ip, const OpcodeEntry_t Entry, const FileInfo_t FileInfo);
+Instruction_t *DecodeRange(const FileInfo_t FileInfo, const uint64_t Start, const uint64_t End, size_t *Count,
+                           uint64_t *DecodedEnd);
+Instruction_t *DecodeBin(const FileInfo_t FileInfo, size_t *Count);
+OpcodeEntry_t DispatchByMaskChain(const uint8_t OpcodeByte);
+uint16_t EncodeInstruction(const Instruction_t *Instruction, uint8_t *Bytes);
+void PrescanLengthsScalar(const FileInfo_t FileInfo, const uint64_t Start, const uint64_t End, uint8_t *Lengths);
+void PrescanLengthsSsse3(const FileInfo_t FileInfo, const uint64_t Start, const uint64_t End, uint8_t *Lengths);
+void PrescanLengthsAvx2(const FileInfo_t FileInfo, const uint64_t Start, const uint64_t End, uint8_t *Lengths);
+void PrescanLengths(const FileInfo_t FileInfo, const uint64_t Start, const uint64_t End, uint8_t *Lengths);
+uint64_t ResolveInstructionLengths(uint8_t *Lengths, const uint64_t Size, uint64_t *ResolvedSize);
+
+uint8_t GetEffectiveAddressClocks(const Instruction_t *Instruction, const Operand_t Operand);
+InstructionClocks_t GetInstructionClocks(const Instruction_t *Instruction);
+int HasOddDirectAddress(const Instruction_t *Instruction);
+
+OutputBuffer_t CreateOutputBuffer(const size_t InstructionCount);
+void AppendChar(OutputBuffer_t *Output, const char Char);
+void AppendStr(OutputBuffer_t *Output, const char *Str);
+void AppendUnsigned(OutputBuffer_t *Output, uint64_t Value);
+void AppendSigned(OutputBuffer_t *Output, const int32_t Value);
+void FlushOutput(OutputBuffer_t *Output, const int Fd);
+void FormatOperand(OutputBuffer_t *Output, const Instruction_t *Instruction, const Operand_t Operand,
+                   const uint8_t NeedsSize);
+void FormatInstruction(OutputBuffer_t *Output, const Instruction_t *Instruction);
+
+#endif
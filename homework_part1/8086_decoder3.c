@@ -1,364 +1,1901 @@
-#include <stdint.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-// This can pass up to listing 40
+#include "8086_decode.h"
+#include "8086_profile.h"
+#include "lib8086decode.h"
 
-typedef struct {
-    size_t FileSize;
-    const uint8_t *const Bin;
-} FileInfo_t;
-
-// Table 4-8
-typedef enum {
-    MemNoDispalcement = 0,
-    MemByteDispalcement = 1,
-    MemWordDispalcement = 2,
-    RegisterMode = 3,
-} ModeField_t;
+// This can pass up to listing 42, make test runs it over the reference listings in listings/
 
 //*****************************************************************************
-// Unions
+// Streaming
 //*****************************************************************************
-// Figure 4-20, page 262
-typedef union {
-    uint8_t val;
-    struct __attribute__((packed)) {
-        uint8_t Word : 1;
-        uint8_t Direction : 1;
-        uint8_t Opcode : 6;
-    } Fields;
-} RegMemToFromRegOpcode_t;
-
-typedef union {
-    uint8_t val;
-    struct __attribute__((packed)) {
-        uint8_t RegMem : 3;
-        uint8_t Register : 3;
-        ModeField_t Mode : 2;
-    } Fields;
-} RegMemToFromRegMod_t;
-
-typedef union {
-    uint8_t val;
-    struct __attribute__((packed)) {
-        uint8_t Reg : 3;
-        uint8_t Word : 1;
-        uint8_t Opcode : 4;
-    } Fields;
-} ImmediateToReg_t;
-
-typedef union {
-    uint8_t val;
-    struct __attribute__((packed)) {
-        uint8_t Word : 1;
-        uint8_t Opcode : 7;
-    } Fields;
-} MemoryToAccumulatorOpcode_t;
+#define StreamWindowSize (64 * 1024)
+#define StreamBatchSize 4096
 
-//*****************************************************************************
-// Helper Functions
-//*****************************************************************************
-FileInfo_t LoadBin(const char *BinFile) {
-    FILE *BinStream = fopen(BinFile, "rb");
-    if (!BinStream) {
-        printf("[%s] ERROR: Could not open %s for read\n", __func__, BinFile);
+// Decodes from Fd through a fixed window so memory use doesn't depend on the size of the input. Decoding stops
+// MaxInstructionLength short of the end of the window until the input runs out, so an instruction that straddles a
+// refill is moved to the front of the window and decoded once the rest of it has been read. Once the input has run
+// out the last few instructions go through Lib8086DecodeOne, so one cut off by the end of the stream is reported at
+// its offset in the stream rather than in the window.
+void DecodeStream(const int Fd, const char *BinFile) {
+    uint8_t *const Window = malloc(StreamWindowSize);
+    Instruction_t *const Records = malloc(StreamBatchSize * sizeof(Instruction_t));
+    if (!Window || !Records) {
+        printf("[%s] ERROR: Could not malloc stream buffers.\n", __func__);
         exit(1);
     }
+    OutputBuffer_t Output = CreateOutputBuffer(StreamBatchSize);
 
-    fseek(BinStream, 0L, SEEK_END);
-    size_t FileSize = ftell(BinStream);
-    rewind(BinStream);
-    printf("Binary %s is 0x%lx bytes\n", BinFile, FileSize);
+    uint64_t StreamOffset = 0; // Offset of Window[0] in the stream
+    size_t Available = 0;
+    int AtEnd = 0;
+    while (!AtEnd || Available) {
+        while (!AtEnd && (Available < StreamWindowSize)) {
+            const ssize_t Result = read(Fd, Window + Available, StreamWindowSize - Available);
+            if (Result < 0) {
+                printf("[%s] ERROR: Could not read %s at offset 0x%lx\n", __func__, BinFile, StreamOffset + Available);
+                exit(1);
+            }
+            AtEnd = !Result;
+            Available += Result;
+        }
 
-    uint8_t *const Bin = malloc(FileSize);
-    if (!Bin) {
-        printf("ERROR: Could not malloc %lu bytes for binary.\n", FileSize);
-        exit(1);
+        const FileInfo_t FileInfo = {Available, Window, 0};
+        const uint64_t SafeEnd = (Available > MaxInstructionLength) ? (Available - MaxInstructionLength) : 0;
+        const uint64_t DecodeLimit = AtEnd ? Available : SafeEnd;
+        uint64_t ip = 0;
+        int Truncated = 0;
+        while ((ip < DecodeLimit) && !Truncated) {
+            size_t Count = 0;
+            while ((ip < DecodeLimit) && (Count < StreamBatchSize)) {
+                uint16_t Length;
+                if (ip < SafeEnd) {
+                    Length = DecodeInstruction(ip, FileInfo, &Records[Count]);
+                } else if (Lib8086DecodeOne(Window + ip, Available - ip, &Records[Count], &Length) != Lib8086Ok) {
+                    Truncated = 1;
+                    break;
+                }
+                ip += Length;
+                Count++;
+            }
+            for (size_t i = 0; i < Count; i++) {
+                FormatInstruction(&Output, &Records[i]);
+            }
+            FlushOutput(&Output, STDOUT_FILENO);
+        }
+        if (Truncated) {
+            printf("[%s] ERROR: Instruction at 0x%lx runs past the end of %s at 0x%lx\n", __func__, StreamOffset + ip,
+                   BinFile, StreamOffset + Available);
+            exit(1);
+        }
+
+        memmove(Window, Window + ip, Available - ip);
+        Available -= ip;
+        StreamOffset += ip;
     }
+    fprintf(stderr, "Stream %s was 0x%lx bytes\n", BinFile, StreamOffset);
+
+    free(Output.Data);
+    free(Records);
+    free(Window);
+}
+
+//*****************************************************************************
+// Parallel Decoding
+//*****************************************************************************
+// Chunks smaller than this spend more time resynchronizing and writing than decoding
+#define MinParallelChunkSize (64 * 1024)
+#define ChunksPerThread 4
 
-    fread(Bin, FileSize, 1, BinStream);
-    fclose(BinStream);
+typedef struct {
+    uint64_t Start; // Bytes this chunk owns. Workers guess that Start is an instruction boundary.
+    uint64_t End;
+    int Speculative; // The tail of the bin is left to ResyncChunks so guesses can't run off the end
+    Instruction_t *Records;
+    size_t Count;
+    uint64_t DecodedEnd;   // Where the speculative decode finished, at or past End
+    size_t First;          // First speculative record that lines up with the serial decode
+    Instruction_t *Fixups; // Records decoded from the real boundary before the speculative ones line up
+    size_t FixupCount;
+    OutputBuffer_t Output;
+} Chunk_t;
+
+typedef struct {
+    const FileInfo_t *FileInfo;
+    Chunk_t *Chunks;
+    size_t ChunkCount;
+    size_t NextChunk; // Shared work counter, bumped atomically
+    pthread_barrier_t Barrier;
+} ParallelJob_t;
 
-    FileInfo_t Info = {FileSize, Bin};
-    return Info;
+Chunk_t *GrabChunk(ParallelJob_t *Job) {
+    const size_t Index = __atomic_fetch_add(&Job->NextChunk, 1, __ATOMIC_RELAXED);
+    return (Index < Job->ChunkCount) ? &Job->Chunks[Index] : NULL;
 }
 
-uint8_t GetByteFromBin(const FileInfo_t FileInfo, const uint16_t Address) {
-    if (Address >= FileInfo.FileSize) {
-        printf("[%s] ERROR: Attempted to access address 0x%x which is beyond the size of the bin 0x%lx\n", __func__,
-               Address, FileInfo.FileSize);
-        exit(1);
+void FormatChunk(Chunk_t *Chunk) {
+    Chunk->Output = CreateOutputBuffer(Chunk->FixupCount + (Chunk->Count - Chunk->First));
+    for (size_t i = 0; i < Chunk->FixupCount; i++) {
+        FormatInstruction(&Chunk->Output, &Chunk->Fixups[i]);
+    }
+    for (size_t i = Chunk->First; i < Chunk->Count; i++) {
+        FormatInstruction(&Chunk->Output, &Chunk->Records[i]);
+    }
+}
+
+// Workers decode every chunk speculatively, wait while the main thread lines the chunks up, then format them.
+void *ParallelWorker(void *Arg) {
+    ParallelJob_t *Job = Arg;
+    Chunk_t *Chunk;
+    while ((Chunk = GrabChunk(Job))) {
+        if (Chunk->Speculative) {
+            Chunk->Records =
+                DecodeRange(*Job->FileInfo, Chunk->Start, Chunk->End, &Chunk->Count, &Chunk->DecodedEnd);
+        }
     }
-    return FileInfo.Bin[Address];
+
+    pthread_barrier_wait(&Job->Barrier);
+    pthread_barrier_wait(&Job->Barrier);
+
+    while ((Chunk = GrabChunk(Job))) {
+        FormatChunk(Chunk);
+    }
+    return NULL;
 }
 
-uint16_t GetWordFromBin(const FileInfo_t FileInfo, const uint16_t Address) {
-    if ((Address + 1) >= FileInfo.FileSize) {
-        printf("[%s] ERROR: Attempted to access address 0x%x which is beyond the size of the bin 0x%lx\n", __func__,
-               Address, FileInfo.FileSize);
+void AppendFixup(Chunk_t *Chunk, const Instruction_t *Instruction, size_t *Capacity) {
+    if (Chunk->FixupCount == *Capacity) {
+        *Capacity = *Capacity ? (*Capacity * 2) : 16;
+        Chunk->Fixups = realloc(Chunk->Fixups, *Capacity * sizeof(Instruction_t));
+        if (!Chunk->Fixups) {
+            printf("[%s] ERROR: Could not grow to %lu fixup records.\n", __func__, *Capacity);
+            exit(1);
+        }
+    }
+    Chunk->Fixups[Chunk->FixupCount++] = *Instruction;
+}
+
+// Serial pass over the chunk boundaries. Chunk 0 starts on a real boundary and every later chunk gets lined up with
+// where the previous one really finished. 8086 code falls back into step within a few instructions of a wrong guess
+// so this only ever re-decodes a handful of instructions per chunk.
+void ResyncChunks(const FileInfo_t FileInfo, Chunk_t *Chunks, const size_t ChunkCount) {
+    uint64_t TrueStart = 0;
+    for (size_t c = 0; c < ChunkCount; c++) {
+        Chunk_t *Chunk = &Chunks[c];
+        size_t FixupCapacity = 0;
+        if (!Chunk->Speculative) {
+            uint64_t ip = TrueStart;
+            while (ip < Chunk->End) {
+                Instruction_t Instruction;
+                ip += DecodeInstruction(ip, FileInfo, &Instruction);
+                AppendFixup(Chunk, &Instruction, &FixupCapacity);
+            }
+            TrueStart = ip;
+            continue;
+        }
+
+        // Skip speculative records that start before the real boundary
+        uint64_t Offset = Chunk->Start;
+        size_t i = 0;
+        while ((i < Chunk->Count) && (Offset < TrueStart)) {
+            Offset += Chunk->Records[i++].Length;
+        }
+
+        // Decode from the real boundary until it lands on an offset the speculative decode also started at
+        uint64_t ip = TrueStart;
+        while ((ip < Chunk->End) && (ip != Offset)) {
+            Instruction_t Instruction;
+            ip += DecodeInstruction(ip, FileInfo, &Instruction);
+            AppendFixup(Chunk, &Instruction, &FixupCapacity);
+            while ((i < Chunk->Count) && (Offset < ip)) {
+                Offset += Chunk->Records[i++].Length;
+            }
+        }
+
+        if (ip == Offset) {
+            Chunk->First = i;
+            TrueStart = Chunk->DecodedEnd;
+        } else {
+            // Never lined up so the fixups are the whole chunk
+            Chunk->First = Chunk->Count;
+            TrueStart = ip;
+        }
+    }
+}
+
+// Decodes and formats the bin across ThreadCount workers. The result is identical to the serial listing and is left
+// in the chunks' output buffers for the caller to write in order and free with FreeChunks.
+Chunk_t *DecodeParallel(const FileInfo_t FileInfo, const int ThreadCount, size_t *ChunkCount) {
+    // Every speculative chunk can decode its last instruction without reading past the end of the bin
+    const uint64_t SpeculativeSize =
+        (FileInfo.FileSize > MaxInstructionLength) ? FileInfo.FileSize - MaxInstructionLength : 0;
+    size_t SpeculativeCount = ThreadCount * ChunksPerThread;
+    if ((SpeculativeSize / SpeculativeCount) < MinParallelChunkSize) {
+        SpeculativeCount = (SpeculativeSize / MinParallelChunkSize) + 1;
+    }
+    const size_t Count = SpeculativeCount + 1;
+
+    Chunk_t *Chunks = calloc(Count, sizeof(Chunk_t));
+    pthread_t *Threads = malloc(ThreadCount * sizeof(pthread_t));
+    if (!Chunks || !Threads) {
+        printf("[%s] ERROR: Could not malloc %lu chunks.\n", __func__, Count);
         exit(1);
     }
-    return *((uint16_t *)(FileInfo.Bin + Address));
+    for (size_t c = 0; c < SpeculativeCount; c++) {
+        Chunks[c].Start = (SpeculativeSize * c) / SpeculativeCount;
+        Chunks[c].End = (SpeculativeSize * (c + 1)) / SpeculativeCount;
+        Chunks[c].Speculative = 1;
+    }
+    Chunks[SpeculativeCount].Start = SpeculativeSize;
+    Chunks[SpeculativeCount].End = FileInfo.FileSize;
+
+    ParallelJob_t Job = {&FileInfo, Chunks, Count, 0};
+    pthread_barrier_init(&Job.Barrier, NULL, ThreadCount + 1);
+    for (int t = 0; t < ThreadCount; t++) {
+        if (pthread_create(&Threads[t], NULL, ParallelWorker, &Job)) {
+            printf("[%s] ERROR: Could not start worker thread %d.\n", __func__, t);
+            exit(1);
+        }
+    }
+
+    pthread_barrier_wait(&Job.Barrier);
+    ResyncChunks(FileInfo, Chunks, Count);
+    Job.NextChunk = 0;
+    pthread_barrier_wait(&Job.Barrier);
+
+    for (int t = 0; t < ThreadCount; t++) {
+        pthread_join(Threads[t], NULL);
+    }
+    pthread_barrier_destroy(&Job.Barrier);
+    free(Threads);
+
+    *ChunkCount = Count;
+    return Chunks;
 }
 
-const char *GetRegisterStr(uint8_t Base, uint8_t IsWord) {
-    const uint8_t Index = Base | (IsWord << 3);
-    // Table 4-9 Page 263
-    const char *RegNames[] = {
-        "al", "cl", "dl", "bl", "ah", "ch", "dh", "bh", "ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
-    };
-    return RegNames[Index];
+void FreeChunks(Chunk_t *Chunks, const size_t ChunkCount) {
+    for (size_t c = 0; c < ChunkCount; c++) {
+        free(Chunks[c].Records);
+        free(Chunks[c].Fixups);
+        free(Chunks[c].Output.Data);
+    }
+    free(Chunks);
 }
 
-// Table 4-10
-const char *GetEffectiveAddressStr(const uint8_t RegMem) {
-    const char *Strings[] = {"bx + si", "bx + di", "bp + si", "bp + di", "si", "di", "direct", "bx"};
-    return Strings[RegMem];
+int GetDefaultThreadCount(void) {
+    const long Cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return (Cores > 0) ? Cores : 1;
 }
 
-// Table 4-10
-const char *GetDisplacementEffectiveAddressStr(const uint8_t RegMem) {
-    const char *Strings[] = {"bx + si", "bx + di", "bp + si", "bp + di", "si", "di", "bp", "bx"};
-    return Strings[RegMem];
+// Times DecodeParallel at doubling thread counts up to the number of cores and checks every run against the serial
+// listing.
+void BenchmarkParallel(const FileInfo_t FileInfo) {
+    const int Repeats = 5;
+
+    size_t SerialCount;
+    Instruction_t *Serial = DecodeBin(FileInfo, &SerialCount);
+    OutputBuffer_t Expected = CreateOutputBuffer(SerialCount);
+    for (size_t i = 0; i < SerialCount; i++) {
+        FormatInstruction(&Expected, &Serial[i]);
+    }
+    free(Serial);
+
+    const int MaxThreads = GetDefaultThreadCount();
+    double BaseSeconds = 0;
+    for (int ThreadCount = 1;; ThreadCount = (ThreadCount * 2 > MaxThreads) ? MaxThreads : ThreadCount * 2) {
+        double Best = 0;
+        for (int Repeat = 0; Repeat < Repeats; Repeat++) {
+            size_t ChunkCount;
+            const double Start = GetSeconds();
+            Chunk_t *Chunks = DecodeParallel(FileInfo, ThreadCount, &ChunkCount);
+            const double Elapsed = GetSeconds() - Start;
+            Best = (!Repeat || (Elapsed < Best)) ? Elapsed : Best;
+
+            size_t Offset = 0;
+            for (size_t c = 0; c < ChunkCount; c++) {
+                const OutputBuffer_t *Output = &Chunks[c].Output;
+                if (((Offset + Output->Used) > Expected.Used) ||
+                    memcmp(Expected.Data + Offset, Output->Data, Output->Used)) {
+                    printf("[%s] ERROR: %d thread output differs from the serial listing in chunk %lu\n", __func__,
+                           ThreadCount, c);
+                    exit(1);
+                }
+                Offset += Output->Used;
+            }
+            if (Offset != Expected.Used) {
+                printf("[%s] ERROR: %d thread output is %lu bytes, serial is %lu\n", __func__, ThreadCount, Offset,
+                       Expected.Used);
+                exit(1);
+            }
+            FreeChunks(Chunks, ChunkCount);
+        }
+
+        BaseSeconds = (ThreadCount == 1) ? Best : BaseSeconds;
+        printf("%3d threads: %.4fs, %.1f MB/s in, %.2fx speedup\n", ThreadCount, Best,
+               ((double)FileInfo.FileSize / Best) / 1e6, BaseSeconds / Best);
+        if (ThreadCount == MaxThreads) {
+            break;
+        }
+    }
+    free(Expected.Data);
 }
 
 //*****************************************************************************
-// Opcode Functions
+// Batch Decoding
 //*****************************************************************************
-uint16_t ImmediateToRegisterMem(const uint16_t ip, const uint8_t OpcodeByte, const FileInfo_t FileInfo) {
-    const RegMemToFromRegOpcode_t Opcode = {OpcodeByte};
-    const RegMemToFromRegMod_t Mod = {GetByteFromBin(FileInfo, ip + 1)};
-
-    switch (Mod.Fields.Mode) {
-    case MemNoDispalcement: {
-        // See asterisk below Table 4-8
-        const uint8_t DirectAddressRM = 6;
-        if (Mod.Fields.RegMem == DirectAddressRM) {
-            const uint16_t Displacement = GetWordFromBin(FileInfo, ip + 2);
-            uint16_t ImmediateValue = 0;
-            uint16_t BytesRead = 5;
-            char *SizeStr;
-            if (Opcode.Fields.Word) {
-                BytesRead++;
-                ImmediateValue = GetWordFromBin(FileInfo, ip + 4);
-                SizeStr = "word";
-            } else {
-                ImmediateValue = GetByteFromBin(FileInfo, ip + 4);
-                SizeStr = "byte";
-            }
-            printf("mov [%x], %s %x\n", Displacement, SizeStr, ImmediateValue);
+// Many bins in one process. Each worker keeps its input, record and output buffers from one file to the next, so
+// after the first few files nothing gets allocated or faulted in. Decoding goes through lib8086decode, which reports
+// a bad file instead of exiting, so one bad file only fails itself.
+#define BatchRecordCount 4096
 
-            return BytesRead;
-        } else {
-            const char *RegisterStr = GetEffectiveAddressStr(Mod.Fields.RegMem);
-            uint16_t ImmediateValue = 0;
-            uint16_t BytesRead = 3;
-            char *SizeStr;
-            if (Opcode.Fields.Word) {
-                BytesRead++;
-                ImmediateValue = GetWordFromBin(FileInfo, ip + 2);
-                SizeStr = "word";
-            } else {
-                ImmediateValue = GetByteFromBin(FileInfo, ip + 2);
-                SizeStr = "byte";
-            }
-            printf("mov [%s], %s %x\n", RegisterStr, SizeStr, ImmediateValue);
-            return BytesRead;
+typedef struct {
+    const char *Path;
+    uint64_t Instructions;
+    char Error[128]; // Empty when the file decoded
+} BatchFile_t;
+
+typedef struct {
+    BatchFile_t *Files;
+    size_t FileCount;
+    size_t NextFile; // Shared work counter, bumped atomically
+    const char *OutputDir; // NULL for one stream on stdout with a "; file" line ahead of each listing
+    pthread_mutex_t OutputLock;
+} BatchJob_t;
+
+typedef struct {
+    uint8_t *Input;
+    size_t InputSize;
+    Instruction_t *Records;
+    OutputBuffer_t Output;
+} BatchBuffers_t;
+
+int GrowBatchOutput(OutputBuffer_t *Output, const size_t Needed) {
+    if ((Output->Size - Output->Used) >= Needed) {
+        return 1;
+    }
+    const size_t Size = (Output->Size * 2) + Needed;
+    char *Data = realloc(Output->Data, Size);
+    if (!Data) {
+        return 0;
+    }
+    Output->Data = Data;
+    Output->Size = Size;
+    return 1;
+}
+
+// Like FlushOutput but hands the error back
+int WriteBatchOutput(const int Fd, const OutputBuffer_t *Output) {
+    size_t Written = 0;
+    while (Written < Output->Used) {
+        const ssize_t Result = write(Fd, Output->Data + Written, Output->Used - Written);
+        if (Result < 0) {
+            return 0;
+        }
+        Written += Result;
+    }
+    return 1;
+}
+
+// Reads the whole file into the worker's input buffer, growing it if this file is the biggest one yet.
+int ReadBatchInput(BatchBuffers_t *Buffers, BatchFile_t *File, size_t *Size) {
+    const int Fd = open(File->Path, O_RDONLY);
+    if (Fd < 0) {
+        snprintf(File->Error, sizeof(File->Error), "could not open for read");
+        return 0;
+    }
+    struct stat Stat;
+    if (fstat(Fd, &Stat) || !S_ISREG(Stat.st_mode)) {
+        snprintf(File->Error, sizeof(File->Error), "not a regular file");
+        close(Fd);
+        return 0;
+    }
+    if ((size_t)Stat.st_size > Buffers->InputSize) {
+        uint8_t *Input = realloc(Buffers->Input, Stat.st_size);
+        if (!Input) {
+            snprintf(File->Error, sizeof(File->Error), "could not malloc 0x%lx bytes", (size_t)Stat.st_size);
+            close(Fd);
+            return 0;
+        }
+        Buffers->Input = Input;
+        Buffers->InputSize = Stat.st_size;
+    }
+
+    size_t Used = 0;
+    while (Used < (size_t)Stat.st_size) {
+        const ssize_t Result = read(Fd, Buffers->Input + Used, Stat.st_size - Used);
+        if (Result <= 0) {
+            snprintf(File->Error, sizeof(File->Error), "could not read");
+            close(Fd);
+            return 0;
+        }
+        Used += Result;
+    }
+    close(Fd);
+    *Size = Used;
+    return 1;
+}
+
+void DecodeBatchFile(BatchJob_t *Job, BatchBuffers_t *Buffers, BatchFile_t *File) {
+    size_t Size;
+    if (!ReadBatchInput(Buffers, File, &Size)) {
+        return;
+    }
+
+    OutputBuffer_t *Output = &Buffers->Output;
+    Output->Used = 0;
+    const size_t HeaderLength = strlen(File->Path) + 16;
+    if (!Job->OutputDir) {
+        if (!GrowBatchOutput(Output, HeaderLength)) {
+            snprintf(File->Error, sizeof(File->Error), "could not grow output");
+            return;
+        }
+        AppendStr(Output, "; file ");
+        AppendStr(Output, File->Path);
+        AppendChar(Output, '\n');
+    }
+
+    size_t ip = 0;
+    while (ip < Size) {
+        size_t Count;
+        size_t Consumed;
+        const Lib8086Status_t Status =
+            Lib8086DecodeBatch(Buffers->Input + ip, Size - ip, Buffers->Records, BatchRecordCount, &Count, &Consumed);
+        if (!GrowBatchOutput(Output, Count * MaxInstructionTextLength)) {
+            snprintf(File->Error, sizeof(File->Error), "could not grow output");
+            return;
+        }
+        for (size_t i = 0; i < Count; i++) {
+            FormatInstruction(Output, &Buffers->Records[i]);
         }
+        File->Instructions += Count;
+        ip += Consumed;
+        if (Status != Lib8086Ok) {
+            snprintf(File->Error, sizeof(File->Error), "%s at 0x%lx", Lib8086StatusStr(Status), ip);
+            return;
+        }
+    }
+
+    if (Job->OutputDir) {
+        // Listings are named after the bin, so two bins with the same name in a list overwrite each other
+        const char *Name = strrchr(File->Path, '/');
+        Name = Name ? Name + 1 : File->Path;
+        char OutputPath[4096];
+        snprintf(OutputPath, sizeof(OutputPath), "%s/%s.asm", Job->OutputDir, Name);
+        const int Fd = open(OutputPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (Fd < 0) {
+            snprintf(File->Error, sizeof(File->Error), "could not open its listing for write");
+            return;
+        }
+        if (!WriteBatchOutput(Fd, Output)) {
+            snprintf(File->Error, sizeof(File->Error), "could not write its listing");
+        }
+        close(Fd);
+    } else {
+        // Whole listings go out one at a time so files never interleave
+        pthread_mutex_lock(&Job->OutputLock);
+        if (!WriteBatchOutput(STDOUT_FILENO, Output)) {
+            snprintf(File->Error, sizeof(File->Error), "could not write output");
+        }
+        pthread_mutex_unlock(&Job->OutputLock);
+    }
+}
+
+void *BatchWorker(void *Arg) {
+    BatchJob_t *Job = Arg;
+    BatchBuffers_t Buffers = {NULL, 0, malloc(BatchRecordCount * sizeof(Instruction_t)), CreateOutputBuffer(0)};
+    if (!Buffers.Records) {
+        printf("[%s] ERROR: Could not malloc %d instruction records.\n", __func__, BatchRecordCount);
+        exit(1);
+    }
+
+    size_t Index;
+    while ((Index = __atomic_fetch_add(&Job->NextFile, 1, __ATOMIC_RELAXED)) < Job->FileCount) {
+        DecodeBatchFile(Job, &Buffers, &Job->Files[Index]);
+    }
+
+    free(Buffers.Input);
+    free(Buffers.Records);
+    free(Buffers.Output.Data);
+    return NULL;
+}
+
+int ComparePaths(const void *A, const void *B) { return strcmp(*(const char *const *)A, *(const char *const *)B); }
+
+// Every regular file directly in a directory, sorted so the tagged stream comes out the same each run, or else one
+// path per line of a list file.
+char **ListBatchFiles(const char *ListPath, size_t *Count) {
+    size_t Capacity = 64;
+    size_t Used = 0;
+    char **Paths = malloc(Capacity * sizeof(char *));
+    if (!Paths) {
+        printf("[%s] ERROR: Could not malloc the file list.\n", __func__);
+        exit(1);
     }
-    case MemWordDispalcement: {
-        const int16_t Displacement = GetWordFromBin(FileInfo, ip + 2);
 
-        const char *RegMemStr = GetDisplacementEffectiveAddressStr(Mod.Fields.RegMem);
-        uint16_t ImmediateValue = 0;
-        uint16_t BytesRead = 5;
-        char *SizeStr;
-        if (Opcode.Fields.Word) {
-            BytesRead++;
-            ImmediateValue = GetWordFromBin(FileInfo, ip + 4);
-            SizeStr = "word";
+    DIR *Dir = opendir(ListPath);
+    FILE *List = Dir ? NULL : fopen(ListPath, "r");
+    if (!Dir && !List) {
+        printf("[%s] ERROR: Could not open %s for read\n", __func__, ListPath);
+        exit(1);
+    }
+    char *Line = NULL;
+    size_t LineSize = 0;
+    for (;;) {
+        char *Path;
+        if (Dir) {
+            const struct dirent *Entry = readdir(Dir);
+            if (!Entry) {
+                break;
+            }
+            if (Entry->d_name[0] == '.') {
+                continue;
+            }
+            Path = malloc(strlen(ListPath) + strlen(Entry->d_name) + 2);
+            if (!Path) {
+                printf("[%s] ERROR: Could not malloc the file list.\n", __func__);
+                exit(1);
+            }
+            sprintf(Path, "%s/%s", ListPath, Entry->d_name);
+            // Not every filesystem fills in d_type, and a link needs following to see what it points at
+            struct stat Stat;
+            const int IsRegular = (Entry->d_type == DT_REG) ||
+                                  (((Entry->d_type == DT_UNKNOWN) || (Entry->d_type == DT_LNK)) && !stat(Path, &Stat) &&
+                                   S_ISREG(Stat.st_mode));
+            if (!IsRegular) {
+                free(Path);
+                continue;
+            }
         } else {
-            ImmediateValue = GetByteFromBin(FileInfo, ip + 4);
-            SizeStr = "byte";
+            ssize_t Length = getline(&Line, &LineSize, List);
+            if (Length < 0) {
+                break;
+            }
+            while ((Length > 0) && ((Line[Length - 1] == '\n') || (Line[Length - 1] == '\r'))) {
+                Line[--Length] = 0;
+            }
+            if (!Length) {
+                continue;
+            }
+            Path = strdup(Line);
         }
-        printf("mov [%s + %d], %s %d\n", RegMemStr, Displacement, SizeStr, ImmediateValue);
 
-        return BytesRead;
+        if (Used == Capacity) {
+            Capacity *= 2;
+            Paths = realloc(Paths, Capacity * sizeof(char *));
+        }
+        if (!Path || !Paths) {
+            printf("[%s] ERROR: Could not malloc the file list.\n", __func__);
+            exit(1);
+        }
+        Paths[Used++] = Path;
+    }
+    free(Line);
+    if (Dir) {
+        closedir(Dir);
+        qsort(Paths, Used, sizeof(char *), ComparePaths);
+    } else {
+        fclose(List);
+    }
+
+    *Count = Used;
+    return Paths;
+}
+
+// Returns the number of files that failed. Status for every file goes to stderr once they're all done.
+size_t DecodeBatch(const char *ListPath, const char *OutputDir, const int ThreadCount) {
+    size_t FileCount;
+    char **Paths = ListBatchFiles(ListPath, &FileCount);
+    BatchFile_t *Files = calloc(FileCount + 1, sizeof(BatchFile_t));
+    pthread_t *Threads = malloc(ThreadCount * sizeof(pthread_t));
+    if (!Files || !Threads) {
+        printf("[%s] ERROR: Could not malloc %lu files.\n", __func__, FileCount);
+        exit(1);
+    }
+    for (size_t f = 0; f < FileCount; f++) {
+        Files[f].Path = Paths[f];
+    }
+
+    const double StartTime = GetSeconds();
+    BatchJob_t Job = {Files, FileCount, 0, OutputDir};
+    pthread_mutex_init(&Job.OutputLock, NULL);
+    for (int t = 0; t < ThreadCount; t++) {
+        if (pthread_create(&Threads[t], NULL, BatchWorker, &Job)) {
+            printf("[%s] ERROR: Could not start worker thread %d.\n", __func__, t);
+            exit(1);
+        }
     }
-    case RegisterMode: {
-        const char *RegMemStr = GetRegisterStr(Mod.Fields.RegMem, Opcode.Fields.Word);
-        const char *RegisterStr = GetRegisterStr(Mod.Fields.Register, Opcode.Fields.Word);
-        if (Opcode.Fields.Direction) {
-            printf("mov %s, %s\n", RegisterStr, RegMemStr);
+    for (int t = 0; t < ThreadCount; t++) {
+        pthread_join(Threads[t], NULL);
+    }
+    pthread_mutex_destroy(&Job.OutputLock);
+    const double Seconds = GetSeconds() - StartTime;
+
+    size_t Failed = 0;
+    uint64_t Instructions = 0;
+    for (size_t f = 0; f < FileCount; f++) {
+        if (Files[f].Error[0]) {
+            fprintf(stderr, "%s: ERROR: %s\n", Files[f].Path, Files[f].Error);
+            Failed++;
         } else {
-            printf("mov %s, %s\n", RegMemStr, RegisterStr);
+            fprintf(stderr, "%s: ok, %lu instructions\n", Files[f].Path, Files[f].Instructions);
         }
-        return 2;
+        Instructions += Files[f].Instructions;
+        free(Paths[f]);
     }
+    fprintf(stderr, "%lu files, %lu failed, %lu instructions in %.3fs on %d threads\n", FileCount, Failed,
+            Instructions, Seconds, ThreadCount);
+    free(Paths);
+    free(Files);
+    free(Threads);
+    return Failed;
+}
+
+//*****************************************************************************
+// Clock Annotation
+//*****************************************************************************
+// Basic blocks end at anything that transfers control, the same places a trace through the code would branch.
+int EndsBasicBlock(const Instruction_t *Instruction) {
+    switch (GetInstructionClass(Instruction)) {
+    case ClassConditionalJump:
+    case ClassJump:
+    case ClassCall:
+    case ClassReturn:
+    case ClassInterrupt:
+        return 1;
     default:
-        printf("[%s] ERROR: Can't do register mode %u at byte 0x%x.\n", __func__, Mod.Fields.Mode, ip + 1);
+        return Instruction->Mnemonic == MnemonicHlt;
+    }
+}
+
+// Puts " ; clocks: +13 = 120 (8 + 5ea)" on the end of the line FormatInstruction just wrote. Conditional transfers
+// count their not taken cost towards the totals, rep and shift by cl count a single pass. A "; block:" line follows
+// every instruction that ends a basic block.
+void FormatClocks(OutputBuffer_t *Output, const Instruction_t *Instruction, uint64_t *Total, uint64_t *BlockTotal) {
+    const InstructionClocks_t Clocks = GetInstructionClocks(Instruction);
+    const uint32_t Penalty = HasOddDirectAddress(Instruction) ? Clocks.Transfers * OddTransferClocks : 0;
+    const uint32_t Spent = Clocks.Base + Clocks.EffectiveAddress + Penalty;
+    *Total += Spent;
+    *BlockTotal += Spent;
+
+    // FormatInstruction always ends the line, the annotation goes in front of the newline
+    Output->Used--;
+    AppendStr(Output, " ; clocks: +");
+    AppendUnsigned(Output, Spent);
+    AppendStr(Output, " = ");
+    AppendUnsigned(Output, *Total);
+    if (Clocks.EffectiveAddress || Penalty) {
+        AppendStr(Output, " (");
+        AppendUnsigned(Output, Clocks.Base);
+        if (Clocks.EffectiveAddress) {
+            AppendStr(Output, " + ");
+            AppendUnsigned(Output, Clocks.EffectiveAddress);
+            AppendStr(Output, "ea");
+        }
+        if (Penalty) {
+            AppendStr(Output, " + ");
+            AppendUnsigned(Output, Penalty);
+            AppendStr(Output, "p");
+        }
+        AppendChar(Output, ')');
+    }
+    if (Clocks.Taken) {
+        AppendStr(Output, " (");
+        AppendUnsigned(Output, Clocks.Taken);
+        AppendStr(Output, " taken)");
+    }
+    if (Clocks.PerRepetition) {
+        AppendStr(Output, " (+");
+        AppendUnsigned(Output, Clocks.PerRepetition);
+        AppendStr(Output, (GetInstructionClass(Instruction) == ClassShift) ? " per bit)" : " per rep)");
+    }
+    AppendChar(Output, '\n');
+
+    if (EndsBasicBlock(Instruction)) {
+        AppendStr(Output, "; block: ");
+        AppendUnsigned(Output, *BlockTotal);
+        AppendStr(Output, " clocks\n");
+        *BlockTotal = 0;
+    }
+}
+
+//*****************************************************************************
+// Statistics
+//*****************************************************************************
+// Histograms of what a bin is made of. Each instruction bumps one counter per histogram, every index comes out of a
+// lookup table or a conditional move, and the whole thing is a few hundred bytes so it stays in L1 for the scan.
+#define ClassCount (ClassControl + 1)
+#define ModeBinCount 5       // No mod r/m, then mod 00-11
+#define AddressBinCount 10   // Table 4-10 r/m 0-7 with 6 as direct, bp + disp, then no memory operand
+#define LengthBinCount (MaxInstructionLength + 1)
+
+const char *const ClassNames[ClassCount] = {
+    "invalid", "prefix", "group", "mov", "stack",     "arithmetic", "logic", "shift", "string",
+    "jcc",     "jmp",    "call",  "ret", "interrupt", "io",         "flag",  "control",
+};
+
+typedef struct {
+    uint64_t Classes[ClassCount];
+    uint64_t Modes[ModeBinCount];
+    uint64_t Addresses[AddressBinCount];
+    uint64_t Widths[2];
+    uint64_t Lengths[LengthBinCount];
+    uint64_t Instructions;
+    uint64_t Bytes;
+} Statistics_t;
+
+// Every histogram but Length only depends on the opcode and the mod r/m byte after it, so nothing gets decoded.
+// Lengths come from the prescan, then StatsOpcodes (indexed by opcode and reg field) gives the class, width and
+// whether a mod r/m byte follows, and the mod r/m byte itself gives the mode and the address bin.
+#define StatsWide 0x20
+#define StatsModRM 0x40
+#define StatsDirect 0x80 // Memory operand without a mod r/m byte, which is always a direct address
+#define StatsPrefix 0x100
+#define StatsClassMask 0x1f
+
+_Static_assert(ClassCount <= (StatsClassMask + 1), "Classes have to fit under the StatsOpcodes flags");
+
+// Filled by decoding a stand-in for every opcode and reg field, prefixes are marked rather than decoded since on
+// their own they only come out as a db.
+static void BuildStatsOpcodes(uint16_t *StatsOpcodes) {
+    for (int Opcode = 0; Opcode < 256; Opcode++) {
+        for (int Reg = 0; Reg < 8; Reg++) {
+            uint16_t *Entry = &StatsOpcodes[(Opcode << 3) | Reg];
+            if (OpcodeTable[Opcode].Class == ClassPrefix) {
+                *Entry = StatsPrefix | ClassInvalid;
+                continue;
+            }
+            const uint8_t Bytes[MaxInstructionLength] = {Opcode, Reg << 3};
+            const FileInfo_t Probe = {sizeof(Bytes), Bytes, 0};
+            Instruction_t Instruction;
+            DecodeInstruction(0, Probe, &Instruction);
+            const InstructionClass_t Class = GetInstructionClass(&Instruction);
+            const uint8_t Layout = OpcodeTable[Opcode].Layout;
+            const int HasModRM =
+                (Class != ClassInvalid) && (Layout >= OperandsModRM) && (Layout <= OperandsGroup3Imm16);
+            const int Direct = !HasModRM && ((Instruction.Operands[0].Type == OperandMemory) ||
+                                             (Instruction.Operands[1].Type == OperandMemory));
+            *Entry = Class | ((Instruction.Flags & InstWide) ? StatsWide : 0) | (HasModRM ? StatsModRM : 0) |
+                     (Direct ? StatsDirect : 0);
+        }
+    }
+}
+
+// Bins one instruction of Length bytes at ip. Length has to already be known to fit in the bin.
+static inline void CountInstruction(Statistics_t *Stats, const uint16_t *StatsOpcodes, const uint8_t *AddressBins,
+                                    const FileInfo_t FileInfo, uint64_t ip, const uint64_t Length) {
+    const uint64_t End = ip + Length;
+    // A prefix that ends the instruction is a db of its own
+    while (((ip + 1) < End) && (StatsOpcodes[FileInfo.Bin[ip] << 3] & StatsPrefix)) {
+        ip++;
+    }
+    // Past the instruction for a group with an undefined reg, which still needs that reg to come out as a db
+    const uint8_t ModRM = ((ip + 1) < FileInfo.FileSize) ? FileInfo.Bin[ip + 1] : 0;
+    const uint16_t Entry = StatsOpcodes[(FileInfo.Bin[ip] << 3) | ((ModRM >> 3) & 0x7)];
+    const int HasModRM = !!(Entry & StatsModRM);
+    const uint8_t NoModRMAddress = (Entry & StatsDirect) ? EffectiveAddressDirect : (AddressBinCount - 1);
+
+    Stats->Classes[Entry & StatsClassMask]++;
+    Stats->Modes[HasModRM * ((ModRM >> 6) + 1)]++;
+    Stats->Addresses[HasModRM ? AddressBins[ModRM] : NoModRMAddress]++;
+    Stats->Widths[!!(Entry & StatsWide)]++;
+    Stats->Lengths[Length]++;
+}
+
+void CollectStatistics(const FileInfo_t FileInfo, Statistics_t *Stats) {
+    TimeFunction;
+    uint16_t StatsOpcodes[256 * 8];
+    BuildStatsOpcodes(StatsOpcodes);
+    // Mod r/m byte to address bin: r/m, except mod 01/10 with r/m 110 is bp + disp and mod 11 has no memory operand
+    uint8_t AddressBins[256];
+    for (int ModRM = 0; ModRM < 256; ModRM++) {
+        const uint8_t Mod = ModRM >> 6;
+        const uint8_t RegMem = ModRM & 0x7;
+        const int BasePointer = (Mod != MemNoDispalcement) && (RegMem == EffectiveAddressDirect);
+        AddressBins[ModRM] = (Mod == RegisterMode) ? (AddressBinCount - 1) : BasePointer ? 8 : RegMem;
+    }
+
+    uint8_t *Lengths = malloc(FileInfo.FileSize + 1);
+    if (!Lengths) {
+        printf("[%s] ERROR: Could not malloc 0x%lx prescanned lengths.\n", __func__, FileInfo.FileSize);
         exit(1);
     }
-    exit(1);
+    PrescanLengths(FileInfo, 0, FileInfo.FileSize, Lengths);
+    uint64_t ResolvedSize;
+    const uint64_t ResolvedCount = ResolveInstructionLengths(Lengths, FileInfo.FileSize, &ResolvedSize);
+
+    uint64_t ip = 0;
+    for (uint64_t i = 0; i < ResolvedCount; i++) {
+        CountInstruction(Stats, StatsOpcodes, AddressBins, FileInfo, ip, Lengths[i]);
+        ip += Lengths[i];
+    }
+    free(Lengths);
+    // Whatever the prescan couldn't resolve runs off the end of the bin, the decoder reports it
+    while (ip < FileInfo.FileSize) {
+        Instruction_t Instruction;
+        const uint16_t Length = DecodeInstruction(ip, FileInfo, &Instruction);
+        CountInstruction(Stats, StatsOpcodes, AddressBins, FileInfo, ip, Length);
+        ip += Length;
+    }
+
+    Stats->Instructions = 0;
+    for (int l = 0; l < LengthBinCount; l++) {
+        Stats->Instructions += Stats->Lengths[l];
+    }
+    Stats->Bytes = ip;
 }
 
-uint16_t ImmediateToRegister(const uint16_t ip, const uint8_t OpcodeByte, const FileInfo_t FileInfo) {
-    ImmediateToReg_t Opcode = {OpcodeByte};
-    uint16_t BytesRead = 2;
+void PrintHistogram(const char *Title, const char *const *Names, const uint64_t *Counts, const int BinCount,
+                    const uint64_t Total) {
+    printf("%s:\n", Title);
+    for (int i = 0; i < BinCount; i++) {
+        if (Counts[i]) {
+            printf("  %-18s %12lu  %6.2f%%\n", Names[i], Counts[i], Total ? (100.0 * Counts[i]) / Total : 0);
+        }
+    }
+}
 
-    int16_t ImmediateValue;
-    if (Opcode.Fields.Word) {
-        BytesRead++;
-        ImmediateValue = GetWordFromBin(FileInfo, ip + 1);
-    } else {
-        ImmediateValue = (int16_t)GetByteFromBin(FileInfo, ip + 1);
+void PrintStatistics(const Statistics_t *Stats) {
+    const char *ModeNames[ModeBinCount] = {"no mod r/m", "mod 00", "mod 01 (disp8)", "mod 10 (disp16)",
+                                           "mod 11 (register)"};
+    const char *AddressNames[AddressBinCount] = {
+        GetEffectiveAddressStr(0), GetEffectiveAddressStr(1), GetEffectiveAddressStr(2), GetEffectiveAddressStr(3),
+        GetEffectiveAddressStr(4), GetEffectiveAddressStr(5), GetEffectiveAddressStr(6), GetEffectiveAddressStr(7),
+        "bp", "no memory operand",
+    };
+    const char *WidthNames[2] = {"byte", "word"};
+    const char *LengthNames[LengthBinCount] = {"0", "1", "2", "3", "4", "5", "6", "7", "8", "9", "10"};
+    _Static_assert(LengthBinCount == 11, "LengthNames needs a name per possible length");
+
+    printf("%lu instructions in %lu bytes, %.2f bytes per instruction\n", Stats->Instructions, Stats->Bytes,
+           Stats->Instructions ? (double)Stats->Bytes / Stats->Instructions : 0);
+    PrintHistogram("Class", ClassNames, Stats->Classes, ClassCount, Stats->Instructions);
+    PrintHistogram("Mode", ModeNames, Stats->Modes, ModeBinCount, Stats->Instructions);
+    PrintHistogram("Effective address", AddressNames, Stats->Addresses, AddressBinCount, Stats->Instructions);
+    PrintHistogram("Width", WidthNames, Stats->Widths, 2, Stats->Instructions);
+    PrintHistogram("Length", LengthNames, Stats->Lengths, LengthBinCount, Stats->Instructions);
+}
+
+//*****************************************************************************
+// Boundary Index
+//*****************************************************************************
+// Sidecar file that records where every instruction starts so a window deep in a large bin can be listed without
+// decoding everything before it. After the header come the checkpoints, one per IndexCheckpointInterval bytes of bin
+// holding the first instruction that starts at or after that offset, then every instruction length packed two to a
+// byte. Lengths are the deltas between starts and never go over MaxInstructionLength, so a nibble holds them.
+#define IndexCheckpointInterval 4096
+#define IndexMagic "8086IDX1"
+
+typedef struct {
+    char Magic[8];
+    uint64_t BinSize; // The only check that the index still belongs to the bin
+    uint64_t InstructionCount;
+    uint32_t CheckpointInterval;
+    uint32_t CheckpointCount;
+} IndexHeader_t;
+
+typedef struct {
+    uint64_t Offset;      // First instruction start at or after the checkpoint, the bin size if there is none
+    uint64_t Instruction; // Number of that instruction, which is where its length sits in the packed lengths
+} IndexCheckpoint_t;
+
+_Static_assert(MaxInstructionLength < 16, "Index lengths are packed into nibbles");
+
+void BuildIndex(const FileInfo_t FileInfo, const char *IndexFile) {
+    TimeFunction;
+    const uint32_t CheckpointCount = (FileInfo.FileSize + IndexCheckpointInterval - 1) / IndexCheckpointInterval;
+    const size_t LengthsOffset = sizeof(IndexHeader_t) + (CheckpointCount * sizeof(IndexCheckpoint_t));
+    // Every instruction is at least a byte, so the bin size bounds the instruction count
+    OutputBuffer_t Output = {calloc(LengthsOffset + (FileInfo.FileSize / 2) + 1, 1), 0, 0};
+    if (!Output.Data) {
+        printf("[%s] ERROR: Could not malloc index for a 0x%lx byte bin.\n", __func__, FileInfo.FileSize);
+        exit(1);
     }
+    IndexHeader_t *Header = (IndexHeader_t *)Output.Data;
+    IndexCheckpoint_t *Checkpoints = (IndexCheckpoint_t *)(Output.Data + sizeof(IndexHeader_t));
+    uint8_t *Lengths = (uint8_t *)Output.Data + LengthsOffset;
 
-    const char *RegisterStr = GetRegisterStr(Opcode.Fields.Reg, Opcode.Fields.Word);
-    if (Opcode.Fields.Word) {
-        printf("mov %s, %d\n", RegisterStr, ImmediateValue);
-    } else {
-        printf("mov %s, %d\n", RegisterStr, (int8_t)ImmediateValue);
+    // Only lengths are needed so the prescan finds them without decoding anything
+    uint8_t *Prescanned = malloc(FileInfo.FileSize + 1);
+    if (!Prescanned) {
+        printf("[%s] ERROR: Could not malloc 0x%lx prescanned lengths.\n", __func__, FileInfo.FileSize);
+        exit(1);
+    }
+    PrescanLengths(FileInfo, 0, FileInfo.FileSize, Prescanned);
+    uint64_t ResolvedSize;
+    const uint64_t ResolvedCount = ResolveInstructionLengths(Prescanned, FileInfo.FileSize, &ResolvedSize);
+
+    uint64_t ip = 0;
+    uint64_t Count = 0;
+    uint32_t NextCheckpoint = 0;
+    while (ip < FileInfo.FileSize) {
+        for (; ((uint64_t)NextCheckpoint * IndexCheckpointInterval) <= ip; NextCheckpoint++) {
+            Checkpoints[NextCheckpoint] = (IndexCheckpoint_t){ip, Count};
+        }
+        // An instruction cut off by the end of the bin goes to the decoder, which reports it
+        Instruction_t Instruction;
+        const uint16_t Length =
+            (Count < ResolvedCount) ? Prescanned[Count] : DecodeInstruction(ip, FileInfo, &Instruction);
+        Lengths[Count / 2] |= Length << ((Count & 1) * 4);
+        ip += Length;
+        Count++;
+    }
+    free(Prescanned);
+    // Checkpoints covered entirely by the tail of the last instruction
+    for (; NextCheckpoint < CheckpointCount; NextCheckpoint++) {
+        Checkpoints[NextCheckpoint] = (IndexCheckpoint_t){FileInfo.FileSize, Count};
+    }
+
+    memcpy(Header->Magic, IndexMagic, sizeof(Header->Magic));
+    Header->BinSize = FileInfo.FileSize;
+    Header->InstructionCount = Count;
+    Header->CheckpointInterval = IndexCheckpointInterval;
+    Header->CheckpointCount = CheckpointCount;
+    Output.Used = LengthsOffset + ((Count + 1) / 2);
+    Output.Size = Output.Used;
+
+    const int Fd = open(IndexFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (Fd < 0) {
+        printf("[%s] ERROR: Could not open %s for write\n", __func__, IndexFile);
+        exit(1);
+    }
+    FlushOutput(&Output, Fd);
+    close(Fd);
+    fprintf(stderr, "Indexed %lu instructions into %s, 0x%lx bytes\n", Count, IndexFile,
+            LengthsOffset + ((Count + 1) / 2));
+    free(Output.Data);
+}
+
+// Finds the instruction covering Start through the index and lists from there until End. The checkpoint is a
+// division away and at most one checkpoint interval of lengths gets walked, so the cost only depends on the window.
+void ListIndexedRange(const FileInfo_t FileInfo, const FileInfo_t Index, const uint64_t Start, uint64_t End) {
+    TimeFunction;
+    const IndexHeader_t *Header = (const IndexHeader_t *)Index.Bin;
+    if ((Index.FileSize < sizeof(IndexHeader_t)) || memcmp(Header->Magic, IndexMagic, sizeof(Header->Magic))) {
+        printf("[%s] ERROR: Not a boundary index\n", __func__);
+        exit(1);
+    }
+    // Everything read out of the index below is checked here first, a stale or damaged one has to be rebuilt
+    const size_t LengthsOffset = sizeof(IndexHeader_t) + (Header->CheckpointCount * sizeof(IndexCheckpoint_t));
+    const uint64_t CheckpointCount = (FileInfo.FileSize + IndexCheckpointInterval - 1) / IndexCheckpointInterval;
+    int Valid = (Header->BinSize == FileInfo.FileSize) && (Header->CheckpointInterval == IndexCheckpointInterval) &&
+                (Header->CheckpointCount == CheckpointCount) && (Header->InstructionCount <= FileInfo.FileSize) &&
+                (Index.FileSize >= (LengthsOffset + ((Header->InstructionCount + 1) / 2)));
+    const IndexCheckpoint_t *Checkpoints = (const IndexCheckpoint_t *)(Index.Bin + sizeof(IndexHeader_t));
+    for (uint64_t c = 0; Valid && (c < CheckpointCount); c++) {
+        Valid = (Checkpoints[c].Offset <= FileInfo.FileSize) &&
+                (Checkpoints[c].Instruction <= Header->InstructionCount);
+    }
+    if (!Valid) {
+        printf("[%s] ERROR: Index is for a 0x%lx byte bin, rebuild it with --build-index\n", __func__,
+               Header->BinSize);
+        exit(1);
+    }
+    if (Start >= FileInfo.FileSize) {
+        printf("[%s] ERROR: Range start 0x%lx is beyond the size of the bin 0x%lx\n", __func__, Start,
+               FileInfo.FileSize);
+        exit(1);
     }
+    End = (End > FileInfo.FileSize) ? FileInfo.FileSize : End;
 
-    return BytesRead;
+    const uint8_t *Lengths = Index.Bin + LengthsOffset;
+    // The instruction covering Start can begin in the previous interval
+    uint64_t Checkpoint = Start / Header->CheckpointInterval;
+    while (Checkpoint && (Checkpoints[Checkpoint].Offset > Start)) {
+        Checkpoint--;
+    }
+    uint64_t ip = Checkpoints[Checkpoint].Offset;
+    for (uint64_t i = Checkpoints[Checkpoint].Instruction; i < Header->InstructionCount; i++) {
+        const uint8_t Length = (Lengths[i / 2] >> ((i & 1) * 4)) & 0xf;
+        if ((ip + Length) > Start) {
+            break;
+        }
+        ip += Length;
+    }
+
+    size_t Count;
+    Instruction_t *Instructions = DecodeRange(FileInfo, ip, (End > ip) ? End : (ip + 1), &Count, NULL);
+    OutputBuffer_t Output = CreateOutputBuffer(Count + 1);
+    AppendStr(&Output, "; offset ");
+    AppendUnsigned(&Output, ip);
+    AppendChar(&Output, '\n');
+    for (size_t i = 0; i < Count; i++) {
+        FormatInstruction(&Output, &Instructions[i]);
+    }
+    FlushOutput(&Output, STDOUT_FILENO);
+    free(Output.Data);
+    free(Instructions);
 }
 
-uint16_t RegisterMemToFromRegister(const uint16_t ip, const uint8_t OpcodeByte, const FileInfo_t FileInfo) {
-    const RegMemToFromRegOpcode_t Opcode = {OpcodeByte};
-    const RegMemToFromRegMod_t Mod = {GetByteFromBin(FileInfo, ip + 1)};
+//*****************************************************************************
+// Structured Output
+//*****************************************************************************
+// Two formats for programs rather than people, both written straight from the decoded records. The binary one is a
+// RecordsHeader_t followed by RecordCount InstructionRecord_t, all little endian with no padding between them, so a
+// consumer can mmap the file and index it. NDJSON is one object per instruction for anything that would rather not.
+#define RecordsMagic "8086REC1"
+// Operands and flags give every NDJSON line a hard upper bound well under this
+#define MaxJsonLineLength 512
 
-    switch (Mod.Fields.Mode) {
-    case MemNoDispalcement: {
-        const char *RegMemStr = GetEffectiveAddressStr(Mod.Fields.RegMem);
-        const char *RegisterStr = GetRegisterStr(Mod.Fields.Register, Opcode.Fields.Word);
+typedef enum {
+    FormatText = 0,
+    FormatRecords,
+    FormatNdjson,
+} OutputFormat_t;
 
-        // See asterisk below Table 4-8
-        const uint8_t DirectAddressRM = 6;
-        if (Mod.Fields.RegMem == DirectAddressRM) {
-            const uint16_t Displacement = GetWordFromBin(FileInfo, ip + 2);
-            if (Opcode.Fields.Direction) {
-                printf("mov %s, [%d]\n", RegisterStr, Displacement);
-            } else {
-                printf("mov [%d], %s\n", Displacement, RegisterStr);
-            }
-            return 4;
+typedef struct {
+    char Magic[8];
+    uint32_t RecordSize; // Lets a reader catch a layout it doesn't know
+    uint32_t RecordCount;
+    uint64_t BinSize;
+} RecordsHeader_t;
+
+// Instruction_t plus where it is. Operand types and indices mean the same as in 8086_decode.h.
+typedef struct {
+    uint32_t Offset;
+    uint8_t Length;
+    uint8_t Class; // InstructionClass_t
+    uint8_t Mnemonic;
+    uint8_t Flags;
+    Operand_t Operands[2];
+    uint8_t Opcode;
+    uint8_t ModRM;
+    uint8_t SegmentOverride;
+    uint8_t Reserved;
+    int16_t Displacement;
+    uint16_t Immediate;
+    uint16_t Segment;
+    uint16_t Reserved2;
+} InstructionRecord_t;
+_Static_assert(sizeof(InstructionRecord_t) == 24, "InstructionRecord_t is a file format, keep it 24 bytes");
+
+void WriteRecords(const FileInfo_t FileInfo, const Instruction_t *Instructions, const size_t Count) {
+    TimeFunction;
+    if ((FileInfo.FileSize > UINT32_MAX) || (Count > UINT32_MAX)) {
+        printf("[%s] ERROR: Records only have 32 bit offsets, 0x%lx bytes is too big\n", __func__, FileInfo.FileSize);
+        exit(1);
+    }
+    const size_t Size = sizeof(RecordsHeader_t) + (Count * sizeof(InstructionRecord_t));
+    OutputBuffer_t Output = {calloc(Size, 1), Size, Size};
+    if (!Output.Data) {
+        printf("[%s] ERROR: Could not malloc %lu records.\n", __func__, Count);
+        exit(1);
+    }
+    RecordsHeader_t *Header = (RecordsHeader_t *)Output.Data;
+    memcpy(Header->Magic, RecordsMagic, sizeof(Header->Magic));
+    Header->RecordSize = sizeof(InstructionRecord_t);
+    Header->RecordCount = Count;
+    Header->BinSize = FileInfo.FileSize;
+
+    InstructionRecord_t *Records = (InstructionRecord_t *)(Output.Data + sizeof(RecordsHeader_t));
+    uint32_t ip = 0;
+    for (size_t i = 0; i < Count; i++) {
+        const Instruction_t *Instruction = &Instructions[i];
+        Records[i] = (InstructionRecord_t){
+            .Offset = ip,
+            .Length = Instruction->Length,
+            .Class = GetInstructionClass(Instruction),
+            .Mnemonic = Instruction->Mnemonic,
+            .Flags = Instruction->Flags,
+            .Operands = {Instruction->Operands[0], Instruction->Operands[1]},
+            .Opcode = Instruction->Opcode,
+            .ModRM = Instruction->ModRM,
+            .SegmentOverride = Instruction->SegmentOverride,
+            .Displacement = Instruction->Displacement,
+            .Immediate = Instruction->Immediate,
+            .Segment = Instruction->Segment,
+        };
+        ip += Instruction->Length;
+    }
+    FlushOutput(&Output, STDOUT_FILENO);
+    free(Output.Data);
+}
+
+void AppendJsonOperand(OutputBuffer_t *Output, const Instruction_t *Instruction, const Operand_t Operand,
+                       const uint64_t ip) {
+    switch (Operand.Type) {
+    case OperandRegister:
+        AppendStr(Output, "{\"type\":\"register\",\"name\":\"");
+        AppendStr(Output, GetRegisterStr(Operand.Index & 0x7, Operand.Index >> 3));
+        AppendStr(Output, "\"}");
+        break;
+    case OperandSegmentRegister:
+        AppendStr(Output, "{\"type\":\"segment\",\"name\":\"");
+        AppendStr(Output, GetSegmentRegisterStr(Operand.Index));
+        AppendStr(Output, "\"}");
+        break;
+    case OperandMemory:
+        // Direct addresses have no base, the displacement is the address
+        AppendStr(Output, "{\"type\":\"memory\",\"base\":");
+        if (Operand.Index == EffectiveAddressDirect) {
+            AppendStr(Output, "null,\"displacement\":");
+            AppendUnsigned(Output, (uint16_t)Instruction->Displacement);
         } else {
-            if (Opcode.Fields.Direction) {
-                printf("mov %s, [%s]\n", RegisterStr, RegMemStr);
-            } else {
-                printf("mov [%s], %s\n", RegMemStr, RegisterStr);
+            AppendChar(Output, '"');
+            AppendStr(Output, (Operand.Index < EffectiveAddressDisplacement)
+                                  ? GetEffectiveAddressStr(Operand.Index)
+                                  : GetDisplacementEffectiveAddressStr(Operand.Index - EffectiveAddressDisplacement));
+            AppendStr(Output, "\",\"displacement\":");
+            AppendSigned(Output, (Operand.Index < EffectiveAddressDisplacement) ? 0 : Instruction->Displacement);
+        }
+        if (Instruction->Flags & InstSegment) {
+            AppendStr(Output, ",\"segment\":\"");
+            AppendStr(Output, GetSegmentRegisterStr(Instruction->SegmentOverride));
+            AppendChar(Output, '"');
+        }
+        // Bytes read through the operand: far transfers and lds/les load a 4 byte pointer, lea reads nothing
+        if ((Instruction->Flags & InstFar) || (Instruction->Mnemonic == MnemonicLds) ||
+            (Instruction->Mnemonic == MnemonicLes)) {
+            AppendStr(Output, ",\"size\":4}");
+        } else if (Instruction->Mnemonic == MnemonicLea) {
+            AppendChar(Output, '}');
+        } else {
+            AppendStr(Output, (Instruction->Flags & InstWide) ? ",\"size\":2}" : ",\"size\":1}");
+        }
+        break;
+    case OperandImmediate:
+        AppendStr(Output, "{\"type\":\"immediate\",\"value\":");
+        if (Operand.Index == ImmediateByte) {
+            AppendSigned(Output, (int8_t)Instruction->Immediate);
+        } else if (Operand.Index == ImmediateWord) {
+            AppendSigned(Output, (int16_t)Instruction->Immediate);
+        } else {
+            AppendUnsigned(Output, Instruction->Immediate);
+        }
+        AppendChar(Output, '}');
+        break;
+    case OperandRelative:
+        // Target is a file offset, the jump itself wraps within the 64k segment
+        AppendStr(Output, "{\"type\":\"relative\",\"offset\":");
+        AppendSigned(Output, (int16_t)Instruction->Immediate);
+        AppendStr(Output, ",\"target\":");
+        AppendSigned(Output, (int64_t)ip + Instruction->Length + (int16_t)Instruction->Immediate);
+        AppendChar(Output, '}');
+        break;
+    case OperandFarPointer:
+        AppendStr(Output, "{\"type\":\"far\",\"segment\":");
+        AppendUnsigned(Output, Instruction->Segment);
+        AppendStr(Output, ",\"offset\":");
+        AppendUnsigned(Output, Instruction->Immediate);
+        AppendChar(Output, '}');
+        break;
+    }
+}
+
+void WriteNdjson(const Instruction_t *Instructions, const size_t Count) {
+    TimeFunction;
+    static const char *const FlagNames[] = {"wide", "lock", "rep", "repne", "segment", "far"};
+    OutputBuffer_t Output = CreateOutputBuffer(Count * (MaxJsonLineLength / MaxInstructionTextLength));
+    uint64_t ip = 0;
+    for (size_t i = 0; i < Count; i++) {
+        const Instruction_t *Instruction = &Instructions[i];
+        AppendStr(&Output, "{\"offset\":");
+        AppendUnsigned(&Output, ip);
+        AppendStr(&Output, ",\"length\":");
+        AppendUnsigned(&Output, Instruction->Length);
+        AppendStr(&Output, ",\"mnemonic\":\"");
+        AppendStr(&Output, MnemonicStrs[Instruction->Mnemonic]);
+        AppendStr(&Output, "\",\"class\":\"");
+        AppendStr(&Output, ClassNames[GetInstructionClass(Instruction)]);
+        AppendStr(&Output, "\",\"flags\":[");
+        int Listed = 0;
+        for (int f = 0; f < 6; f++) {
+            if (Instruction->Flags & (1 << f)) {
+                AppendStr(&Output, Listed++ ? ",\"" : "\"");
+                AppendStr(&Output, FlagNames[f]);
+                AppendChar(&Output, '"');
+            }
+        }
+        AppendStr(&Output, "],\"operands\":[");
+        for (int o = 0; (o < 2) && (Instruction->Operands[o].Type != OperandNone); o++) {
+            if (o) {
+                AppendChar(&Output, ',');
             }
-            return 2;
+            AppendJsonOperand(&Output, Instruction, Instruction->Operands[o], ip);
         }
+        // Listing text never has quotes or backslashes in it, so it goes in as is
+        AppendStr(&Output, "],\"text\":\"");
+        FormatInstruction(&Output, Instruction);
+        Output.Used--;
+        AppendStr(&Output, "\"}\n");
+        ip += Instruction->Length;
     }
-    case MemByteDispalcement: {
-        const int8_t Displacement = GetByteFromBin(FileInfo, ip + 2);
-        const char *RegMemStr = GetDisplacementEffectiveAddressStr(Mod.Fields.RegMem);
-        const char *RegisterStr = GetRegisterStr(Mod.Fields.Register, Opcode.Fields.Word);
-        if (Opcode.Fields.Direction) {
-            printf("mov %s, [%s + %d]\n", RegisterStr, RegMemStr, Displacement);
+    FlushOutput(&Output, STDOUT_FILENO);
+    free(Output.Data);
+}
+
+//*****************************************************************************
+// Control Flow Graph
+//*****************************************************************************
+// Recursive descent from the entry points instead of a linear sweep. Only bytes control can reach get decoded, so
+// data mixed in with the code never turns into bogus instructions. Direct jumps, calls and loops are followed,
+// anything indirect or far ends the path. One bit per bin byte marks where a reached instruction starts and another
+// where a basic block has to start, then a walk over the first bitmap in address order cuts the blocks.
+//
+// The binary graph is a GraphHeader_t, BlockCount GraphBlock_t in address order and EdgeCount GraphEdge_t whose
+// From and To index the blocks, all little endian.
+#define GraphMagic "8086CFG1"
+#define MaxEntryPoints 64
+
+typedef enum {
+    GraphDot = 1,
+    GraphBinary,
+} GraphFormat_t;
+
+typedef enum {
+    EdgeFallthrough,
+    EdgeBranch, // Jumps, conditional or not, and loops
+    EdgeCall,
+} EdgeKind_t;
+
+typedef struct {
+    char Magic[8];
+    uint64_t BinSize;
+    uint32_t BlockCount;
+    uint32_t EdgeCount;
+} GraphHeader_t;
+
+typedef struct {
+    uint64_t Start;
+    uint32_t Size; // In bytes
+    uint32_t InstructionCount;
+} GraphBlock_t;
+
+typedef struct {
+    uint32_t From;
+    uint32_t To;
+    uint32_t Kind; // EdgeKind_t
+} GraphEdge_t;
+
+// Edges are collected with the target offset and only turned into a block index once every block is known
+typedef struct {
+    uint32_t From;
+    uint32_t Kind;
+    uint64_t Target;
+} PendingEdge_t;
+
+_Static_assert(sizeof(GraphHeader_t) == 24, "Graph header layout is part of the file format");
+_Static_assert(sizeof(GraphBlock_t) == 16, "Graph block layout is part of the file format");
+_Static_assert(sizeof(GraphEdge_t) == 12, "Graph edge layout is part of the file format");
+
+static const char *const EdgeKindNames[] = {"fallthrough", "branch", "call"};
+
+int TestBit(const uint64_t *Bits, const uint64_t Index) { return (Bits[Index / 64] >> (Index % 64)) & 1; }
+void SetBit(uint64_t *Bits, const uint64_t Index) { Bits[Index / 64] |= 1ull << (Index % 64); }
+
+// Grows a malloc'd array by doubling, the way the batch and fixup lists do.
+void *GrowArray(void *Array, size_t *Capacity, const size_t ElementSize) {
+    *Capacity = *Capacity ? (*Capacity * 2) : 1024;
+    Array = realloc(Array, *Capacity * ElementSize);
+    if (!Array) {
+        printf("[%s] ERROR: Could not grow an array to %lu elements.\n", __func__, *Capacity);
+        exit(1);
+    }
+    return Array;
+}
+
+int FallsThrough(const Instruction_t *Instruction) {
+    const InstructionClass_t Class = GetInstructionClass(Instruction);
+    return (Class != ClassJump) && (Class != ClassReturn) && (Instruction->Mnemonic != MnemonicHlt);
+}
+
+// Where a jmp, jcc, loop or call goes, -1 if it isn't relative or leaves the bin.
+int64_t GetBranchTarget(const Instruction_t *Instruction, const uint64_t ip, const uint64_t Size) {
+    if (Instruction->Operands[0].Type != OperandRelative) {
+        return -1;
+    }
+    const int64_t Target = (int64_t)(ip + Instruction->Length) + (int16_t)Instruction->Immediate;
+    return ((Target >= 0) && ((uint64_t)Target < Size)) ? Target : -1;
+}
+
+uint32_t FindBlock(const GraphBlock_t *Blocks, const uint32_t BlockCount, const uint64_t Offset) {
+    uint32_t Low = 0;
+    uint32_t High = BlockCount;
+    while (Low < High) {
+        const uint32_t Middle = Low + ((High - Low) / 2);
+        if (Blocks[Middle].Start < Offset) {
+            Low = Middle + 1;
         } else {
-            printf("mov [%s + %d], %s\n", RegMemStr, Displacement, RegisterStr);
+            High = Middle;
         }
-        return 3;
     }
-    case MemWordDispalcement: {
-        const int16_t Displacement = GetWordFromBin(FileInfo, ip + 2);
-        const char *RegMemStr = GetDisplacementEffectiveAddressStr(Mod.Fields.RegMem);
-        const char *RegisterStr = GetRegisterStr(Mod.Fields.Register, Opcode.Fields.Word);
-        if (Opcode.Fields.Direction) {
-            printf("mov %s, [%s + %d]\n", RegisterStr, RegMemStr, Displacement);
-        } else {
-            printf("mov [%s + %d], %s\n", RegMemStr, Displacement, RegisterStr);
+    return ((Low < BlockCount) && (Blocks[Low].Start == Offset)) ? Low : UINT32_MAX;
+}
+
+void WriteGraph(const FileInfo_t FileInfo, const uint64_t *EntryPoints, const size_t EntryCount,
+                const GraphFormat_t GraphFormat) {
+    TimeFunction;
+    const size_t BitWords = (FileInfo.FileSize / 64) + 1;
+    uint64_t *Starts = calloc(BitWords, sizeof(uint64_t));
+    uint64_t *Leaders = calloc(BitWords, sizeof(uint64_t));
+    if (!Starts || !Leaders) {
+        printf("[%s] ERROR: Could not malloc bitmaps for a 0x%lx byte bin.\n", __func__, FileInfo.FileSize);
+        exit(1);
+    }
+
+    // Discovery. Every path runs until it hits code already reached, so each byte is decoded at most once per
+    // instruction that starts on it.
+    uint64_t *Worklist = NULL;
+    size_t WorklistCapacity = 0;
+    size_t WorklistCount = 0;
+    for (size_t e = 0; e < EntryCount; e++) {
+        if (EntryPoints[e] >= FileInfo.FileSize) {
+            printf("[%s] ERROR: Entry point 0x%lx is beyond the size of the bin 0x%lx\n", __func__, EntryPoints[e],
+                   FileInfo.FileSize);
+            exit(1);
+        }
+        if (WorklistCount == WorklistCapacity) {
+            Worklist = GrowArray(Worklist, &WorklistCapacity, sizeof(uint64_t));
         }
-        return 4;
+        Worklist[WorklistCount++] = EntryPoints[e];
     }
-    case RegisterMode: {
-        const char *RegMemStr = GetRegisterStr(Mod.Fields.RegMem, Opcode.Fields.Word);
-        const char *RegisterStr = GetRegisterStr(Mod.Fields.Register, Opcode.Fields.Word);
-        if (Opcode.Fields.Direction) {
-            printf("mov %s, %s\n", RegisterStr, RegMemStr);
-        } else {
-            printf("mov %s, %s\n", RegMemStr, RegisterStr);
+    uint64_t Reached = 0;
+    uint64_t ReachedBytes = 0;
+    uint64_t Truncated = 0;
+    uint64_t External = 0;
+    while (WorklistCount) {
+        uint64_t ip = Worklist[--WorklistCount];
+        SetBit(Leaders, ip);
+        while ((ip < FileInfo.FileSize) && !TestBit(Starts, ip)) {
+            Instruction_t Instruction;
+            uint16_t Length;
+            // Targets can land anywhere, including a few bytes short of the end
+            if (Lib8086DecodeOne(FileInfo.Bin + ip, FileInfo.FileSize - ip, &Instruction, &Length) != Lib8086Ok) {
+                Truncated++;
+                break;
+            }
+            SetBit(Starts, ip);
+            Reached++;
+            ReachedBytes += Length;
+
+            const int64_t Target = GetBranchTarget(&Instruction, ip, FileInfo.FileSize);
+            if (Target >= 0) {
+                if (!TestBit(Starts, Target)) {
+                    if (WorklistCount == WorklistCapacity) {
+                        Worklist = GrowArray(Worklist, &WorklistCapacity, sizeof(uint64_t));
+                    }
+                    Worklist[WorklistCount++] = Target;
+                }
+                SetBit(Leaders, Target);
+            } else if (Instruction.Operands[0].Type == OperandRelative) {
+                External++;
+            }
+            ip += Length;
+            if (EndsBasicBlock(&Instruction)) {
+                if (!FallsThrough(&Instruction)) {
+                    break;
+                }
+                if (ip < FileInfo.FileSize) {
+                    SetBit(Leaders, ip);
+                }
+            } else if ((ip < FileInfo.FileSize) && TestBit(Starts, ip)) {
+                // Running into code reached before, only not a leader yet when the two paths overlap
+                SetBit(Leaders, ip);
+            }
         }
-        return 2;
     }
-    default:
-        printf("[%s] ERROR: Can't do register mode %u at byte 0x%x.\n", __func__, Mod.Fields.Mode, ip + 1);
+    free(Worklist);
+
+    // Blocks in address order. A block also ends where the next reached instruction doesn't follow on directly,
+    // which happens when a jump lands inside another instruction, so a block can overlap the one before it.
+    GraphBlock_t *Blocks = NULL;
+    size_t BlockCapacity = 0;
+    uint32_t BlockCount = 0;
+    PendingEdge_t *Pending = NULL;
+    size_t PendingCapacity = 0;
+    size_t PendingCount = 0;
+    // Room for every instruction twice since each line in a DOT label gets longer, plus a line per block and edge
+    OutputBuffer_t Text = {0};
+    if (GraphFormat == GraphDot) {
+        Text = CreateOutputBuffer((Reached * 2) + 2);
+        AppendStr(&Text, "digraph cfg {\n    node [shape=box fontname=\"monospace\"];\n");
+    }
+    uint64_t PreviousEnd = UINT64_MAX;
+    int PreviousEndsBlock = 0;
+    int PreviousFallsThrough = 0;
+    for (size_t w = 0; w < BitWords; w++) {
+        for (uint64_t Bits = Starts[w]; Bits; Bits &= Bits - 1) {
+            const uint64_t ip = (w * 64) + __builtin_ctzll(Bits);
+            Instruction_t Instruction;
+            uint16_t Length;
+            Lib8086DecodeOne(FileInfo.Bin + ip, FileInfo.FileSize - ip, &Instruction, &Length);
+
+            if (!BlockCount || TestBit(Leaders, ip) || (ip != PreviousEnd) || PreviousEndsBlock) {
+                if (BlockCount && PreviousFallsThrough) {
+                    if (PendingCount == PendingCapacity) {
+                        Pending = GrowArray(Pending, &PendingCapacity, sizeof(PendingEdge_t));
+                    }
+                    Pending[PendingCount++] = (PendingEdge_t){BlockCount - 1, EdgeFallthrough, PreviousEnd};
+                }
+                if (BlockCount == BlockCapacity) {
+                    Blocks = GrowArray(Blocks, &BlockCapacity, sizeof(GraphBlock_t));
+                }
+                Blocks[BlockCount++] = (GraphBlock_t){ip, 0, 0};
+                if (GraphFormat == GraphDot) {
+                    if (BlockCount > 1) {
+                        AppendStr(&Text, "\"];\n");
+                    }
+                    AppendStr(&Text, "    b");
+                    AppendUnsigned(&Text, ip);
+                    AppendStr(&Text, " [label=\"");
+                    AppendUnsigned(&Text, ip);
+                    AppendStr(&Text, ":\\l");
+                }
+            }
+            GraphBlock_t *Block = &Blocks[BlockCount - 1];
+            Block->Size = ip + Length - Block->Start;
+            Block->InstructionCount++;
+            if (GraphFormat == GraphDot) {
+                // DOT wants \l instead of the newline to left align the line
+                FormatInstruction(&Text, &Instruction);
+                Text.Used--;
+                AppendStr(&Text, "\\l");
+            }
+
+            const int64_t Target = GetBranchTarget(&Instruction, ip, FileInfo.FileSize);
+            if (Target >= 0) {
+                if (PendingCount == PendingCapacity) {
+                    Pending = GrowArray(Pending, &PendingCapacity, sizeof(PendingEdge_t));
+                }
+                const EdgeKind_t Kind = (GetInstructionClass(&Instruction) == ClassCall) ? EdgeCall : EdgeBranch;
+                Pending[PendingCount++] = (PendingEdge_t){BlockCount - 1, Kind, Target};
+            }
+            PreviousEnd = ip + Length;
+            PreviousEndsBlock = EndsBasicBlock(&Instruction);
+            PreviousFallsThrough = FallsThrough(&Instruction);
+        }
+    }
+    if (BlockCount && PreviousFallsThrough) {
+        if (PendingCount == PendingCapacity) {
+            Pending = GrowArray(Pending, &PendingCapacity, sizeof(PendingEdge_t));
+        }
+        Pending[PendingCount++] = (PendingEdge_t){BlockCount - 1, EdgeFallthrough, PreviousEnd};
+    }
+    free(Starts);
+    free(Leaders);
+
+    // Fallthrough into a truncated instruction is the only way a target doesn't start a block
+    GraphEdge_t *Edges = malloc((PendingCount + 1) * sizeof(GraphEdge_t));
+    if (!Edges) {
+        printf("[%s] ERROR: Could not malloc %lu edges.\n", __func__, PendingCount);
         exit(1);
     }
-}
+    uint32_t EdgeCount = 0;
+    for (size_t p = 0; p < PendingCount; p++) {
+        const uint32_t To = FindBlock(Blocks, BlockCount, Pending[p].Target);
+        if (To != UINT32_MAX) {
+            Edges[EdgeCount++] = (GraphEdge_t){Pending[p].From, To, Pending[p].Kind};
+        }
+    }
+    free(Pending);
 
-// AccumulatorToMemory could be combined with this function because the direction field is the difference
-// in the opcode. I've decided to keep them split so it matches the Intel Spec 1:1.
-uint16_t MemoryToAccumulator(const uint16_t ip, const uint8_t OpcodeByte, const FileInfo_t FileInfo) {
-    const MemoryToAccumulatorOpcode_t Opcode = {OpcodeByte};
-    const uint16_t MemoryAddress = GetWordFromBin(FileInfo, ip + 1);
-    char *Register;
-    if (Opcode.Fields.Word) {
-        Register = "ax";
+    if (GraphFormat == GraphDot) {
+        if (BlockCount) {
+            AppendStr(&Text, "\"];\n");
+        }
+        FlushOutput(&Text, STDOUT_FILENO);
+        // Edge lines are short, a buffer line each is plenty
+        free(Text.Data);
+        Text = CreateOutputBuffer(EdgeCount + 1);
+        for (uint32_t e = 0; e < EdgeCount; e++) {
+            AppendStr(&Text, "    b");
+            AppendUnsigned(&Text, Blocks[Edges[e].From].Start);
+            AppendStr(&Text, " -> b");
+            AppendUnsigned(&Text, Blocks[Edges[e].To].Start);
+            AppendStr(&Text, " [label=\"");
+            AppendStr(&Text, EdgeKindNames[Edges[e].Kind]);
+            AppendStr(&Text, (Edges[e].Kind == EdgeFallthrough) ? "\" style=dashed];\n" : "\"];\n");
+        }
+        AppendStr(&Text, "}\n");
+        FlushOutput(&Text, STDOUT_FILENO);
+        free(Text.Data);
     } else {
-        Register = "al";
+        const size_t BlocksSize = BlockCount * sizeof(GraphBlock_t);
+        const size_t Size = sizeof(GraphHeader_t) + BlocksSize + (EdgeCount * sizeof(GraphEdge_t));
+        OutputBuffer_t Output = {malloc(Size), Size, Size};
+        if (!Output.Data) {
+            printf("[%s] ERROR: Could not malloc a 0x%lx byte graph.\n", __func__, Size);
+            exit(1);
+        }
+        GraphHeader_t *Header = (GraphHeader_t *)Output.Data;
+        memcpy(Header->Magic, GraphMagic, sizeof(Header->Magic));
+        Header->BinSize = FileInfo.FileSize;
+        Header->BlockCount = BlockCount;
+        Header->EdgeCount = EdgeCount;
+        memcpy(Output.Data + sizeof(GraphHeader_t), Blocks, BlocksSize);
+        memcpy(Output.Data + sizeof(GraphHeader_t) + BlocksSize, Edges, EdgeCount * sizeof(GraphEdge_t));
+        FlushOutput(&Output, STDOUT_FILENO);
+        free(Output.Data);
     }
-    printf("mov %s, [%u]\n", Register, MemoryAddress);
-    return 3;
+    fprintf(stderr, "Reached %lu instructions covering 0x%lx of 0x%lx bytes in %u blocks with %u edges", Reached,
+            ReachedBytes, FileInfo.FileSize, BlockCount, EdgeCount);
+    fprintf(stderr, ", %lu branches leave the bin, %lu paths run into the end of it\n", External, Truncated);
+    free(Edges);
+    free(Blocks);
 }
 
-uint16_t AccumulatorToMemory(const uint16_t ip, const uint8_t OpcodeByte, const FileInfo_t FileInfo) {
-    const MemoryToAccumulatorOpcode_t Opcode = {OpcodeByte};
-    const uint16_t MemoryAddress = GetWordFromBin(FileInfo, ip + 1);
-    char *Register;
-    if (Opcode.Fields.Word) {
-        Register = "ax";
-    } else {
-        Register = "al";
+//*****************************************************************************
+// Round Trip Verification
+//*****************************************************************************
+#define MaxReportedMismatches 16
+
+// Decodes every instruction, encodes the record again and compares with the bin. Bytes that don't match are decoded
+// once more, if that gives back the same record the bin just used prefixes the encoder writes differently. Anything
+// else is a decoder or encoder bug. Returns the number of bugs.
+uint64_t VerifyRoundTrip(const FileInfo_t FileInfo) {
+    TimeFunction;
+    uint64_t Count = 0;
+    uint64_t Reordered = 0;
+    uint64_t Mismatches = 0;
+    const double StartTime = GetSeconds();
+
+    uint64_t ip = 0;
+    while (ip < FileInfo.FileSize) {
+        Instruction_t Instruction;
+        uint8_t Bytes[MaxInstructionLength];
+        const uint16_t Length = DecodeInstruction(ip, FileInfo, &Instruction);
+        const uint16_t EncodedLength = EncodeInstruction(&Instruction, Bytes);
+        if ((EncodedLength != Length) || memcmp(Bytes, FileInfo.Bin + ip, Length)) {
+            const FileInfo_t Encoded = {EncodedLength, Bytes, 0};
+            Instruction_t Redecoded;
+            DecodeInstruction(0, Encoded, &Redecoded);
+            // Length is the one field prefixes are allowed to change
+            Redecoded.Length = Instruction.Length;
+            if (!memcmp(&Redecoded, &Instruction, sizeof(Instruction))) {
+                Reordered++;
+            } else if (Mismatches++ < MaxReportedMismatches) {
+                OutputBuffer_t Output = CreateOutputBuffer(1);
+                FormatInstruction(&Output, &Instruction);
+                Output.Data[Output.Used - 1] = 0;
+                printf("0x%lx: %s:", ip, Output.Data);
+                for (uint16_t i = 0; i < Length; i++) {
+                    printf(" %02x", FileInfo.Bin[ip + i]);
+                }
+                printf(" encoded as");
+                for (uint16_t i = 0; i < EncodedLength; i++) {
+                    printf(" %02x", Bytes[i]);
+                }
+                printf("\n");
+                free(Output.Data);
+            }
+        }
+        ip += Length;
+        Count++;
+    }
+
+    const double Seconds = GetSeconds() - StartTime;
+    printf("%lu instructions round tripped in %.3fs (%.2fM instr/s), %lu only differ in prefixes, %lu mismatched\n",
+           Count, Seconds, Count / (Seconds * 1e6), Reordered, Mismatches);
+    return Mismatches;
+}
+
+//*****************************************************************************
+// Dispatch Benchmark
+//*****************************************************************************
+// Walks the whole bin over and over without printing so the cost of output doesn't hide the cost of decoding. The
+// first two methods only do dispatch and length decode, the third fills a full Instruction_t. Formatting is timed
+// separately at the end.
+void BenchmarkDispatch(const FileInfo_t FileInfo) {
+    const uint64_t TargetInstructions = 100000000;
+    const char *Names[] = {"mask chain", "opcode table", "full decode"};
+    // Every pass over an empty bin is free, the loops below would never get to TargetInstructions
+    if (!FileInfo.FileSize) {
+        printf("Nothing to benchmark, the bin is empty\n");
+        return;
+    }
+
+    for (int Method = 0; Method < 3; Method++) {
+        uint64_t Instructions = 0;
+        uint64_t Checksum = 0;
+        uint64_t ip = 0;
+        uint16_t Length = 1;
+        const double Start = GetSeconds();
+        while (Length && (Instructions < TargetInstructions)) {
+            ip = 0;
+            while (ip < FileInfo.FileSize) {
+                const uint8_t OpcodeByte = GetByteFromBin(FileInfo, ip);
+                if (Method == 2) {
+                    Instruction_t Instruction;
+                    Length = DecodeInstruction(ip, FileInfo, &Instruction);
+                    Checksum += Instruction.Mnemonic;
+                } else {
+                    const OpcodeEntry_t Entry = Method ? OpcodeTable[OpcodeByte] : DispatchByMaskChain(OpcodeByte);
+                    Length = GetInstructionLength(ip, Entry, FileInfo);
+                    Checksum += Entry.Class;
+                }
+                if (!Length) {
+                    break;
+                }
+                ip += Length;
+                Instructions++;
+            }
+        }
+        const double Elapsed = GetSeconds() - Start;
+        if (!Length) {
+            printf("%-12s: skipped, can't process instruction %x at address %lx\n", Names[Method],
+                   GetByteFromBin(FileInfo, ip), ip);
+            continue;
+        }
+        printf("%-12s: %lu instructions in %.3fs, %.1f M instructions/sec (checksum %lu)\n", Names[Method],
+               Instructions, Elapsed, ((double)Instructions / Elapsed) / 1e6, Checksum);
+    }
+
+    // Formatting pass on its own, over records that are already decoded
+    size_t Count;
+    Instruction_t *Records = DecodeBin(FileInfo, &Count);
+    OutputBuffer_t Output = CreateOutputBuffer(Count);
+    uint64_t Instructions = 0;
+    uint64_t Bytes = 0;
+    const double Start = GetSeconds();
+    while (Count && (Instructions < TargetInstructions)) {
+        Output.Used = 0;
+        for (size_t i = 0; i < Count; i++) {
+            FormatInstruction(&Output, &Records[i]);
+        }
+        Instructions += Count;
+        Bytes += Output.Used;
     }
-    printf("mov [%u], %s\n", MemoryAddress, Register);
-    return 3;
+    const double Elapsed = GetSeconds() - Start;
+    printf("%-12s: %lu instructions in %.3fs, %.1f M instructions/sec (%.1f MB/s of text)\n", "format", Instructions,
+           Elapsed, ((double)Instructions / Elapsed) / 1e6, ((double)Bytes / Elapsed) / 1e6);
+    free(Output.Data);
+    free(Records);
 }
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
+    BeginProfile();
+    int Benchmark = 0;
+    int BenchmarkThreads = 0;
+    int Stream = 0;
+    int ThreadCount = 0;
+    int ShowClocks = 0;
+    int ShowStats = 0;
+    int Verify = 0;
+    OutputFormat_t Format = FormatText;
+    const char *BatchList = NULL;
+    const char *BatchOutputDir = NULL;
+    const char *BuildIndexFile = NULL;
+    const char *IndexFile = NULL;
+    uint64_t RangeStart = 0;
+    uint64_t RangeEnd = 0;
+    GraphFormat_t GraphFormat = 0;
+    uint64_t EntryPoints[MaxEntryPoints] = {0};
+    size_t EntryCount = 0;
+    int ArgIndex = 1;
+    for (; (ArgIndex < argc) && !strncmp(argv[ArgIndex], "--", 2); ArgIndex++) {
+        if (!strcmp(argv[ArgIndex], "--bench-dispatch")) {
+            Benchmark = 1;
+        } else if (!strcmp(argv[ArgIndex], "--bench-parallel")) {
+            BenchmarkThreads = 1;
+        } else if (!strcmp(argv[ArgIndex], "--stream")) {
+            Stream = 1;
+        } else if (!strcmp(argv[ArgIndex], "--profile")) {
+            // Printed however main exits
+            atexit(EndAndPrintProfile);
+        } else if (!strcmp(argv[ArgIndex], "--batch") && ((ArgIndex + 1) < argc)) {
+            BatchList = argv[++ArgIndex];
+        } else if (!strcmp(argv[ArgIndex], "--out-dir") && ((ArgIndex + 1) < argc)) {
+            BatchOutputDir = argv[++ArgIndex];
+        } else if (!strcmp(argv[ArgIndex], "--format") && ((ArgIndex + 1) < argc)) {
+            const char *Name = argv[++ArgIndex];
+            if (!strcmp(Name, "records")) {
+                Format = FormatRecords;
+            } else if (!strcmp(Name, "ndjson")) {
+                Format = FormatNdjson;
+            } else if (strcmp(Name, "text")) {
+                printf("ERROR: Unknown format %s\n", Name);
+                exit(1);
+            }
+        } else if (!strcmp(argv[ArgIndex], "--verify")) {
+            Verify = 1;
+        } else if (!strcmp(argv[ArgIndex], "--stats")) {
+            ShowStats = 1;
+        } else if (!strcmp(argv[ArgIndex], "--clocks")) {
+            ShowClocks = 1;
+        } else if (!strcmp(argv[ArgIndex], "--build-index") && ((ArgIndex + 1) < argc)) {
+            BuildIndexFile = argv[++ArgIndex];
+        } else if (!strcmp(argv[ArgIndex], "--index") && ((ArgIndex + 3) < argc)) {
+            // Offsets take 0x for hex
+            IndexFile = argv[++ArgIndex];
+            RangeStart = strtoull(argv[++ArgIndex], NULL, 0);
+            RangeEnd = strtoull(argv[++ArgIndex], NULL, 0);
+        } else if (!strcmp(argv[ArgIndex], "--cfg") && ((ArgIndex + 1) < argc)) {
+            const char *Name = argv[++ArgIndex];
+            if (!strcmp(Name, "dot")) {
+                GraphFormat = GraphDot;
+            } else if (!strcmp(Name, "graph")) {
+                GraphFormat = GraphBinary;
+            } else {
+                printf("ERROR: Unknown graph format %s\n", Name);
+                exit(1);
+            }
+        } else if (!strcmp(argv[ArgIndex], "--entry") && ((ArgIndex + 1) < argc)) {
+            if (EntryCount == MaxEntryPoints) {
+                printf("ERROR: At most %d entry points\n", MaxEntryPoints);
+                exit(1);
+            }
+            EntryPoints[EntryCount++] = strtoull(argv[++ArgIndex], NULL, 0);
+        } else if (!strcmp(argv[ArgIndex], "--parallel") && ((ArgIndex + 1) < argc)) {
+            // 0 means one thread per core
+            ThreadCount = atoi(argv[++ArgIndex]);
+            ThreadCount = (ThreadCount > 0) ? ThreadCount : GetDefaultThreadCount();
+        } else {
+            printf("ERROR: Unknown option %s\n", argv[ArgIndex]);
+            exit(1);
+        }
+    }
+    if ((ArgIndex >= argc) && !BatchList) {
         printf("ERROR: Must provide path to input bin file on commandline.\n");
+        printf("Usage: %s [--bench-dispatch] [--bench-parallel] [--stream] [--parallel <threads>]\n"
+               "       [--clocks] [--stats] [--verify] [--profile] [--build-index <index>]\n"
+               "       [--index <index> <start> <end>] [--format text|records|ndjson]\n"
+               "       [--cfg dot|graph] [--entry <offset>]... <bin>\n"
+               "   or: %s --batch <list or directory> [--out-dir <directory>] [--parallel <threads>]\n",
+               argv[0], argv[0]);
+        printf("       - reads the bin from stdin, 0 threads means one per core\n");
+        printf("       --clocks adds 8086 clock estimates with running and basic block totals\n");
+        printf("       --stats prints histograms of instruction class, mode, addressing, width and length\n");
+        printf("       --verify encodes every decoded instruction again and compares it with the bin\n");
+        printf("       --build-index writes instruction boundaries, --index lists start to end using them\n");
+        printf("       --format records writes fixed size binary records, ndjson one JSON object per line\n");
+        printf("       --cfg follows control flow from the entry points, offset 0 by default, and writes the basic\n"
+               "             blocks and edges as a DOT graph or binary records\n");
+        printf("       --batch decodes every file in a list or directory, to <bin name>.asm files with --out-dir\n");
+        printf("       --profile prints where the time went to stderr, per block when built with PROFILER=1\n");
+        exit(1);
+    }
+    // Each of these decides what gets written, so any two together would leave one of them silently ignored.
+    // --parallel with --batch is the worker count rather than a mode, and building an index can go with listing it.
+    const int ModeCount = !!BatchList + (Benchmark || BenchmarkThreads) + Stream + (ThreadCount && !BatchList) +
+                          ShowClocks + ShowStats + Verify + (BuildIndexFile || IndexFile) + (Format != FormatText) +
+                          !!GraphFormat;
+    if (ModeCount > 1) {
+        printf("ERROR: Only one of --batch, --bench-dispatch/--bench-parallel, --stream, --parallel, --clocks, "
+               "--stats, --verify, --build-index/--index, --format and --cfg at a time\n");
+        exit(1);
     }
+    if (EntryCount && !GraphFormat) {
+        printf("ERROR: --entry only means anything with --cfg\n");
+        exit(1);
+    }
+    if (BatchOutputDir && !BatchList) {
+        printf("ERROR: --out-dir only means anything with --batch\n");
+        exit(1);
+    }
+    if (BatchList) {
+        // Threads here are workers each taking whole files
+        const int Workers = ThreadCount ? ThreadCount : GetDefaultThreadCount();
+        return DecodeBatch(BatchList, BatchOutputDir, Workers) ? 1 : 0;
+    }
+    const char *BinFile = argv[ArgIndex];
 
-    FileInfo_t FileInfo = LoadBin(argv[1]);
-    uint16_t ip = 0;
-    while (ip < FileInfo.FileSize) {
-        uint8_t OpcodeByte = GetByteFromBin(FileInfo, ip);
-
-        // Table 4-12
-        const uint8_t ImmediateToRegisterMask = 0xf0;
-        const uint8_t ImmediateToRegisterOpcode = 0xb0;
-        const uint8_t RegisterMemToFromRegisterMask = 0xfc;
-        const uint8_t RegisterMemToFromRegisterOpcode = 0x88;
-        const uint8_t ImmediateToRegisterMemMask = 0xfe;
-        const uint8_t ImmediateToRegisterMemOpcode = 0xc6;
-        const uint8_t MemoryToAccumulatorMask = 0xfe;
-        const uint8_t MemoryToAccumulatorOpcode = 0xa0;
-        const uint8_t AccumulatorToMemoryMask = 0xfe;
-        const uint8_t AccumulatorToMemoryOpcode = 0xa2;
-
-        // Must check for immediate first in case other opcodes would alias to this one because so few bits
-        // are checked.
-        if ((OpcodeByte & ImmediateToRegisterMask) == ImmediateToRegisterOpcode) {
-            ip += ImmediateToRegister(ip, OpcodeByte, FileInfo);
-        } else if ((OpcodeByte & RegisterMemToFromRegisterMask) == RegisterMemToFromRegisterOpcode) {
-            ip += RegisterMemToFromRegister(ip, OpcodeByte, FileInfo);
-        } else if ((OpcodeByte & ImmediateToRegisterMemMask) == ImmediateToRegisterMemOpcode) {
-            ip += ImmediateToRegisterMem(ip, OpcodeByte, FileInfo);
-        } else if ((OpcodeByte & MemoryToAccumulatorMask) == MemoryToAccumulatorOpcode) {
-            ip += MemoryToAccumulator(ip, OpcodeByte, FileInfo);
-        } else if ((OpcodeByte & AccumulatorToMemoryMask) == AccumulatorToMemoryOpcode) {
-            ip += AccumulatorToMemory(ip, OpcodeByte, FileInfo);
+    if (Stream) {
+        const int Fd = OpenBin(BinFile);
+        DecodeStream(Fd, BinFile);
+        if (Fd != STDIN_FILENO) {
+            close(Fd);
+        }
+        return 0;
+    }
+
+    FileInfo_t FileInfo = LoadBin(BinFile);
+    if (Benchmark || BenchmarkThreads) {
+        if (Benchmark) {
+            BenchmarkDispatch(FileInfo);
+        }
+        if (BenchmarkThreads) {
+            BenchmarkParallel(FileInfo);
+        }
+        UnloadBin(FileInfo);
+        return 0;
+    }
+
+    if (BuildIndexFile || IndexFile) {
+        if (BuildIndexFile) {
+            BuildIndex(FileInfo, BuildIndexFile);
+        }
+        if (IndexFile) {
+            FileInfo_t Index = LoadBin(IndexFile);
+            ListIndexedRange(FileInfo, Index, RangeStart, RangeEnd);
+            UnloadBin(Index);
+        }
+        UnloadBin(FileInfo);
+        return 0;
+    }
+
+    if (GraphFormat) {
+        if (!EntryCount) {
+            EntryCount = 1;
+        }
+        WriteGraph(FileInfo, EntryPoints, EntryCount, GraphFormat);
+        UnloadBin(FileInfo);
+        return 0;
+    }
+
+    if (Verify) {
+        const uint64_t Mismatches = VerifyRoundTrip(FileInfo);
+        UnloadBin(FileInfo);
+        return Mismatches ? 1 : 0;
+    }
+
+    if (ShowStats) {
+        Statistics_t Stats = {0};
+        CollectStatistics(FileInfo, &Stats);
+        PrintStatistics(&Stats);
+        UnloadBin(FileInfo);
+        return 0;
+    }
+
+    if (ThreadCount) {
+        size_t ChunkCount;
+        Chunk_t *Chunks = DecodeParallel(FileInfo, ThreadCount, &ChunkCount);
+        for (size_t c = 0; c < ChunkCount; c++) {
+            FlushOutput(&Chunks[c].Output, STDOUT_FILENO);
+        }
+        FreeChunks(Chunks, ChunkCount);
+        UnloadBin(FileInfo);
+        return 0;
+    }
+
+    // Decode everything first, then format it all into one buffer that goes out with a single write
+    size_t Count;
+    Instruction_t *Instructions;
+    {
+        TimeBandwidth("Decode", FileInfo.FileSize);
+        Instructions = DecodeBin(FileInfo, &Count);
+    }
+    if (Format != FormatText) {
+        if (Format == FormatRecords) {
+            WriteRecords(FileInfo, Instructions, Count);
         } else {
-            printf("[%s] ERROR: Trying to process instruction %x at address %x\n", __func__, OpcodeByte, ip);
-            exit(1);
+            WriteNdjson(Instructions, Count);
+        }
+        free(Instructions);
+        UnloadBin(FileInfo);
+        return 0;
+    }
+    if (ShowClocks) {
+        // Room for the annotation and a block total line on top of each instruction
+        OutputBuffer_t Output = CreateOutputBuffer(Count * 3);
+        uint64_t Total = 0;
+        uint64_t BlockTotal = 0;
+        for (size_t i = 0; i < Count; i++) {
+            FormatInstruction(&Output, &Instructions[i]);
+            FormatClocks(&Output, &Instructions[i], &Total, &BlockTotal);
+        }
+        if (BlockTotal) {
+            AppendStr(&Output, "; block: ");
+            AppendUnsigned(&Output, BlockTotal);
+            AppendStr(&Output, " clocks\n");
+        }
+        AppendStr(&Output, "; total: ");
+        AppendUnsigned(&Output, Total);
+        AppendStr(&Output, " clocks\n");
+        FlushOutput(&Output, STDOUT_FILENO);
+        free(Output.Data);
+        free(Instructions);
+        UnloadBin(FileInfo);
+        return 0;
+    }
+
+    OutputBuffer_t Output = CreateOutputBuffer(Count);
+    {
+        TimeBlock("Format");
+        for (size_t i = 0; i < Count; i++) {
+            FormatInstruction(&Output, &Instructions[i]);
         }
     }
-    free((void *)FileInfo.Bin);
+    FlushOutput(&Output, STDOUT_FILENO);
+
+    free(Output.Data);
+    free(Instructions);
+    UnloadBin(FileInfo);
 
     return 0;
 }
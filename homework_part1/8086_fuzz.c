@@ -0,0 +1,361 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "8086_decode.h"
+#include "lib8086decode.h"
+
+// Fuzz target for the decoder. Built with -DLIBFUZZER=1 it's a plain LLVMFuzzerTestOneInput for clang's libFuzzer,
+// otherwise it comes with its own driver that mutates a seed corpus, keeps inputs that reach decoder states it
+// hasn't seen and reports execs/sec. Every input goes through lib8086decode so a bad one can only fail a check,
+// and a failed check aborts so both drivers (and the sanitizers) stop right on it.
+#ifndef LIBFUZZER
+#define LIBFUZZER 0
+#endif
+
+#define MaxFuzzInputSize 256
+#define FuzzFeatureBits (64 * 1024)
+
+//*****************************************************************************
+// Fuzz Target
+//*****************************************************************************
+static uint8_t FuzzFeatures[FuzzFeatureBits / 8]; // Driver only, libFuzzer brings its own coverage
+
+void FuzzCheck(const int Condition, const char *What, const uint8_t *Data, const size_t Size, const size_t Offset) {
+    if (Condition) {
+        return;
+    }
+    printf("[%s] ERROR: %s at offset 0x%lx of a %lu byte input:", __func__, What, Offset, Size);
+    for (size_t i = 0; i < Size; i++) {
+        printf(" %02x", Data[i]);
+    }
+    printf("\n");
+    fflush(stdout);
+    abort();
+}
+
+// Returns how many decoder states it reached that no input has before.
+size_t FuzzOne(const uint8_t *Data, const size_t Size) {
+    Instruction_t Instructions[MaxFuzzInputSize];
+    uint8_t Prescanned[MaxFuzzInputSize];
+    size_t Count;
+    size_t Consumed;
+    const Lib8086Status_t Status =
+        Lib8086DecodeBatch(Data, Size, Instructions, MaxFuzzInputSize, &Count, &Consumed);
+    FuzzCheck((Status == Lib8086Ok) || (Status == Lib8086Truncated), "unexpected status", Data, Size, Consumed);
+    FuzzCheck((Status == Lib8086Ok) ? (Consumed == Size) : ((Size - Consumed) < MaxInstructionLength),
+              "decoding stopped early", Data, Size, Consumed);
+
+    // The prescan has to find the same boundaries the handlers do
+    const FileInfo_t FileInfo = {Size, Data, 0};
+    uint64_t ResolvedSize;
+    PrescanLengths(FileInfo, 0, Size, Prescanned);
+    const uint64_t ResolvedCount = ResolveInstructionLengths(Prescanned, Size, &ResolvedSize);
+    FuzzCheck((ResolvedCount == Count) && (ResolvedSize == Consumed), "prescan disagrees", Data, Size, ResolvedSize);
+
+    size_t NewFeatures = 0;
+    size_t ip = 0;
+    for (size_t i = 0; i < Count; i++) {
+        const Instruction_t *Instruction = &Instructions[i];
+        FuzzCheck((Instruction->Length > 0) && (Instruction->Length <= MaxInstructionLength), "bad length", Data, Size,
+                  ip);
+        FuzzCheck(Prescanned[i] == Instruction->Length, "prescan length differs", Data, Size, ip);
+
+        char Text[MaxInstructionTextLength];
+        size_t TextLength;
+        FuzzCheck(Lib8086Format(Instruction, Text, sizeof(Text), &TextLength) == Lib8086Ok, "text too long", Data,
+                  Size, ip);
+
+        // Same round trip as decoder3 --verify
+        uint8_t Bytes[MaxInstructionLength];
+        const uint16_t EncodedLength = EncodeInstruction(Instruction, Bytes);
+        if ((EncodedLength != Instruction->Length) || memcmp(Bytes, Data + ip, EncodedLength)) {
+            Instruction_t Redecoded;
+            uint16_t RedecodedLength;
+            FuzzCheck(Lib8086DecodeOne(Bytes, EncodedLength, &Redecoded, &RedecodedLength) == Lib8086Ok,
+                      "encoding doesn't decode", Data, Size, ip);
+            Redecoded.Length = Instruction->Length;
+            FuzzCheck(!memcmp(&Redecoded, Instruction, sizeof(Redecoded)), "round trip mismatch", Data, Size, ip);
+        }
+
+        if (!LIBFUZZER) {
+            // Opcode, mod, reg, r/m 110 or not, prefixes and operand types stand in for the branches the handlers took
+            const uint32_t Feature = ((Instruction->Opcode << 6) | ((Instruction->ModRM & 0xf8) >> 2) |
+                                      ((Instruction->ModRM & 0x7) == EffectiveAddressDirect)) ^
+                                     ((Instruction->Flags & ~InstWide) << 11) ^
+                                     (((Instruction->Operands[0].Type << 3) | Instruction->Operands[1].Type) << 5) ^
+                                     (Instruction->Mnemonic * 0x9e37);
+            const uint32_t Bit = Feature % FuzzFeatureBits;
+            NewFeatures += !(FuzzFeatures[Bit / 8] & (1 << (Bit % 8)));
+            FuzzFeatures[Bit / 8] |= 1 << (Bit % 8);
+        }
+        ip += Instruction->Length;
+    }
+    return NewFeatures;
+}
+
+#if LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size) {
+    FuzzOne(Data, (Size > MaxFuzzInputSize) ? MaxFuzzInputSize : Size);
+    return 0;
+}
+
+#else
+
+//*****************************************************************************
+// Seed Corpus
+//*****************************************************************************
+typedef struct {
+    uint8_t Data[MaxFuzzInputSize];
+    size_t Size;
+} FuzzInput_t;
+
+typedef struct {
+    FuzzInput_t *Inputs;
+    size_t Count;
+    size_t Capacity;
+} FuzzCorpus_t;
+
+void AddToCorpus(FuzzCorpus_t *Corpus, const uint8_t *Data, const size_t Size) {
+    if (Corpus->Count == Corpus->Capacity) {
+        Corpus->Capacity = Corpus->Capacity ? (Corpus->Capacity * 2) : 256;
+        Corpus->Inputs = realloc(Corpus->Inputs, Corpus->Capacity * sizeof(FuzzInput_t));
+        if (!Corpus->Inputs) {
+            printf("[%s] ERROR: Could not grow the corpus to %lu inputs.\n", __func__, Corpus->Capacity);
+            exit(1);
+        }
+    }
+    FuzzInput_t *Input = &Corpus->Inputs[Corpus->Count++];
+    Input->Size = (Size > MaxFuzzInputSize) ? MaxFuzzInputSize : Size;
+    memcpy(Input->Data, Data, Input->Size);
+}
+
+// One seed per opcode handler holding every opcode that goes to it, each with mod r/m bytes that walk through all four
+// modes and all eight reg values, so every group member and displacement size is in there somewhere. Prefixes get
+// paired with a string op and a memory operand.
+void GenerateSeeds(FuzzCorpus_t *Corpus) {
+    static const uint8_t ModRMs[] = {0x00, 0x06, 0x0f, 0x16, 0x1e, 0x27, 0x28, 0x31, 0x39, 0x44, 0x4d, 0x52,
+                                     0x5b, 0x65, 0x6e, 0x77, 0x7a, 0x83, 0x8c, 0x95, 0x9e, 0xa7, 0xae, 0xb1,
+                                     0xbc, 0xc0, 0xc9, 0xd2, 0xdb, 0xe4, 0xed, 0xf6, 0xff};
+    static const uint8_t Filler[] = {0x12, 0x34, 0x56, 0x78, 0x9a, 0xbc};
+    int Seeded[256] = {0};
+    for (int First = 0; First < 256; First++) {
+        if (Seeded[First]) {
+            continue;
+        }
+        uint8_t Seed[MaxFuzzInputSize];
+        size_t Size = 0;
+        for (int Opcode = First; Opcode < 256; Opcode++) {
+            if (Seeded[Opcode] || (OpcodeTable[Opcode].Handler != OpcodeTable[First].Handler)) {
+                continue;
+            }
+            Seeded[Opcode] = 1;
+            // Without a mod r/m byte the variants would all be the same instruction
+            const uint8_t Layout = OpcodeTable[Opcode].Layout;
+            const int HasModRM = (Layout >= OperandsModRM) && (Layout <= OperandsGroup3Imm16);
+            const size_t Variants = (HasModRM || (Layout == OperandsPrefix)) ? sizeof(ModRMs) : 1;
+            for (size_t m = 0; m < Variants; m++) {
+                uint8_t Candidate[MaxInstructionLength] = {Opcode, ModRMs[m]};
+                memcpy(Candidate + 2, Filler, sizeof(Filler));
+                if (Layout == OperandsPrefix) {
+                    Candidate[1] = (m & 1) ? 0xa5 : 0x89;
+                    Candidate[2] = ModRMs[m];
+                }
+                // Keep only the bytes the instruction really uses so the seed stays one clean stream
+                Instruction_t Instruction;
+                uint16_t Length;
+                Lib8086DecodeOne(Candidate, sizeof(Candidate), &Instruction, &Length);
+                if ((Size + Length) > sizeof(Seed)) {
+                    AddToCorpus(Corpus, Seed, Size);
+                    Size = 0;
+                }
+                memcpy(Seed + Size, Candidate, Length);
+                Size += Length;
+            }
+        }
+        AddToCorpus(Corpus, Seed, Size);
+    }
+}
+
+void WriteSeeds(const FuzzCorpus_t *Corpus, const char *Directory) {
+    mkdir(Directory, 0755);
+    for (size_t i = 0; i < Corpus->Count; i++) {
+        char Path[4096];
+        snprintf(Path, sizeof(Path), "%s/seed_%03lu.bin", Directory, i);
+        FILE *Stream = fopen(Path, "wb");
+        if (!Stream || (fwrite(Corpus->Inputs[i].Data, 1, Corpus->Inputs[i].Size, Stream) != Corpus->Inputs[i].Size)) {
+            printf("[%s] ERROR: Could not write %s\n", __func__, Path);
+            exit(1);
+        }
+        fclose(Stream);
+    }
+    printf("Wrote %lu seeds to %s\n", Corpus->Count, Directory);
+}
+
+// Anything already in a corpus directory joins the generated seeds, the first MaxFuzzInputSize bytes of it at least.
+void LoadCorpusDirectory(FuzzCorpus_t *Corpus, const char *Directory) {
+    DIR *Dir = opendir(Directory);
+    if (!Dir) {
+        printf("[%s] ERROR: Could not open %s\n", __func__, Directory);
+        exit(1);
+    }
+    const struct dirent *Entry;
+    while ((Entry = readdir(Dir))) {
+        char Path[4096];
+        snprintf(Path, sizeof(Path), "%s/%s", Directory, Entry->d_name);
+        FILE *Stream = fopen(Path, "rb");
+        if (!Stream) {
+            continue;
+        }
+        uint8_t Data[MaxFuzzInputSize];
+        const size_t Size = fread(Data, 1, sizeof(Data), Stream);
+        fclose(Stream);
+        if (Size) {
+            AddToCorpus(Corpus, Data, Size);
+        }
+    }
+    closedir(Dir);
+}
+
+//*****************************************************************************
+// Driver
+//*****************************************************************************
+// xorshift64 like the bench corpus generator
+uint64_t NextRandom(uint64_t *State) {
+    uint64_t x = *State;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *State = x;
+    return x;
+}
+
+// A few of the usual byte level mutations. Prefix and mod r/m bytes are favoured since that's where the decoder
+// branches.
+size_t Mutate(uint8_t *Data, size_t Size, const FuzzCorpus_t *Corpus, uint64_t *Random) {
+    static const uint8_t Interesting[] = {0x26, 0x2e, 0x36, 0x3e, 0xf0, 0xf2, 0xf3, 0x06, 0x46, 0x86, 0xc0, 0xff};
+    const int Mutations = 1 + (NextRandom(Random) % 4);
+    for (int m = 0; m < Mutations; m++) {
+        const uint64_t r = NextRandom(Random);
+        const size_t At = Size ? ((r >> 8) % Size) : 0;
+        switch (r % 6) {
+        case 0:
+            if (Size) {
+                Data[At] ^= 1 << ((r >> 32) % 8);
+            }
+            break;
+        case 1:
+            if (Size) {
+                Data[At] = r >> 32;
+            }
+            break;
+        case 2:
+            if (Size) {
+                Data[At] = Interesting[(r >> 32) % sizeof(Interesting)];
+            }
+            break;
+        case 3:
+            if (Size < MaxFuzzInputSize) {
+                memmove(Data + At + 1, Data + At, Size - At);
+                Data[At] = r >> 32;
+                Size++;
+            }
+            break;
+        case 4:
+            if (Size > 1) {
+                memmove(Data + At, Data + At + 1, Size - At - 1);
+                Size--;
+            }
+            break;
+        case 5: {
+            // Splice the tail of another input on
+            const FuzzInput_t *Other = &Corpus->Inputs[(r >> 32) % Corpus->Count];
+            const size_t From = Other->Size ? ((r >> 16) % Other->Size) : 0;
+            const size_t Length = (Other->Size - From) < (MaxFuzzInputSize - At) ? (Other->Size - From)
+                                                                                 : (MaxFuzzInputSize - At);
+            memcpy(Data + At, Other->Data + From, Length);
+            Size = At + Length;
+            break;
+        }
+        }
+    }
+    return Size;
+}
+
+int main(int argc, char *argv[]) {
+    double Seconds = 10;
+    uint64_t Random = 1;
+    const char *SeedDirectory = NULL;
+    const char *CorpusDirectory = NULL;
+    for (int ArgIndex = 1; ArgIndex < argc; ArgIndex++) {
+        if (!strcmp(argv[ArgIndex], "--seconds") && ((ArgIndex + 1) < argc)) {
+            Seconds = atof(argv[++ArgIndex]);
+        } else if (!strcmp(argv[ArgIndex], "--seed") && ((ArgIndex + 1) < argc)) {
+            Random = strtoull(argv[++ArgIndex], NULL, 0);
+            Random = Random ? Random : 1;
+        } else if (!strcmp(argv[ArgIndex], "--write-seeds") && ((ArgIndex + 1) < argc)) {
+            SeedDirectory = argv[++ArgIndex];
+        } else if (!strncmp(argv[ArgIndex], "--", 2)) {
+            printf("ERROR: Unknown option %s\n", argv[ArgIndex]);
+            printf("Usage: %s [--seconds <n>] [--seed <n>] [--write-seeds <directory>] [<corpus directory>]\n",
+                   argv[0]);
+            printf("       --write-seeds writes the generated seed corpus, for libFuzzer, and exits\n");
+            exit(1);
+        } else {
+            CorpusDirectory = argv[ArgIndex];
+        }
+    }
+
+    FuzzCorpus_t Corpus = {0};
+    GenerateSeeds(&Corpus);
+    if (SeedDirectory) {
+        WriteSeeds(&Corpus, SeedDirectory);
+        return 0;
+    }
+    if (CorpusDirectory) {
+        LoadCorpusDirectory(&Corpus, CorpusDirectory);
+    }
+    size_t Features = 0;
+    for (size_t i = 0; i < Corpus.Count; i++) {
+        Features += FuzzOne(Corpus.Inputs[i].Data, Corpus.Inputs[i].Size);
+    }
+    printf("%lu seeds reach %lu features\n", Corpus.Count, Features);
+
+    uint64_t Execs = 0;
+    uint64_t IntervalExecs = 0;
+    const double Start = GetSeconds();
+    double IntervalStart = Start;
+    double Now = Start;
+    while ((Now - Start) < Seconds) {
+        // Time is only checked every so often, it costs about as much as a short input
+        for (int i = 0; i < 1024; i++) {
+            uint8_t Data[MaxFuzzInputSize];
+            const FuzzInput_t *Parent = &Corpus.Inputs[NextRandom(&Random) % Corpus.Count];
+            memcpy(Data, Parent->Data, Parent->Size);
+            const size_t Size = Mutate(Data, Parent->Size, &Corpus, &Random);
+            const size_t NewFeatures = FuzzOne(Data, Size);
+            if (NewFeatures) {
+                Features += NewFeatures;
+                AddToCorpus(&Corpus, Data, Size);
+            }
+        }
+        Execs += 1024;
+        IntervalExecs += 1024;
+        Now = GetSeconds();
+        if ((Now - IntervalStart) >= 1) {
+            printf("#%lu  corpus %lu  features %lu  %.0f execs/sec\n", Execs, Corpus.Count, Features,
+                   IntervalExecs / (Now - IntervalStart));
+            IntervalExecs = 0;
+            IntervalStart = Now;
+        }
+    }
+    printf("Done: %lu execs in %.1fs, %.0f execs/sec, corpus %lu, features %lu, no failures\n", Execs, Now - Start,
+           Execs / (Now - Start), Corpus.Count, Features);
+    free(Corpus.Inputs);
+    return 0;
+}
+
+#endif
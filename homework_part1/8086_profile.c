@@ -0,0 +1,125 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "8086_profile.h"
+
+_Thread_local ProfileCounters_t *ProfileThreadCounters;
+_Thread_local uint32_t ProfileParent;
+
+// Guards the anchor list and the totals, blocks only take it the first time an anchor or a thread shows up
+static pthread_mutex_t ProfileMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t ProfileThreadKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t ProfileThreadKey;
+static ProfileAnchor_t *FirstAnchor;
+static ProfileAnchor_t **LastAnchorNext = &FirstAnchor;
+static uint32_t AnchorCount;
+static uint64_t ProfileStartTsc;
+
+static uint64_t ReadOsTimerNanoseconds(void) {
+    struct timespec Now;
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return ((uint64_t)Now.tv_sec * 1000000000ull) + Now.tv_nsec;
+}
+
+// rdtsc ticks at a fixed rate nothing reports directly, so count ticks across a stretch of the OS clock.
+uint64_t EstimateCpuTimerFrequency(void) {
+    const uint64_t WaitNanoseconds = 100000000;
+    const uint64_t CpuStart = __rdtsc();
+    const uint64_t OsStart = ReadOsTimerNanoseconds();
+    uint64_t OsElapsed = 0;
+    while (OsElapsed < WaitNanoseconds) {
+        OsElapsed = ReadOsTimerNanoseconds() - OsStart;
+    }
+    const uint64_t CpuElapsed = __rdtsc() - CpuStart;
+    return (CpuElapsed * 1000000000ull) / OsElapsed;
+}
+
+// Anchors are listed in the order their blocks first ran, which reads top down for most programs. Two threads can
+// reach a new anchor at once, only the first one in gets to link it.
+uint32_t RegisterProfileAnchor(ProfileAnchor_t *Anchor) {
+    pthread_mutex_lock(&ProfileMutex);
+    uint32_t Index = Anchor->Index;
+    if (!Index) {
+        if ((AnchorCount + 1) >= MaxProfileAnchors) {
+            fprintf(stderr, "[%s] ERROR: More than %d profile blocks.\n", __func__, MaxProfileAnchors - 1);
+            exit(1);
+        }
+        Index = ++AnchorCount;
+        *LastAnchorNext = Anchor;
+        LastAnchorNext = &Anchor->Next;
+        __atomic_store_n(&Anchor->Index, Index, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&ProfileMutex);
+    return Index;
+}
+
+// Adds a thread's counts to the anchor totals. Runs as the thread exits through the key destructor, or from
+// EndAndPrintProfile for the thread that prints.
+static void MergeProfileThreadCounters(void *Data) {
+    ProfileCounters_t *Counters = Data;
+    pthread_mutex_lock(&ProfileMutex);
+    for (ProfileAnchor_t *Anchor = FirstAnchor; Anchor; Anchor = Anchor->Next) {
+        const ProfileCounters_t *Thread = &Counters[Anchor->Index];
+        Anchor->Total.ExclusiveTsc += Thread->ExclusiveTsc;
+        Anchor->Total.InclusiveTsc += Thread->InclusiveTsc;
+        Anchor->Total.HitCount += Thread->HitCount;
+        Anchor->Total.ProcessedByteCount += Thread->ProcessedByteCount;
+    }
+    pthread_mutex_unlock(&ProfileMutex);
+    free(Counters);
+}
+
+static void CreateProfileThreadKey(void) {
+    if (pthread_key_create(&ProfileThreadKey, MergeProfileThreadCounters)) {
+        fprintf(stderr, "[%s] ERROR: Could not create a thread key for the profiler.\n", __func__);
+        exit(1);
+    }
+}
+
+ProfileCounters_t *CreateProfileThreadCounters(void) {
+    pthread_once(&ProfileThreadKeyOnce, CreateProfileThreadKey);
+    ProfileThreadCounters = calloc(MaxProfileAnchors, sizeof(ProfileCounters_t));
+    if (!ProfileThreadCounters || pthread_setspecific(ProfileThreadKey, ProfileThreadCounters)) {
+        fprintf(stderr, "[%s] ERROR: Could not set up profile counters for a thread.\n", __func__);
+        exit(1);
+    }
+    return ProfileThreadCounters;
+}
+
+void BeginProfile(void) { ProfileStartTsc = __rdtsc(); }
+
+// Goes to stderr so the report never ends up mixed into a listing on stdout.
+void EndAndPrintProfile(void) {
+    const uint64_t TotalTsc = __rdtsc() - ProfileStartTsc;
+    const uint64_t Frequency = EstimateCpuTimerFrequency();
+    fprintf(stderr, "\nTotal time: %.4fms (CPU freq %lu)\n", 1000.0 * (double)TotalTsc / (double)Frequency,
+            Frequency);
+    if (!PROFILER) {
+        fprintf(stderr, "Built without PROFILER=1, no blocks were timed\n");
+        return;
+    }
+
+    if (ProfileThreadCounters) {
+        pthread_setspecific(ProfileThreadKey, NULL);
+        MergeProfileThreadCounters(ProfileThreadCounters);
+        ProfileThreadCounters = NULL;
+    }
+    for (const ProfileAnchor_t *Anchor = FirstAnchor; Anchor; Anchor = Anchor->Next) {
+        const ProfileCounters_t *Counts = &Anchor->Total;
+        const double Percent = 100.0 * (double)Counts->ExclusiveTsc / (double)TotalTsc;
+        fprintf(stderr, "  %s[%lu]: %lu (%.2f%%", Anchor->Label, Counts->HitCount, Counts->ExclusiveTsc, Percent);
+        if (Counts->InclusiveTsc != Counts->ExclusiveTsc) {
+            const double InclusivePercent = 100.0 * (double)Counts->InclusiveTsc / (double)TotalTsc;
+            fprintf(stderr, ", %.2f%% w/children", InclusivePercent);
+        }
+        fprintf(stderr, ")");
+        if (Counts->ProcessedByteCount) {
+            const double Seconds = (double)Counts->InclusiveTsc / (double)Frequency;
+            const double Megabytes = (double)Counts->ProcessedByteCount / (1024.0 * 1024.0);
+            fprintf(stderr, "  %.3fmb at %.2fmb/s", Megabytes, Megabytes / Seconds);
+        }
+        fprintf(stderr, "\n");
+    }
+}
@@ -0,0 +1,104 @@
+#ifndef PROFILE_8086_H
+#define PROFILE_8086_H
+
+#include <stdint.h>
+#include <x86intrin.h>
+
+// Scoped rdtsc timing blocks. Build with -DPROFILER=1 to turn them on, otherwise every TimeBlock/TimeFunction/
+// TimeBandwidth expands to nothing and only the total time around BeginProfile/EndAndPrintProfile is measured.
+//
+//     void DecodeSomething(...) {
+//         TimeFunction;
+//         ...
+//     }
+//
+// Blocks nest. Inclusive time covers everything under a block, exclusive time leaves out the blocks nested inside it,
+// so each cycle is only ever counted as exclusive time once. Recursion is handled by only adding the outermost call
+// to the inclusive time. Every thread counts into its own slots, and a thread's counts are added to the anchors when
+// it exits. EndAndPrintProfile adds the calling thread's, so it has to run after the workers are joined. Time from
+// several threads is summed, so percentages can add up to more than 100.
+#ifndef PROFILER
+#define PROFILER 0
+#endif
+
+// Counter slots per thread. Slot 0 stands for "no parent block".
+#define MaxProfileAnchors 256
+
+typedef struct {
+    uint64_t ExclusiveTsc;
+    uint64_t InclusiveTsc;
+    uint64_t HitCount;
+    uint64_t ProcessedByteCount;
+} ProfileCounters_t;
+
+typedef struct ProfileAnchor {
+    const char *Label;
+    struct ProfileAnchor *Next; // Anchors register themselves the first time their block runs on any thread
+    uint32_t Index;             // Slot in every thread's counters, 0 until registered
+    ProfileCounters_t Total;    // Counts from the threads that have finished
+} ProfileAnchor_t;
+
+//*****************************************************************************
+// Functions
+//*****************************************************************************
+uint64_t EstimateCpuTimerFrequency(void);
+uint32_t RegisterProfileAnchor(ProfileAnchor_t *Anchor);
+ProfileCounters_t *CreateProfileThreadCounters(void);
+void BeginProfile(void);
+void EndAndPrintProfile(void);
+
+#if PROFILER
+
+typedef struct {
+    uint32_t Index;
+    uint32_t Parent;
+    uint64_t OldInclusiveTsc;
+    uint64_t StartTsc;
+} ProfileBlock_t;
+
+extern _Thread_local ProfileCounters_t *ProfileThreadCounters;
+extern _Thread_local uint32_t ProfileParent;
+
+static inline ProfileBlock_t BeginProfileBlock(ProfileAnchor_t *Anchor, const uint64_t ByteCount) {
+    uint32_t Index = __atomic_load_n(&Anchor->Index, __ATOMIC_ACQUIRE);
+    if (!Index) {
+        Index = RegisterProfileAnchor(Anchor);
+    }
+    ProfileCounters_t *Counters = ProfileThreadCounters ? ProfileThreadCounters : CreateProfileThreadCounters();
+    ProfileBlock_t Block = {Index, ProfileParent, Counters[Index].InclusiveTsc, 0};
+    Counters[Index].ProcessedByteCount += ByteCount;
+    ProfileParent = Index;
+    Block.StartTsc = __rdtsc();
+    return Block;
+}
+
+static inline void EndProfileBlock(ProfileBlock_t *Block) {
+    const uint64_t Elapsed = __rdtsc() - Block->StartTsc;
+    ProfileCounters_t *Counters = ProfileThreadCounters;
+    ProfileParent = Block->Parent;
+    if (Block->Parent) {
+        Counters[Block->Parent].ExclusiveTsc -= Elapsed;
+    }
+    Counters[Block->Index].ExclusiveTsc += Elapsed;
+    Counters[Block->Index].InclusiveTsc = Block->OldInclusiveTsc + Elapsed;
+    Counters[Block->Index].HitCount++;
+}
+
+#define ProfileConcat2(A, B) A##B
+#define ProfileConcat(A, B) ProfileConcat2(A, B)
+// The block ends when the enclosing scope does, cleanup runs EndProfileBlock on every way out of it
+#define TimeBandwidth(Name, ByteCount)                                                                                 \
+    static ProfileAnchor_t ProfileConcat(ProfileAnchor, __LINE__) = {.Label = Name};                                   \
+    ProfileBlock_t ProfileConcat(ProfileBlock, __LINE__) __attribute__((cleanup(EndProfileBlock))) =                  \
+        BeginProfileBlock(&ProfileConcat(ProfileAnchor, __LINE__), ByteCount)
+
+#else
+
+#define TimeBandwidth(Name, ByteCount)
+
+#endif
+
+#define TimeBlock(Name) TimeBandwidth(Name, 0)
+#define TimeFunction TimeBlock(__func__)
+
+#endif
@@ -0,0 +1,1883 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "8086_decode.h"
+
+// Runs a bin on a simulated 8086 and dumps the final register state.
+
+#define MemorySize (1024 * 1024)
+#define MemoryMask (MemorySize - 1)
+
+// Figure 2-32
+#define FlagCarry 0x0001
+#define FlagParity 0x0004
+#define FlagAuxCarry 0x0010
+#define FlagZero 0x0040
+#define FlagSign 0x0080
+#define FlagTrap 0x0100
+#define FlagInterrupt 0x0200
+#define FlagDirection 0x0400
+#define FlagOverflow 0x0800
+#define FlagsDefined 0x0fd5
+// lahf/sahf only move the low byte flags
+#define FlagsLow (FlagSign | FlagZero | FlagAuxCarry | FlagParity | FlagCarry)
+
+// Table 4-9 word register order
+typedef enum {
+    RegisterAx = 0,
+    RegisterCx,
+    RegisterDx,
+    RegisterBx,
+    RegisterSp,
+    RegisterBp,
+    RegisterSi,
+    RegisterDi,
+    RegisterZero, // Always 0, lets the effective address tables name "no register"
+} WordRegister_t;
+
+typedef enum {
+    SegmentEs = 0,
+    SegmentCs,
+    SegmentSs,
+    SegmentDs,
+} SegmentRegister_t;
+
+typedef struct Block Block_t;
+typedef struct Trace Trace_t;
+typedef struct Cpu Cpu_t;
+
+typedef void ThreadedHandler_t(Cpu_t *Cpu, const Instruction_t *Instruction);
+
+// A decode cache entry. The handler is picked once when the instruction is decoded, so a cached instruction goes
+// straight to the code for its operand types instead of through ExecuteInstruction's switches each time it runs.
+typedef struct {
+    Instruction_t Instruction;
+    ThreadedHandler_t *Handler;
+} CachedInstruction_t;
+
+typedef struct {
+    uint32_t Address;
+    uint8_t Value;
+} TraceWrite_t;
+
+struct Cpu {
+    // Byte registers alias the word registers the way the real ones do, so al/ah are the two halves of ax
+    union {
+        uint16_t Words[RegisterZero + 1];
+        uint8_t Bytes[(RegisterZero + 1) * 2];
+    } Registers;
+    uint16_t Segments[4];
+    uint16_t ip;
+    uint16_t Flags;
+    int Halted;
+    uint64_t InstructionCount;
+    uint32_t ProgramEnd; // Execution stops when cs:ip leaves the loaded program
+    uint8_t *Memory;
+    // Decoded instructions keyed by the physical address they start at. A Length of 0 means nothing is cached there.
+    // CodeMap marks every byte some cached instruction was decoded from so writes know when to invalidate.
+    CachedInstruction_t *DecodeCache;
+    uint8_t *CodeMap;
+    // Threaded code. Blocks come out of a fixed pool and BlockMap finds them by physical start address. A write that
+    // invalidates cached code sets CodeWritten so the blocks built from it get thrown away.
+    Block_t *Blocks;
+    uint32_t BlockCount;
+    Block_t **BlockMap;
+    int CodeWritten;
+    // Estimated 8086 clocks, only counted when single stepping with CountClocks set
+    int CountClocks;
+    uint64_t Clocks;
+    // Execution trace, only with --trace. WriteMemory logs every byte it stores so the step's record can carry them.
+    Trace_t *Trace;
+    TraceWrite_t *TraceWrites;
+    uint32_t TraceWriteCount;
+};
+
+//*****************************************************************************
+// Registers And Memory
+//*****************************************************************************
+// Table 4-9. Index is Reg | (Word << 3), the same layout GetRegisterStr uses. Byte registers 0-3 are the low halves of
+// ax-bx and 4-7 the high halves.
+uint16_t ReadRegister(const Cpu_t *Cpu, const uint8_t Index) {
+    static const uint8_t ByteOffsets[8] = {0, 2, 4, 6, 1, 3, 5, 7};
+    if (Index & 0x8) {
+        return Cpu->Registers.Words[Index & 0x7];
+    }
+    return Cpu->Registers.Bytes[ByteOffsets[Index]];
+}
+
+void WriteRegister(Cpu_t *Cpu, const uint8_t Index, const uint16_t Value) {
+    static const uint8_t ByteOffsets[8] = {0, 2, 4, 6, 1, 3, 5, 7};
+    if (Index & 0x8) {
+        Cpu->Registers.Words[Index & 0x7] = Value;
+    } else {
+        Cpu->Registers.Bytes[ByteOffsets[Index]] = Value;
+    }
+}
+
+uint32_t GetPhysicalAddress(const uint16_t Segment, const uint16_t Offset) {
+    return (((uint32_t)Segment << 4) + Offset) & MemoryMask;
+}
+
+uint16_t ReadMemory(const Cpu_t *Cpu, const uint32_t Address, const int Wide) {
+    if (Wide) {
+        return Cpu->Memory[Address] | (Cpu->Memory[(Address + 1) & MemoryMask] << 8);
+    }
+    return Cpu->Memory[Address];
+}
+
+// Drops every cached instruction that was decoded from the byte at Address. They can start at most
+// MaxInstructionLength - 1 bytes before it.
+void InvalidateCode(Cpu_t *Cpu, const uint32_t Address) {
+    for (uint32_t Back = 0; Back < MaxInstructionLength; Back++) {
+        Instruction_t *Cached = &Cpu->DecodeCache[(Address - Back) & MemoryMask].Instruction;
+        if (Cached->Length > Back) {
+            Cached->Length = 0;
+        }
+    }
+    Cpu->CodeMap[Address] = 0;
+    Cpu->CodeWritten = 1;
+}
+
+void WriteMemory(Cpu_t *Cpu, const uint32_t Address, const uint16_t Value, const int Wide) {
+    const uint32_t NextAddress = (Address + 1) & MemoryMask;
+    if (Cpu->TraceWrites) {
+        Cpu->TraceWrites[Cpu->TraceWriteCount++] = (TraceWrite_t){Address, Value};
+        if (Wide) {
+            Cpu->TraceWrites[Cpu->TraceWriteCount++] = (TraceWrite_t){NextAddress, Value >> 8};
+        }
+    }
+    if (Cpu->CodeMap && Cpu->CodeMap[Address]) {
+        InvalidateCode(Cpu, Address);
+    }
+    Cpu->Memory[Address] = Value;
+    if (Wide) {
+        if (Cpu->CodeMap && Cpu->CodeMap[NextAddress]) {
+            InvalidateCode(Cpu, NextAddress);
+        }
+        Cpu->Memory[NextAddress] = Value >> 8;
+    }
+}
+
+// Table 4-10 as register pairs, indexed the same way as OperandMemory. Anything based on bp defaults to ss.
+uint16_t GetEffectiveOffset(const Cpu_t *Cpu, const Instruction_t *Instruction, const Operand_t Operand) {
+    static const uint8_t Bases[16] = {
+        RegisterBx, RegisterBx, RegisterBp, RegisterBp, RegisterSi,   RegisterDi, RegisterZero, RegisterBx,
+        RegisterBx, RegisterBx, RegisterBp, RegisterBp, RegisterSi,   RegisterDi, RegisterBp,   RegisterBx,
+    };
+    static const uint8_t Indexes[16] = {
+        RegisterSi, RegisterDi, RegisterSi, RegisterDi, RegisterZero, RegisterZero, RegisterZero, RegisterZero,
+        RegisterSi, RegisterDi, RegisterSi, RegisterDi, RegisterZero, RegisterZero, RegisterZero, RegisterZero,
+    };
+    const uint16_t *Words = Cpu->Registers.Words;
+    return Words[Bases[Operand.Index]] + Words[Indexes[Operand.Index]] + Instruction->Displacement;
+}
+
+uint32_t GetOperandAddress(const Cpu_t *Cpu, const Instruction_t *Instruction, const Operand_t Operand) {
+    static const uint8_t DefaultSegments[16] = {
+        SegmentDs, SegmentDs, SegmentSs, SegmentSs, SegmentDs, SegmentDs, SegmentDs, SegmentDs,
+        SegmentDs, SegmentDs, SegmentSs, SegmentSs, SegmentDs, SegmentDs, SegmentSs, SegmentDs,
+    };
+    const uint8_t Segment =
+        (Instruction->Flags & InstSegment) ? Instruction->SegmentOverride : DefaultSegments[Operand.Index];
+    return GetPhysicalAddress(Cpu->Segments[Segment], GetEffectiveOffset(Cpu, Instruction, Operand));
+}
+
+uint16_t ReadOperand(const Cpu_t *Cpu, const Instruction_t *Instruction, const Operand_t Operand) {
+    switch (Operand.Type) {
+    case OperandRegister:
+        return ReadRegister(Cpu, Operand.Index);
+    case OperandSegmentRegister:
+        return Cpu->Segments[Operand.Index];
+    case OperandMemory:
+        return ReadMemory(Cpu, GetOperandAddress(Cpu, Instruction, Operand), Instruction->Flags & InstWide);
+    case OperandImmediate:
+        return Instruction->Immediate;
+    default:
+        return 0;
+    }
+}
+
+void WriteOperand(Cpu_t *Cpu, const Instruction_t *Instruction, const Operand_t Operand, const uint16_t Value) {
+    switch (Operand.Type) {
+    case OperandRegister:
+        WriteRegister(Cpu, Operand.Index, Value);
+        break;
+    case OperandSegmentRegister:
+        Cpu->Segments[Operand.Index] = Value;
+        break;
+    case OperandMemory:
+        WriteMemory(Cpu, GetOperandAddress(Cpu, Instruction, Operand), Value, Instruction->Flags & InstWide);
+        break;
+    }
+}
+
+void Push(Cpu_t *Cpu, const uint16_t Value) {
+    Cpu->Registers.Words[RegisterSp] -= 2;
+    WriteMemory(Cpu, GetPhysicalAddress(Cpu->Segments[SegmentSs], Cpu->Registers.Words[RegisterSp]), Value, 1);
+}
+
+uint16_t Pop(Cpu_t *Cpu) {
+    const uint16_t Value =
+        ReadMemory(Cpu, GetPhysicalAddress(Cpu->Segments[SegmentSs], Cpu->Registers.Words[RegisterSp]), 1);
+    Cpu->Registers.Words[RegisterSp] += 2;
+    return Value;
+}
+
+//*****************************************************************************
+// Flags
+//*****************************************************************************
+void SetFlag(Cpu_t *Cpu, const uint16_t Flag, const int Set) {
+    Cpu->Flags = Set ? (Cpu->Flags | Flag) : (Cpu->Flags & ~Flag);
+}
+
+// Sign, zero and parity all come straight from the result. Parity only looks at the low byte.
+uint16_t GetResultFlags(const uint16_t Result, const int Wide) {
+    const uint16_t Mask = Wide ? 0xffff : 0xff;
+    const uint16_t SignBit = Wide ? 0x8000 : 0x80;
+    return ((Result & Mask) ? 0 : FlagZero) | ((Result & SignBit) ? FlagSign : 0) |
+           (__builtin_parity(Result & 0xff) ? 0 : FlagParity);
+}
+
+void SetResultFlags(Cpu_t *Cpu, const uint16_t Result, const int Wide) {
+    Cpu->Flags = (Cpu->Flags & ~(FlagZero | FlagSign | FlagParity)) | GetResultFlags(Result, Wide);
+}
+
+// The arithmetic helpers build every flag they touch and write them back once, it keeps the common ALU path free of
+// a branch per flag.
+#define ArithmeticFlags (FlagCarry | FlagParity | FlagAuxCarry | FlagZero | FlagSign | FlagOverflow)
+
+uint16_t AddWithFlags(Cpu_t *Cpu, const uint16_t A, const uint16_t B, const uint16_t CarryIn, const int Wide) {
+    const uint32_t Mask = Wide ? 0xffff : 0xff;
+    const uint16_t SignBit = Wide ? 0x8000 : 0x80;
+    const uint32_t Full = (A & Mask) + (B & Mask) + CarryIn;
+    const uint16_t Result = Full & Mask;
+    const uint16_t Flags = ((Full > Mask) ? FlagCarry : 0) | ((A ^ B ^ Result) & FlagAuxCarry) |
+                           (((A ^ Result) & (B ^ Result) & SignBit) ? FlagOverflow : 0) | GetResultFlags(Result, Wide);
+    Cpu->Flags = (Cpu->Flags & ~ArithmeticFlags) | Flags;
+    return Result;
+}
+
+uint16_t SubWithFlags(Cpu_t *Cpu, const uint16_t A, const uint16_t B, const uint16_t BorrowIn, const int Wide) {
+    const uint32_t Mask = Wide ? 0xffff : 0xff;
+    const uint16_t SignBit = Wide ? 0x8000 : 0x80;
+    const uint16_t Result = ((A & Mask) - (B & Mask) - BorrowIn) & Mask;
+    const uint16_t Flags = (((A & Mask) < ((B & Mask) + BorrowIn)) ? FlagCarry : 0) |
+                           ((A ^ B ^ Result) & FlagAuxCarry) |
+                           (((A ^ B) & (A ^ Result) & SignBit) ? FlagOverflow : 0) | GetResultFlags(Result, Wide);
+    Cpu->Flags = (Cpu->Flags & ~ArithmeticFlags) | Flags;
+    return Result;
+}
+
+uint16_t LogicWithFlags(Cpu_t *Cpu, const uint16_t Result, const int Wide) {
+    Cpu->Flags = (Cpu->Flags & ~ArithmeticFlags) | GetResultFlags(Result, Wide);
+    return Result;
+}
+
+// Shifts and rotates one bit at a time so the flags come out the way the 8086 leaves them for any count.
+uint16_t ShiftWithFlags(Cpu_t *Cpu, const uint8_t Mnemonic, uint16_t Value, uint8_t Count, const int Wide) {
+    const uint16_t Mask = Wide ? 0xffff : 0xff;
+    const uint16_t SignBit = Wide ? 0x8000 : 0x80;
+    if (!Count) {
+        return Value;
+    }
+
+    Value &= Mask;
+    while (Count--) {
+        const uint16_t Carry = Cpu->Flags & FlagCarry;
+        const uint16_t Msb = Value & SignBit;
+        const uint16_t Lsb = Value & 0x1;
+        switch (Mnemonic) {
+        case MnemonicRol:
+            Value = ((Value << 1) | (Msb ? 1 : 0)) & Mask;
+            SetFlag(Cpu, FlagCarry, Msb);
+            break;
+        case MnemonicRor:
+            Value = (Value >> 1) | (Lsb ? SignBit : 0);
+            SetFlag(Cpu, FlagCarry, Lsb);
+            break;
+        case MnemonicRcl:
+            Value = ((Value << 1) | (Carry ? 1 : 0)) & Mask;
+            SetFlag(Cpu, FlagCarry, Msb);
+            break;
+        case MnemonicRcr:
+            Value = (Value >> 1) | (Carry ? SignBit : 0);
+            SetFlag(Cpu, FlagCarry, Lsb);
+            break;
+        case MnemonicShl:
+            Value = (Value << 1) & Mask;
+            SetFlag(Cpu, FlagCarry, Msb);
+            break;
+        case MnemonicShr:
+            Value >>= 1;
+            SetFlag(Cpu, FlagCarry, Lsb);
+            break;
+        case MnemonicSar:
+            Value = (Value >> 1) | Msb;
+            SetFlag(Cpu, FlagCarry, Lsb);
+            break;
+        }
+    }
+
+    // Overflow is only defined for a count of 1 but every 8086 computes it this way from the final step
+    const int TopBitsDiffer = !(Value & SignBit) != !(Value & (SignBit >> 1));
+    switch (Mnemonic) {
+    case MnemonicRol:
+    case MnemonicRcl:
+    case MnemonicShl:
+        SetFlag(Cpu, FlagOverflow, !(Value & SignBit) != !(Cpu->Flags & FlagCarry));
+        break;
+    case MnemonicRor:
+    case MnemonicRcr:
+    case MnemonicShr:
+        SetFlag(Cpu, FlagOverflow, TopBitsDiffer);
+        break;
+    case MnemonicSar:
+        SetFlag(Cpu, FlagOverflow, 0);
+        break;
+    }
+    if ((Mnemonic == MnemonicShl) || (Mnemonic == MnemonicShr) || (Mnemonic == MnemonicSar)) {
+        SetResultFlags(Cpu, Value, Wide);
+    }
+    return Value;
+}
+
+// Conditional jumps come in pairs in Table 4-12 where the odd one is the opposite of the even one.
+int IsConditionTrue(const Cpu_t *Cpu, const uint8_t Mnemonic) {
+    const uint16_t Flags = Cpu->Flags;
+    const int Sign = !!(Flags & FlagSign);
+    const int Overflow = !!(Flags & FlagOverflow);
+    const uint8_t Condition = Mnemonic - MnemonicJo;
+
+    int Result = 0;
+    switch (Condition >> 1) {
+    case 0: // jo
+        Result = Overflow;
+        break;
+    case 1: // jb
+        Result = Flags & FlagCarry;
+        break;
+    case 2: // je
+        Result = Flags & FlagZero;
+        break;
+    case 3: // jbe
+        Result = Flags & (FlagCarry | FlagZero);
+        break;
+    case 4: // js
+        Result = Sign;
+        break;
+    case 5: // jp
+        Result = Flags & FlagParity;
+        break;
+    case 6: // jl
+        Result = Sign != Overflow;
+        break;
+    case 7: // jle
+        Result = (Flags & FlagZero) || (Sign != Overflow);
+        break;
+    }
+    return !!Result ^ (Condition & 0x1);
+}
+
+//*****************************************************************************
+// Trace Recording
+//*****************************************************************************
+// --trace records what every step of the run changed. The file starts with a TraceHeader_t and the program, then has
+// one record per step:
+//     varint  zigzag ip delta
+//     varint  mask of the TraceState_t fields that changed, bit TraceFieldCount set when memory was written
+//     varint  zigzag delta of each changed field, lowest bit first
+//     varint  write count, then per byte written a zigzag address delta from the previous write and the new value
+// Before every TraceCheckpointInterval-th step (step 0 included) comes a checkpoint with the full TraceState_t and
+// every memory page written since the start, so replay only has to go back to the nearest one. A TraceFooter_t at the
+// end finds the checkpoint index. Records are built in one buffer while a writer thread writes out the other.
+#define TraceMagic "8086TRC1"
+#define TraceFooterMagic "8086TRCE"
+#define TraceBufferSize (4 * 1024 * 1024)
+#define TraceCheckpointInterval (1024 * 1024)
+#define TracePageSize 4096
+#define TracePageCount (MemorySize / TracePageSize)
+// One rep stosw or movsw can store 65535 words
+#define MaxTraceWritesPerStep ((2 * 65536) + 16)
+// Varints of the 16 bit ip and field deltas take up to 3 bytes, write address deltas up to 3 plus the value
+#define MaxStepRecordSize (3 + 3 + (TraceFieldCount * 3) + 3 + (MaxTraceWritesPerStep * 4))
+#define MaxCheckpointSize (sizeof(TraceState_t) + sizeof(uint32_t) + (TracePageCount * (2 + TracePageSize)))
+
+// Everything but memory. Fields are the word registers in Table 4-9 order, the segment registers, then the flags.
+#define TraceFieldCount 13
+
+typedef struct {
+    uint16_t Fields[TraceFieldCount];
+    uint16_t ip;
+} TraceState_t;
+
+_Static_assert(MaxStepRecordSize < TraceBufferSize, "A step record has to fit in a trace buffer");
+_Static_assert(MaxCheckpointSize < TraceBufferSize, "A checkpoint has to fit in a trace buffer");
+
+typedef struct {
+    char Magic[8];
+    uint32_t ProgramSize;
+    uint32_t CheckpointInterval;
+} TraceHeader_t;
+
+typedef struct {
+    uint64_t Step;
+    uint64_t Offset;
+} TraceCheckpoint_t;
+
+typedef struct {
+    uint64_t StepCount;
+    uint64_t CheckpointCount;
+    uint64_t IndexOffset; // Where the TraceCheckpoint_t for each checkpoint start
+    char Magic[8];
+} TraceFooter_t;
+
+struct Trace {
+    int Fd;
+    // Buffers[Active] is being filled. The writer thread owns the other one while PendingSize isn't 0.
+    uint8_t *Buffers[2];
+    int Active;
+    size_t Used;
+    size_t PendingSize;
+    int Done;
+    int WriteFailed;
+    pthread_t Writer;
+    pthread_mutex_t Lock;
+    pthread_cond_t Changed;
+    uint64_t Offset; // File offset Buffers[Active] starts at
+    uint64_t Steps;
+    TraceState_t Before;
+    uint32_t LastWriteAddress;
+    uint8_t DirtyPages[TracePageCount];
+    TraceCheckpoint_t *Checkpoints;
+    size_t CheckpointCount;
+    size_t CheckpointCapacity;
+};
+
+void GetTraceState(const Cpu_t *Cpu, TraceState_t *State) {
+    memcpy(State->Fields, Cpu->Registers.Words, 8 * sizeof(uint16_t));
+    memcpy(State->Fields + 8, Cpu->Segments, 4 * sizeof(uint16_t));
+    State->Fields[12] = Cpu->Flags;
+    State->ip = Cpu->ip;
+}
+
+void SetTraceState(Cpu_t *Cpu, const TraceState_t *State) {
+    memcpy(Cpu->Registers.Words, State->Fields, 8 * sizeof(uint16_t));
+    memcpy(Cpu->Segments, State->Fields + 8, 4 * sizeof(uint16_t));
+    Cpu->Flags = State->Fields[12];
+    Cpu->ip = State->ip;
+}
+
+uint8_t *PutVarint(uint8_t *Out, uint32_t Value) {
+    while (Value >= 0x80) {
+        *Out++ = Value | 0x80;
+        Value >>= 7;
+    }
+    *Out++ = Value;
+    return Out;
+}
+
+uint32_t ZigZag(const int32_t Value) { return ((uint32_t)Value << 1) ^ (uint32_t)(Value >> 31); }
+
+void *TraceWriter(void *Arg) {
+    Trace_t *Trace = Arg;
+    pthread_mutex_lock(&Trace->Lock);
+    for (;;) {
+        while (!Trace->PendingSize && !Trace->Done) {
+            pthread_cond_wait(&Trace->Changed, &Trace->Lock);
+        }
+        if (!Trace->PendingSize) {
+            break;
+        }
+        const uint8_t *Data = Trace->Buffers[Trace->Active ^ 1];
+        const size_t Size = Trace->PendingSize;
+        pthread_mutex_unlock(&Trace->Lock);
+
+        size_t Written = 0;
+        int Failed = 0;
+        while (!Failed && (Written < Size)) {
+            const ssize_t Result = write(Trace->Fd, Data + Written, Size - Written);
+            Failed = Result < 0;
+            Written += Failed ? 0 : Result;
+        }
+
+        pthread_mutex_lock(&Trace->Lock);
+        Trace->WriteFailed |= Failed;
+        Trace->PendingSize = 0;
+        pthread_cond_broadcast(&Trace->Changed);
+    }
+    pthread_mutex_unlock(&Trace->Lock);
+    return NULL;
+}
+
+// Hands the filled buffer to the writer. Only waits if the writer hasn't finished the previous one yet.
+void SwapTraceBuffers(Trace_t *Trace) {
+    pthread_mutex_lock(&Trace->Lock);
+    while (Trace->PendingSize) {
+        pthread_cond_wait(&Trace->Changed, &Trace->Lock);
+    }
+    Trace->PendingSize = Trace->Used;
+    Trace->Active ^= 1;
+    Trace->Offset += Trace->Used;
+    Trace->Used = 0;
+    pthread_cond_broadcast(&Trace->Changed);
+    pthread_mutex_unlock(&Trace->Lock);
+}
+
+void AppendTrace(Trace_t *Trace, const void *Data, const size_t Size) {
+    if ((TraceBufferSize - Trace->Used) < Size) {
+        SwapTraceBuffers(Trace);
+    }
+    memcpy(Trace->Buffers[Trace->Active] + Trace->Used, Data, Size);
+    Trace->Used += Size;
+}
+
+void WriteTraceCheckpoint(Cpu_t *Cpu) {
+    Trace_t *Trace = Cpu->Trace;
+    if ((TraceBufferSize - Trace->Used) < MaxCheckpointSize) {
+        SwapTraceBuffers(Trace);
+    }
+    if (Trace->CheckpointCount == Trace->CheckpointCapacity) {
+        Trace->CheckpointCapacity = Trace->CheckpointCapacity ? (Trace->CheckpointCapacity * 2) : 64;
+        Trace->Checkpoints = realloc(Trace->Checkpoints, Trace->CheckpointCapacity * sizeof(TraceCheckpoint_t));
+        if (!Trace->Checkpoints) {
+            printf("[%s] ERROR: Could not grow the checkpoint index to %lu.\n", __func__, Trace->CheckpointCapacity);
+            exit(1);
+        }
+    }
+    Trace->Checkpoints[Trace->CheckpointCount++] = (TraceCheckpoint_t){Trace->Steps, Trace->Offset + Trace->Used};
+
+    TraceState_t State;
+    GetTraceState(Cpu, &State);
+    AppendTrace(Trace, &State, sizeof(State));
+    uint32_t DirtyCount = 0;
+    for (uint32_t Page = 0; Page < TracePageCount; Page++) {
+        DirtyCount += Trace->DirtyPages[Page];
+    }
+    AppendTrace(Trace, &DirtyCount, sizeof(DirtyCount));
+    for (uint16_t Page = 0; Page < TracePageCount; Page++) {
+        if (Trace->DirtyPages[Page]) {
+            AppendTrace(Trace, &Page, sizeof(Page));
+            AppendTrace(Trace, Cpu->Memory + (Page * TracePageSize), TracePageSize);
+        }
+    }
+    // Write addresses restart from 0 so replay can start decoding right here
+    Trace->LastWriteAddress = 0;
+}
+
+Trace_t *OpenTrace(Cpu_t *Cpu, const char *TraceFile, const uint8_t *Program, const size_t ProgramSize) {
+    Trace_t *Trace = calloc(1, sizeof(Trace_t));
+    Cpu->TraceWrites = malloc(MaxTraceWritesPerStep * sizeof(TraceWrite_t));
+    if (!Trace || !Cpu->TraceWrites) {
+        printf("[%s] ERROR: Could not malloc the trace.\n", __func__);
+        exit(1);
+    }
+    Trace->Buffers[0] = malloc(TraceBufferSize);
+    Trace->Buffers[1] = malloc(TraceBufferSize);
+    if (!Trace->Buffers[0] || !Trace->Buffers[1]) {
+        printf("[%s] ERROR: Could not malloc trace buffers.\n", __func__);
+        exit(1);
+    }
+    Trace->Fd = open(TraceFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (Trace->Fd < 0) {
+        printf("[%s] ERROR: Could not open %s for write\n", __func__, TraceFile);
+        exit(1);
+    }
+    pthread_mutex_init(&Trace->Lock, NULL);
+    pthread_cond_init(&Trace->Changed, NULL);
+    if (pthread_create(&Trace->Writer, NULL, TraceWriter, Trace)) {
+        printf("[%s] ERROR: Could not start the trace writer\n", __func__);
+        exit(1);
+    }
+
+    TraceHeader_t Header = {{0}, ProgramSize, TraceCheckpointInterval};
+    memcpy(Header.Magic, TraceMagic, sizeof(Header.Magic));
+    AppendTrace(Trace, &Header, sizeof(Header));
+    for (size_t Done = 0; Done < ProgramSize; Done += TraceBufferSize) {
+        const size_t Size = ((ProgramSize - Done) < TraceBufferSize) ? (ProgramSize - Done) : TraceBufferSize;
+        AppendTrace(Trace, Program + Done, Size);
+    }
+    Cpu->Trace = Trace;
+    WriteTraceCheckpoint(Cpu);
+    return Trace;
+}
+
+void BeginTraceStep(Cpu_t *Cpu) {
+    Trace_t *Trace = Cpu->Trace;
+    if (Trace->Steps && !(Trace->Steps % TraceCheckpointInterval)) {
+        WriteTraceCheckpoint(Cpu);
+    }
+    GetTraceState(Cpu, &Trace->Before);
+    Cpu->TraceWriteCount = 0;
+}
+
+void EndTraceStep(Cpu_t *Cpu) {
+    Trace_t *Trace = Cpu->Trace;
+    if ((TraceBufferSize - Trace->Used) < MaxStepRecordSize) {
+        SwapTraceBuffers(Trace);
+    }
+    TraceState_t After;
+    GetTraceState(Cpu, &After);
+    uint8_t *Out = Trace->Buffers[Trace->Active] + Trace->Used;
+    Out = PutVarint(Out, ZigZag((int16_t)(After.ip - Trace->Before.ip)));
+    uint32_t Changed = Cpu->TraceWriteCount ? (1 << TraceFieldCount) : 0;
+    for (int Field = 0; Field < TraceFieldCount; Field++) {
+        Changed |= (After.Fields[Field] != Trace->Before.Fields[Field]) << Field;
+    }
+    Out = PutVarint(Out, Changed);
+    for (uint32_t Bits = Changed & ((1 << TraceFieldCount) - 1); Bits; Bits &= Bits - 1) {
+        const int Field = __builtin_ctz(Bits);
+        Out = PutVarint(Out, ZigZag((int16_t)(After.Fields[Field] - Trace->Before.Fields[Field])));
+    }
+    if (Cpu->TraceWriteCount) {
+        Out = PutVarint(Out, Cpu->TraceWriteCount);
+        for (uint32_t i = 0; i < Cpu->TraceWriteCount; i++) {
+            const TraceWrite_t Write = Cpu->TraceWrites[i];
+            Out = PutVarint(Out, ZigZag((int32_t)(Write.Address - Trace->LastWriteAddress)));
+            *Out++ = Write.Value;
+            Trace->LastWriteAddress = Write.Address;
+            Trace->DirtyPages[Write.Address / TracePageSize] = 1;
+        }
+    }
+    Trace->Used = Out - Trace->Buffers[Trace->Active];
+    Trace->Steps++;
+}
+
+// Writes out what's left with the checkpoint index and footer behind it and waits for the writer to finish.
+void CloseTrace(Cpu_t *Cpu, const char *TraceFile) {
+    Trace_t *Trace = Cpu->Trace;
+    TraceFooter_t Footer = {Trace->Steps, Trace->CheckpointCount, Trace->Offset + Trace->Used, {0}};
+    memcpy(Footer.Magic, TraceFooterMagic, sizeof(Footer.Magic));
+    for (size_t i = 0; i < Trace->CheckpointCount; i++) {
+        AppendTrace(Trace, &Trace->Checkpoints[i], sizeof(TraceCheckpoint_t));
+    }
+    AppendTrace(Trace, &Footer, sizeof(Footer));
+    const uint64_t Size = Trace->Offset + Trace->Used;
+    SwapTraceBuffers(Trace);
+
+    pthread_mutex_lock(&Trace->Lock);
+    Trace->Done = 1;
+    pthread_cond_broadcast(&Trace->Changed);
+    pthread_mutex_unlock(&Trace->Lock);
+    pthread_join(Trace->Writer, NULL);
+    if (Trace->WriteFailed || close(Trace->Fd)) {
+        printf("[%s] ERROR: Could not write %s\n", __func__, TraceFile);
+        exit(1);
+    }
+    fprintf(stderr, "Traced %lu steps into %s, 0x%lx bytes with %lu checkpoints\n", Trace->Steps, TraceFile, Size,
+            Trace->CheckpointCount);
+
+    pthread_mutex_destroy(&Trace->Lock);
+    pthread_cond_destroy(&Trace->Changed);
+    free(Trace->Buffers[0]);
+    free(Trace->Buffers[1]);
+    free(Trace->Checkpoints);
+    free(Trace);
+    free(Cpu->TraceWrites);
+    Cpu->Trace = NULL;
+    Cpu->TraceWrites = NULL;
+}
+
+//*****************************************************************************
+// Execution
+//*****************************************************************************
+void Interrupt(Cpu_t *Cpu, const uint8_t Type) {
+    Push(Cpu, Cpu->Flags | 0xf002);
+    Cpu->Flags &= ~(FlagInterrupt | FlagTrap);
+    Push(Cpu, Cpu->Segments[SegmentCs]);
+    Push(Cpu, Cpu->ip);
+    Cpu->ip = ReadMemory(Cpu, Type * 4, 1);
+    Cpu->Segments[SegmentCs] = ReadMemory(Cpu, (Type * 4) + 2, 1);
+}
+
+void ExecuteMultiply(Cpu_t *Cpu, const Instruction_t *Instruction) {
+    const int Wide = Instruction->Flags & InstWide;
+    const uint16_t Source = ReadOperand(Cpu, Instruction, Instruction->Operands[0]);
+    uint16_t *Words = Cpu->Registers.Words;
+
+    int Overflow;
+    if (Instruction->Mnemonic == MnemonicMul) {
+        if (Wide) {
+            const uint32_t Result = (uint32_t)Words[RegisterAx] * Source;
+            Words[RegisterAx] = Result;
+            Words[RegisterDx] = Result >> 16;
+            Overflow = Words[RegisterDx] != 0;
+        } else {
+            Words[RegisterAx] = (uint16_t)(Words[RegisterAx] & 0xff) * (Source & 0xff);
+            Overflow = (Words[RegisterAx] >> 8) != 0;
+        }
+    } else {
+        if (Wide) {
+            const int32_t Result = (int32_t)(int16_t)Words[RegisterAx] * (int16_t)Source;
+            Words[RegisterAx] = Result;
+            Words[RegisterDx] = (uint32_t)Result >> 16;
+            Overflow = Result != (int16_t)Result;
+        } else {
+            const int16_t Result = (int16_t)(int8_t)Words[RegisterAx] * (int8_t)Source;
+            Words[RegisterAx] = Result;
+            Overflow = Result != (int8_t)Result;
+        }
+    }
+    SetFlag(Cpu, FlagCarry, Overflow);
+    SetFlag(Cpu, FlagOverflow, Overflow);
+}
+
+// A zero divisor or a quotient that doesn't fit raises interrupt 0 and leaves the registers alone.
+void ExecuteDivide(Cpu_t *Cpu, const Instruction_t *Instruction) {
+    const int Wide = Instruction->Flags & InstWide;
+    const uint16_t Source = ReadOperand(Cpu, Instruction, Instruction->Operands[0]);
+    uint16_t *Words = Cpu->Registers.Words;
+
+    if (Instruction->Mnemonic == MnemonicDiv) {
+        const uint32_t Dividend = Wide ? ((uint32_t)Words[RegisterDx] << 16) | Words[RegisterAx] : Words[RegisterAx];
+        const uint32_t Divisor = Wide ? Source : (Source & 0xff);
+        if (!Divisor || ((Dividend / Divisor) > (Wide ? 0xffffu : 0xffu))) {
+            Interrupt(Cpu, 0);
+        } else if (Wide) {
+            Words[RegisterAx] = Dividend / Divisor;
+            Words[RegisterDx] = Dividend % Divisor;
+        } else {
+            Words[RegisterAx] = ((Dividend % Divisor) << 8) | (Dividend / Divisor);
+        }
+    } else {
+        // 64 bits so 0x80000000 / -1 doesn't overflow on the host. The 8086 faults on a quotient of 0x8000/0x80 as well
+        // as anything past it, only later parts return it.
+        const int64_t Dividend =
+            Wide ? (int32_t)(((uint32_t)Words[RegisterDx] << 16) | Words[RegisterAx]) : (int16_t)Words[RegisterAx];
+        const int64_t Divisor = Wide ? (int16_t)Source : (int8_t)Source;
+        const int64_t Limit = Wide ? 0x7fff : 0x7f;
+        if (!Divisor || ((Dividend / Divisor) > Limit) || ((Dividend / Divisor) < -Limit)) {
+            Interrupt(Cpu, 0);
+        } else if (Wide) {
+            Words[RegisterAx] = Dividend / Divisor;
+            Words[RegisterDx] = Dividend % Divisor;
+        } else {
+            Words[RegisterAx] = (((Dividend % Divisor) & 0xff) << 8) | ((Dividend / Divisor) & 0xff);
+        }
+    }
+}
+
+// movs/cmps/scas/lods/stos, with rep/repne counting down cx.
+void ExecuteString(Cpu_t *Cpu, const Instruction_t *Instruction) {
+    const int Wide = Instruction->Flags & InstWide;
+    const int Repeat = Instruction->Flags & (InstRep | InstRepne);
+    const uint16_t Step = (Cpu->Flags & FlagDirection) ? (Wide ? -2 : -1) : (Wide ? 2 : 1);
+    const uint8_t SourceSegment = (Instruction->Flags & InstSegment) ? Instruction->SegmentOverride : SegmentDs;
+    const uint8_t Accumulator = Wide ? 0x8 : 0x0;
+    uint16_t *Words = Cpu->Registers.Words;
+
+    if (Repeat && !Words[RegisterCx]) {
+        return;
+    }
+    for (;;) {
+        const uint32_t Source = GetPhysicalAddress(Cpu->Segments[SourceSegment], Words[RegisterSi]);
+        const uint32_t Destination = GetPhysicalAddress(Cpu->Segments[SegmentEs], Words[RegisterDi]);
+        switch (Instruction->Mnemonic) {
+        case MnemonicMovs:
+            WriteMemory(Cpu, Destination, ReadMemory(Cpu, Source, Wide), Wide);
+            Words[RegisterSi] += Step;
+            Words[RegisterDi] += Step;
+            break;
+        case MnemonicCmps:
+            SubWithFlags(Cpu, ReadMemory(Cpu, Source, Wide), ReadMemory(Cpu, Destination, Wide), 0, Wide);
+            Words[RegisterSi] += Step;
+            Words[RegisterDi] += Step;
+            break;
+        case MnemonicScas:
+            SubWithFlags(Cpu, ReadRegister(Cpu, Accumulator), ReadMemory(Cpu, Destination, Wide), 0, Wide);
+            Words[RegisterDi] += Step;
+            break;
+        case MnemonicLods:
+            WriteRegister(Cpu, Accumulator, ReadMemory(Cpu, Source, Wide));
+            Words[RegisterSi] += Step;
+            break;
+        case MnemonicStos:
+            WriteMemory(Cpu, Destination, ReadRegister(Cpu, Accumulator), Wide);
+            Words[RegisterDi] += Step;
+            break;
+        }
+
+        if (!Repeat || !--Words[RegisterCx]) {
+            break;
+        }
+        // cmps and scas also stop when the comparison goes the wrong way
+        if ((Instruction->Mnemonic == MnemonicCmps) || (Instruction->Mnemonic == MnemonicScas)) {
+            const int Zero = !!(Cpu->Flags & FlagZero);
+            if (((Instruction->Flags & InstRep) && !Zero) || ((Instruction->Flags & InstRepne) && Zero)) {
+                break;
+            }
+        }
+    }
+}
+
+// jmp and call. The target is relative, a far pointer, or a near/far address in a register or memory.
+void ExecuteTransfer(Cpu_t *Cpu, const Instruction_t *Instruction) {
+    const Operand_t Target = Instruction->Operands[0];
+    uint16_t NewIp;
+    uint16_t NewCs = Cpu->Segments[SegmentCs];
+
+    if (Target.Type == OperandRelative) {
+        NewIp = Cpu->ip + Instruction->Immediate;
+    } else if (Target.Type == OperandFarPointer) {
+        NewIp = Instruction->Immediate;
+        NewCs = Instruction->Segment;
+    } else if (Instruction->Flags & InstFar) {
+        const uint32_t Address = GetOperandAddress(Cpu, Instruction, Target);
+        NewIp = ReadMemory(Cpu, Address, 1);
+        NewCs = ReadMemory(Cpu, (Address + 2) & MemoryMask, 1);
+    } else {
+        NewIp = ReadOperand(Cpu, Instruction, Target);
+    }
+
+    if (Instruction->Mnemonic == MnemonicCall) {
+        if (Instruction->Flags & InstFar) {
+            Push(Cpu, Cpu->Segments[SegmentCs]);
+        }
+        Push(Cpu, Cpu->ip);
+    }
+    Cpu->ip = NewIp;
+    Cpu->Segments[SegmentCs] = NewCs;
+}
+
+void ExecuteDecimalAdjust(Cpu_t *Cpu, const Instruction_t *Instruction) {
+    uint8_t *Al = &Cpu->Registers.Bytes[0];
+    uint8_t *Ah = &Cpu->Registers.Bytes[1];
+    const uint8_t OldAl = *Al;
+    const int OldCarry = !!(Cpu->Flags & FlagCarry);
+    const int Adjust = ((*Al & 0xf) > 9) || (Cpu->Flags & FlagAuxCarry);
+
+    switch (Instruction->Mnemonic) {
+    case MnemonicAaa:
+    case MnemonicAas:
+        if (Adjust) {
+            *Al += (Instruction->Mnemonic == MnemonicAaa) ? 6 : -6;
+            *Ah += (Instruction->Mnemonic == MnemonicAaa) ? 1 : -1;
+        }
+        *Al &= 0xf;
+        SetFlag(Cpu, FlagAuxCarry, Adjust);
+        SetFlag(Cpu, FlagCarry, Adjust);
+        break;
+    case MnemonicDaa:
+    case MnemonicDas: {
+        const int Add = Instruction->Mnemonic == MnemonicDaa;
+        int Carry = OldCarry;
+        if (Adjust) {
+            Carry |= Add ? (*Al > 0xf9) : (*Al < 6);
+            *Al += Add ? 6 : -6;
+        }
+        if ((OldAl > 0x99) || OldCarry) {
+            *Al += Add ? 0x60 : -0x60;
+            Carry = 1;
+        }
+        SetFlag(Cpu, FlagAuxCarry, Adjust);
+        SetFlag(Cpu, FlagCarry, Carry);
+        SetResultFlags(Cpu, *Al, 0);
+        break;
+    }
+    case MnemonicAam: {
+        const uint8_t Base = Instruction->Immediate;
+        if (!Base) {
+            Interrupt(Cpu, 0);
+            return;
+        }
+        *Ah = OldAl / Base;
+        *Al = OldAl % Base;
+        SetResultFlags(Cpu, *Al, 0);
+        break;
+    }
+    case MnemonicAad:
+        *Al = OldAl + (*Ah * (uint8_t)Instruction->Immediate);
+        *Ah = 0;
+        SetResultFlags(Cpu, *Al, 0);
+        break;
+    }
+}
+
+// cs:ip has already been moved past the instruction, so relative targets and pushed return addresses come from it.
+void ExecuteInstruction(Cpu_t *Cpu, const Instruction_t *Instruction) {
+    const int Wide = Instruction->Flags & InstWide;
+    const Operand_t Destination = Instruction->Operands[0];
+    const Operand_t Source = Instruction->Operands[1];
+    uint16_t *Words = Cpu->Registers.Words;
+    const uint8_t Mnemonic = Instruction->Mnemonic;
+
+    switch (Mnemonic) {
+    case MnemonicMov:
+        WriteOperand(Cpu, Instruction, Destination, ReadOperand(Cpu, Instruction, Source));
+        break;
+    case MnemonicAdd:
+    case MnemonicAdc: {
+        const uint16_t Carry = (Mnemonic == MnemonicAdc) ? (Cpu->Flags & FlagCarry) : 0;
+        const uint16_t Result = AddWithFlags(Cpu, ReadOperand(Cpu, Instruction, Destination),
+                                             ReadOperand(Cpu, Instruction, Source), Carry, Wide);
+        WriteOperand(Cpu, Instruction, Destination, Result);
+        break;
+    }
+    case MnemonicSub:
+    case MnemonicSbb:
+    case MnemonicCmp: {
+        const uint16_t Borrow = (Mnemonic == MnemonicSbb) ? (Cpu->Flags & FlagCarry) : 0;
+        const uint16_t Result = SubWithFlags(Cpu, ReadOperand(Cpu, Instruction, Destination),
+                                             ReadOperand(Cpu, Instruction, Source), Borrow, Wide);
+        if (Mnemonic != MnemonicCmp) {
+            WriteOperand(Cpu, Instruction, Destination, Result);
+        }
+        break;
+    }
+    case MnemonicAnd:
+    case MnemonicTest: {
+        const uint16_t Result = LogicWithFlags(
+            Cpu, ReadOperand(Cpu, Instruction, Destination) & ReadOperand(Cpu, Instruction, Source), Wide);
+        if (Mnemonic == MnemonicAnd) {
+            WriteOperand(Cpu, Instruction, Destination, Result);
+        }
+        break;
+    }
+    case MnemonicOr:
+        WriteOperand(Cpu, Instruction, Destination,
+                     LogicWithFlags(Cpu,
+                                    ReadOperand(Cpu, Instruction, Destination) |
+                                        ReadOperand(Cpu, Instruction, Source),
+                                    Wide));
+        break;
+    case MnemonicXor:
+        WriteOperand(Cpu, Instruction, Destination,
+                     LogicWithFlags(Cpu,
+                                    ReadOperand(Cpu, Instruction, Destination) ^
+                                        ReadOperand(Cpu, Instruction, Source),
+                                    Wide));
+        break;
+    case MnemonicInc:
+    case MnemonicDec: {
+        // inc and dec leave the carry flag alone
+        const uint16_t Carry = Cpu->Flags & FlagCarry;
+        const uint16_t Value = ReadOperand(Cpu, Instruction, Destination);
+        const uint16_t Result =
+            (Mnemonic == MnemonicInc) ? AddWithFlags(Cpu, Value, 1, 0, Wide) : SubWithFlags(Cpu, Value, 1, 0, Wide);
+        Cpu->Flags = (Cpu->Flags & ~FlagCarry) | Carry;
+        WriteOperand(Cpu, Instruction, Destination, Result);
+        break;
+    }
+    case MnemonicNeg:
+        WriteOperand(Cpu, Instruction, Destination,
+                     SubWithFlags(Cpu, 0, ReadOperand(Cpu, Instruction, Destination), 0, Wide));
+        break;
+    case MnemonicNot:
+        WriteOperand(Cpu, Instruction, Destination, ~ReadOperand(Cpu, Instruction, Destination));
+        break;
+    case MnemonicShl:
+    case MnemonicShr:
+    case MnemonicSar:
+    case MnemonicRol:
+    case MnemonicRor:
+    case MnemonicRcl:
+    case MnemonicRcr:
+        WriteOperand(Cpu, Instruction, Destination,
+                     ShiftWithFlags(Cpu, Mnemonic, ReadOperand(Cpu, Instruction, Destination),
+                                    ReadOperand(Cpu, Instruction, Source), Wide));
+        break;
+    case MnemonicMul:
+    case MnemonicImul:
+        ExecuteMultiply(Cpu, Instruction);
+        break;
+    case MnemonicDiv:
+    case MnemonicIdiv:
+        ExecuteDivide(Cpu, Instruction);
+        break;
+    case MnemonicCbw:
+        Cpu->Registers.Bytes[1] = (Cpu->Registers.Bytes[0] & 0x80) ? 0xff : 0;
+        break;
+    case MnemonicCwd:
+        Words[RegisterDx] = (Words[RegisterAx] & 0x8000) ? 0xffff : 0;
+        break;
+    case MnemonicAaa:
+    case MnemonicAas:
+    case MnemonicDaa:
+    case MnemonicDas:
+    case MnemonicAam:
+    case MnemonicAad:
+        ExecuteDecimalAdjust(Cpu, Instruction);
+        break;
+    case MnemonicXchg: {
+        const uint16_t Value = ReadOperand(Cpu, Instruction, Destination);
+        WriteOperand(Cpu, Instruction, Destination, ReadOperand(Cpu, Instruction, Source));
+        WriteOperand(Cpu, Instruction, Source, Value);
+        break;
+    }
+    case MnemonicLea:
+        WriteOperand(Cpu, Instruction, Destination, GetEffectiveOffset(Cpu, Instruction, Source));
+        break;
+    case MnemonicLds:
+    case MnemonicLes: {
+        const uint32_t Address = GetOperandAddress(Cpu, Instruction, Source);
+        WriteOperand(Cpu, Instruction, Destination, ReadMemory(Cpu, Address, 1));
+        Cpu->Segments[(Mnemonic == MnemonicLds) ? SegmentDs : SegmentEs] =
+            ReadMemory(Cpu, (Address + 2) & MemoryMask, 1);
+        break;
+    }
+    case MnemonicXlat: {
+        const uint8_t Segment = (Instruction->Flags & InstSegment) ? Instruction->SegmentOverride : SegmentDs;
+        const uint16_t Offset = Words[RegisterBx] + Cpu->Registers.Bytes[0];
+        Cpu->Registers.Bytes[0] = Cpu->Memory[GetPhysicalAddress(Cpu->Segments[Segment], Offset)];
+        break;
+    }
+    case MnemonicPush:
+        Push(Cpu, ReadOperand(Cpu, Instruction, Destination));
+        break;
+    case MnemonicPop:
+        WriteOperand(Cpu, Instruction, Destination, Pop(Cpu));
+        break;
+    case MnemonicPushf:
+        Push(Cpu, Cpu->Flags | 0xf002);
+        break;
+    case MnemonicPopf:
+        Cpu->Flags = Pop(Cpu) & FlagsDefined;
+        break;
+    case MnemonicLahf:
+        Cpu->Registers.Bytes[1] = (Cpu->Flags & FlagsLow) | 0x2;
+        break;
+    case MnemonicSahf:
+        Cpu->Flags = (Cpu->Flags & ~FlagsLow) | (Cpu->Registers.Bytes[1] & FlagsLow);
+        break;
+    case MnemonicIn:
+        // Nothing is attached to the bus so every port reads back all ones
+        WriteOperand(Cpu, Instruction, Destination, 0xffff);
+        break;
+    case MnemonicOut:
+        break;
+    case MnemonicMovs:
+    case MnemonicCmps:
+    case MnemonicScas:
+    case MnemonicLods:
+    case MnemonicStos:
+        ExecuteString(Cpu, Instruction);
+        break;
+    case MnemonicJmp:
+    case MnemonicCall:
+        ExecuteTransfer(Cpu, Instruction);
+        break;
+    case MnemonicRet:
+    case MnemonicRetf:
+        Cpu->ip = Pop(Cpu);
+        if (Mnemonic == MnemonicRetf) {
+            Cpu->Segments[SegmentCs] = Pop(Cpu);
+        }
+        if (Destination.Type == OperandImmediate) {
+            Words[RegisterSp] += Instruction->Immediate;
+        }
+        break;
+    case MnemonicJo:
+    case MnemonicJno:
+    case MnemonicJb:
+    case MnemonicJnb:
+    case MnemonicJe:
+    case MnemonicJne:
+    case MnemonicJbe:
+    case MnemonicJa:
+    case MnemonicJs:
+    case MnemonicJns:
+    case MnemonicJp:
+    case MnemonicJnp:
+    case MnemonicJl:
+    case MnemonicJnl:
+    case MnemonicJle:
+    case MnemonicJg:
+        if (IsConditionTrue(Cpu, Mnemonic)) {
+            Cpu->ip += Instruction->Immediate;
+        }
+        break;
+    case MnemonicLoop:
+    case MnemonicLoopz:
+    case MnemonicLoopnz: {
+        const int Zero = !!(Cpu->Flags & FlagZero);
+        const int Taken = --Words[RegisterCx] && ((Mnemonic == MnemonicLoop) || ((Mnemonic == MnemonicLoopz) == Zero));
+        if (Taken) {
+            Cpu->ip += Instruction->Immediate;
+        }
+        break;
+    }
+    case MnemonicJcxz:
+        if (!Words[RegisterCx]) {
+            Cpu->ip += Instruction->Immediate;
+        }
+        break;
+    case MnemonicInt:
+        Interrupt(Cpu, Instruction->Immediate);
+        break;
+    case MnemonicInt3:
+        Interrupt(Cpu, 3);
+        break;
+    case MnemonicInto:
+        if (Cpu->Flags & FlagOverflow) {
+            Interrupt(Cpu, 4);
+        }
+        break;
+    case MnemonicIret:
+        Cpu->ip = Pop(Cpu);
+        Cpu->Segments[SegmentCs] = Pop(Cpu);
+        Cpu->Flags = Pop(Cpu) & FlagsDefined;
+        break;
+    case MnemonicClc:
+        Cpu->Flags &= ~FlagCarry;
+        break;
+    case MnemonicStc:
+        Cpu->Flags |= FlagCarry;
+        break;
+    case MnemonicCmc:
+        Cpu->Flags ^= FlagCarry;
+        break;
+    case MnemonicCld:
+        Cpu->Flags &= ~FlagDirection;
+        break;
+    case MnemonicStd:
+        Cpu->Flags |= FlagDirection;
+        break;
+    case MnemonicCli:
+        Cpu->Flags &= ~FlagInterrupt;
+        break;
+    case MnemonicSti:
+        Cpu->Flags |= FlagInterrupt;
+        break;
+    case MnemonicHlt:
+        Cpu->Halted = 1;
+        break;
+    case MnemonicNop:
+    case MnemonicWait:
+    case MnemonicEsc:
+        break;
+    default:
+        fprintf(stderr, "[%s] ERROR: Undefined instruction %x at %04x:%04x\n", __func__, Instruction->Opcode,
+                Cpu->Segments[SegmentCs], (uint16_t)(Cpu->ip - Instruction->Length));
+        Cpu->Halted = 1;
+        break;
+    }
+}
+
+// Runs one instruction and adds its Table 2-21 clocks using what actually happened: whether a conditional transfer
+// was taken, how many times rep went round, the shift count in cl and whether the memory operand was at an odd address.
+void ExecuteCountingClocks(Cpu_t *Cpu, const Instruction_t *Instruction) {
+    const InstructionClocks_t Clocks = GetInstructionClocks(Instruction);
+    const uint16_t CxBefore = Cpu->Registers.Words[RegisterCx];
+    int OddAddress = 0;
+    for (int i = 0; i < 2; i++) {
+        if (Instruction->Operands[i].Type == OperandMemory) {
+            OddAddress = GetEffectiveOffset(Cpu, Instruction, Instruction->Operands[i]) & 0x1;
+        }
+    }
+    if (GetInstructionClass(Instruction) == ClassString) {
+        // Both string addresses move together so either one being odd costs every transfer
+        OddAddress = (Cpu->Registers.Words[RegisterSi] | Cpu->Registers.Words[RegisterDi]) & 0x1;
+    }
+
+    const uint16_t NextIp = Cpu->ip + Instruction->Length;
+    const uint16_t Cs = Cpu->Segments[SegmentCs];
+    Cpu->ip = NextIp;
+    ExecuteInstruction(Cpu, Instruction);
+
+    uint64_t Spent = Clocks.Base + Clocks.EffectiveAddress;
+    if (Clocks.Taken && ((Cpu->ip != NextIp) || (Cpu->Segments[SegmentCs] != Cs))) {
+        Spent = Clocks.Taken;
+    }
+    // Only rep repeats the memory transfers, a shift by cl reads and writes its operand once
+    uint32_t TransferPasses = 1;
+    if (Clocks.PerRepetition && (GetInstructionClass(Instruction) == ClassShift)) {
+        Spent += (uint64_t)Clocks.PerRepetition * (CxBefore & 0xff);
+    } else if (Clocks.PerRepetition) {
+        TransferPasses = (uint16_t)(CxBefore - Cpu->Registers.Words[RegisterCx]);
+        Spent += (uint64_t)Clocks.PerRepetition * TransferPasses;
+    }
+    if (OddAddress) {
+        Spent += (uint64_t)Clocks.Transfers * OddTransferClocks * TransferPasses;
+    }
+    Cpu->Clocks += Spent;
+}
+
+ThreadedHandler_t *SelectHandler(const Instruction_t *Instruction);
+
+// Returns the cache entry for the instruction at Address, decoding it and picking its handler on a miss.
+const CachedInstruction_t *FetchInstruction(Cpu_t *Cpu, const uint32_t Address) {
+    CachedInstruction_t *Cached = &Cpu->DecodeCache[Address];
+    if (!Cached->Instruction.Length) {
+        const FileInfo_t MemoryInfo = {MemorySize, Cpu->Memory, 0};
+        DecodeInstruction(Address, MemoryInfo, &Cached->Instruction);
+        Cached->Handler = SelectHandler(&Cached->Instruction);
+        memset(&Cpu->CodeMap[Address], 1, Cached->Instruction.Length);
+    }
+    return Cached;
+}
+
+// Runs until hlt, until cs:ip leaves the loaded program or until Limit instructions have run. Without a decode cache
+// every instruction is decoded again each time it runs.
+void Run(Cpu_t *Cpu, const uint64_t Limit) {
+    const FileInfo_t MemoryInfo = {MemorySize, Cpu->Memory, 0};
+    while (!Cpu->Halted && (Cpu->InstructionCount < Limit)) {
+        const uint32_t Address = GetPhysicalAddress(Cpu->Segments[SegmentCs], Cpu->ip);
+        if (Address >= Cpu->ProgramEnd) {
+            break;
+        }
+
+        Instruction_t Decoded;
+        const Instruction_t *Instruction = &Decoded;
+        ThreadedHandler_t *Handler = ExecuteInstruction;
+        if (Cpu->DecodeCache) {
+            const CachedInstruction_t *Cached = FetchInstruction(Cpu, Address);
+            Instruction = &Cached->Instruction;
+            Handler = Cached->Handler;
+        } else {
+            DecodeInstruction(Address, MemoryInfo, &Decoded);
+        }
+        if (Cpu->Trace) {
+            BeginTraceStep(Cpu);
+        }
+        if (Cpu->CountClocks) {
+            ExecuteCountingClocks(Cpu, Instruction);
+        } else {
+            Cpu->ip += Instruction->Length;
+            Handler(Cpu, Instruction);
+        }
+        Cpu->InstructionCount++;
+        if (Cpu->Trace) {
+            EndTraceStep(Cpu);
+        }
+    }
+}
+
+//*****************************************************************************
+// Threaded Execution
+//*****************************************************************************
+// A basic block is a straight run of decoded instructions that ends at anything that can move cs:ip somewhere other
+// than the next instruction. Each instruction had its handler picked when it went into the decode cache, so running a
+// block is a flat loop of indirect calls with no dispatch on the mnemonic or operand types.
+#define MaxBlockLength 32
+#define MaxBlocks 8192
+
+typedef struct {
+    ThreadedHandler_t *Handler;
+    const Instruction_t *Instruction;
+} ThreadedOp_t;
+
+// Links remember the blocks control went to after this one the first time, so loops and if/else go block to block
+// without a BlockMap lookup.
+struct Block {
+    uint32_t Start;
+    uint32_t Count;
+    Block_t *Links[2];
+    ThreadedOp_t Ops[MaxBlockLength];
+};
+
+void ExecuteMovRegister(Cpu_t *Cpu, const Instruction_t *Instruction) {
+    WriteRegister(Cpu, Instruction->Operands[0].Index, ReadRegister(Cpu, Instruction->Operands[1].Index));
+}
+
+void ExecuteMovImmediate(Cpu_t *Cpu, const Instruction_t *Instruction) {
+    WriteRegister(Cpu, Instruction->Operands[0].Index, Instruction->Immediate);
+}
+
+void ExecuteMovToMemory(Cpu_t *Cpu, const Instruction_t *Instruction) {
+    WriteMemory(Cpu, GetOperandAddress(Cpu, Instruction, Instruction->Operands[0]),
+                ReadRegister(Cpu, Instruction->Operands[1].Index), Instruction->Flags & InstWide);
+}
+
+void ExecuteMovFromMemory(Cpu_t *Cpu, const Instruction_t *Instruction) {
+    WriteRegister(Cpu, Instruction->Operands[0].Index,
+                  ReadMemory(Cpu, GetOperandAddress(Cpu, Instruction, Instruction->Operands[1]),
+                             Instruction->Flags & InstWide));
+}
+
+// Register destination ALU handlers. The source is a register, an immediate or memory, Kind picks which at compile
+// time so each generated handler only does the one read it needs.
+#define AluSourceRegister(Cpu, Instruction) ReadRegister(Cpu, Instruction->Operands[1].Index)
+#define AluSourceImmediate(Cpu, Instruction) (Instruction->Immediate)
+#define AluSourceMemory(Cpu, Instruction)                                                                              \
+    ReadMemory(Cpu, GetOperandAddress(Cpu, Instruction, Instruction->Operands[1]), Instruction->Flags & InstWide)
+
+#define ALU_HANDLER(Name, Kind, Operation, WritesBack)                                                                 \
+    void Execute##Name##Kind(Cpu_t *Cpu, const Instruction_t *Instruction) {                                           \
+        const int Wide = Instruction->Flags & InstWide;                                                                \
+        const uint8_t Destination = Instruction->Operands[0].Index;                                                    \
+        const uint16_t A = ReadRegister(Cpu, Destination);                                                             \
+        const uint16_t B = AluSource##Kind(Cpu, Instruction);                                                          \
+        const uint16_t Result = Operation;                                                                             \
+        if (WritesBack) {                                                                                              \
+            WriteRegister(Cpu, Destination, Result);                                                                   \
+        }                                                                                                              \
+    }
+
+#define ALU_HANDLERS(X)                                                                                                \
+    X(Add, AddWithFlags(Cpu, A, B, 0, Wide), 1)                                                                        \
+    X(Adc, AddWithFlags(Cpu, A, B, Cpu->Flags & FlagCarry, Wide), 1)                                                   \
+    X(Sub, SubWithFlags(Cpu, A, B, 0, Wide), 1)                                                                        \
+    X(Sbb, SubWithFlags(Cpu, A, B, Cpu->Flags & FlagCarry, Wide), 1)                                                   \
+    X(Cmp, SubWithFlags(Cpu, A, B, 0, Wide), 0)                                                                        \
+    X(And, LogicWithFlags(Cpu, A & B, Wide), 1)                                                                        \
+    X(Or, LogicWithFlags(Cpu, A | B, Wide), 1)                                                                         \
+    X(Xor, LogicWithFlags(Cpu, A ^ B, Wide), 1)                                                                        \
+    X(Test, LogicWithFlags(Cpu, A & B, Wide), 0)
+
+#define ALU_HANDLER_KINDS(Name, Operation, WritesBack)                                                                 \
+    ALU_HANDLER(Name, Register, Operation, WritesBack)                                                                 \
+    ALU_HANDLER(Name, Immediate, Operation, WritesBack)                                                                \
+    ALU_HANDLER(Name, Memory, Operation, WritesBack)
+ALU_HANDLERS(ALU_HANDLER_KINDS)
+
+void ExecuteIncRegister(Cpu_t *Cpu, const Instruction_t *Instruction) {
+    const uint16_t Carry = Cpu->Flags & FlagCarry;
+    const uint8_t Destination = Instruction->Operands[0].Index;
+    const uint16_t Result =
+        AddWithFlags(Cpu, ReadRegister(Cpu, Destination), 1, 0, Instruction->Flags & InstWide);
+    Cpu->Flags = (Cpu->Flags & ~FlagCarry) | Carry;
+    WriteRegister(Cpu, Destination, Result);
+}
+
+void ExecuteDecRegister(Cpu_t *Cpu, const Instruction_t *Instruction) {
+    const uint16_t Carry = Cpu->Flags & FlagCarry;
+    const uint8_t Destination = Instruction->Operands[0].Index;
+    const uint16_t Result =
+        SubWithFlags(Cpu, ReadRegister(Cpu, Destination), 1, 0, Instruction->Flags & InstWide);
+    Cpu->Flags = (Cpu->Flags & ~FlagCarry) | Carry;
+    WriteRegister(Cpu, Destination, Result);
+}
+
+void ExecuteConditionalJump(Cpu_t *Cpu, const Instruction_t *Instruction) {
+    if (IsConditionTrue(Cpu, Instruction->Mnemonic)) {
+        Cpu->ip += Instruction->Immediate;
+    }
+}
+
+void ExecuteLoop(Cpu_t *Cpu, const Instruction_t *Instruction) {
+    if (--Cpu->Registers.Words[RegisterCx]) {
+        Cpu->ip += Instruction->Immediate;
+    }
+}
+
+// Picks the most specific handler for an instruction. Anything without one goes through ExecuteInstruction.
+ThreadedHandler_t *SelectHandler(const Instruction_t *Instruction) {
+    const uint8_t Destination = Instruction->Operands[0].Type;
+    const uint8_t Source = Instruction->Operands[1].Type;
+
+    if (Instruction->Mnemonic == MnemonicMov) {
+        if ((Destination == OperandRegister) && (Source == OperandRegister)) {
+            return ExecuteMovRegister;
+        } else if ((Destination == OperandRegister) && (Source == OperandImmediate)) {
+            return ExecuteMovImmediate;
+        } else if ((Destination == OperandMemory) && (Source == OperandRegister)) {
+            return ExecuteMovToMemory;
+        } else if ((Destination == OperandRegister) && (Source == OperandMemory)) {
+            return ExecuteMovFromMemory;
+        }
+        return ExecuteInstruction;
+    }
+
+    if (Destination == OperandRegister) {
+#define ALU_SELECT(Name, Operation, WritesBack)                                                                        \
+    if (Instruction->Mnemonic == Mnemonic##Name) {                                                                     \
+        return (Source == OperandRegister)    ? Execute##Name##Register                                                \
+               : (Source == OperandImmediate) ? Execute##Name##Immediate                                               \
+               : (Source == OperandMemory)    ? Execute##Name##Memory                                                  \
+                                              : ExecuteInstruction;                                                    \
+    }
+        ALU_HANDLERS(ALU_SELECT)
+#undef ALU_SELECT
+        if (Instruction->Mnemonic == MnemonicInc) {
+            return ExecuteIncRegister;
+        } else if (Instruction->Mnemonic == MnemonicDec) {
+            return ExecuteDecRegister;
+        }
+    }
+
+    if ((Instruction->Mnemonic >= MnemonicJo) && (Instruction->Mnemonic <= MnemonicJg)) {
+        return ExecuteConditionalJump;
+    } else if (Instruction->Mnemonic == MnemonicLoop) {
+        return ExecuteLoop;
+    }
+    return ExecuteInstruction;
+}
+
+// Control transfers end a block, and so does anything that can raise an interrupt or load cs, since the rest of the
+// block would no longer be what runs next.
+int EndsBlock(const Instruction_t *Instruction) {
+    switch (MnemonicClasses[Instruction->Mnemonic]) {
+    case ClassConditionalJump:
+    case ClassJump:
+    case ClassCall:
+    case ClassReturn:
+    case ClassInterrupt:
+    case ClassInvalid:
+        return 1;
+    }
+    switch (Instruction->Mnemonic) {
+    case MnemonicHlt:
+    case MnemonicDiv:
+    case MnemonicIdiv:
+    case MnemonicAam:
+        return 1;
+    }
+    return (Instruction->Operands[0].Type == OperandSegmentRegister) && (Instruction->Operands[0].Index == SegmentCs);
+}
+
+Block_t *BuildBlock(Cpu_t *Cpu, const uint32_t Start) {
+    Block_t *Block = &Cpu->Blocks[Cpu->BlockCount++];
+    Block->Start = Start;
+    Block->Count = 0;
+    Block->Links[0] = NULL;
+    Block->Links[1] = NULL;
+
+    uint32_t Address = Start;
+    while ((Block->Count < MaxBlockLength) && (Address < Cpu->ProgramEnd)) {
+        const CachedInstruction_t *Cached = FetchInstruction(Cpu, Address);
+        const Instruction_t *Instruction = &Cached->Instruction;
+        Block->Ops[Block->Count].Handler = Cached->Handler;
+        Block->Ops[Block->Count].Instruction = Instruction;
+        Block->Count++;
+        Address += Instruction->Length;
+        if (EndsBlock(Instruction)) {
+            break;
+        }
+    }
+    Cpu->BlockMap[Start] = Block;
+    return Block;
+}
+
+// Blocks only ever start below ProgramEnd so that is all of BlockMap that needs clearing.
+void FlushBlocks(Cpu_t *Cpu) {
+    memset(Cpu->BlockMap, 0, Cpu->ProgramEnd * sizeof(*Cpu->BlockMap));
+    Cpu->BlockCount = 0;
+    Cpu->CodeWritten = 0;
+}
+
+// Stops early if an instruction wrote over cached code, the rest of the block may have been decoded from old bytes.
+void RunBlock(Cpu_t *Cpu, const Block_t *Block) {
+    const ThreadedOp_t *Op = Block->Ops;
+    const ThreadedOp_t *End = Op + Block->Count;
+    while (Op < End) {
+        Cpu->ip += Op->Instruction->Length;
+        Op->Handler(Cpu, Op->Instruction);
+        Op++;
+        if (Cpu->CodeWritten) {
+            break;
+        }
+    }
+    Cpu->InstructionCount += Op - Block->Ops;
+}
+
+// Same stopping rules as Run. When fewer than a block's worth of instructions are left before Limit the rest are
+// single stepped so the count comes out exact.
+void RunThreaded(Cpu_t *Cpu, const uint64_t Limit) {
+    Block_t *Previous = NULL;
+    while (!Cpu->Halted && (Cpu->InstructionCount < Limit)) {
+        const uint32_t Address = GetPhysicalAddress(Cpu->Segments[SegmentCs], Cpu->ip);
+        if (Address >= Cpu->ProgramEnd) {
+            break;
+        }
+
+        Block_t *Block = NULL;
+        if (Previous && Previous->Links[0] && (Previous->Links[0]->Start == Address)) {
+            Block = Previous->Links[0];
+        } else if (Previous && Previous->Links[1] && (Previous->Links[1]->Start == Address)) {
+            Block = Previous->Links[1];
+        } else {
+            Block = Cpu->BlockMap[Address];
+            if (!Block) {
+                if (Cpu->BlockCount == MaxBlocks) {
+                    FlushBlocks(Cpu);
+                    Previous = NULL;
+                }
+                Block = BuildBlock(Cpu, Address);
+            }
+            if (Previous) {
+                Previous->Links[Previous->Links[0] ? 1 : 0] = Block;
+            }
+        }
+
+        if ((Limit - Cpu->InstructionCount) < Block->Count) {
+            Run(Cpu, Limit);
+            break;
+        }
+        RunBlock(Cpu, Block);
+        if (Cpu->CodeWritten) {
+            FlushBlocks(Cpu);
+            Previous = NULL;
+        } else {
+            Previous = Block;
+        }
+    }
+}
+
+void RunProgram(Cpu_t *Cpu, const uint64_t Limit) {
+    if (Cpu->Blocks) {
+        RunThreaded(Cpu, Limit);
+    } else {
+        Run(Cpu, Limit);
+    }
+}
+
+//*****************************************************************************
+// Setup And Reporting
+//*****************************************************************************
+// Everything starts at zero and the program is loaded at physical address 0, which is where cs:ip points.
+// Only addresses below ProgramEnd are ever executed, so that is all of the decode cache that needs clearing.
+void ResetCpu(Cpu_t *Cpu, const uint8_t *Program, const size_t ProgramSize) {
+    if (Cpu->DecodeCache) {
+        // Cached instructions near the end can reach a few bytes past it
+        const uint32_t ClearEnd = (Cpu->ProgramEnd + MaxInstructionLength < MemorySize)
+                                      ? Cpu->ProgramEnd + MaxInstructionLength
+                                      : MemorySize;
+        memset(Cpu->DecodeCache, 0, ClearEnd * sizeof(*Cpu->DecodeCache));
+        memset(Cpu->CodeMap, 0, ClearEnd);
+    }
+    if (Cpu->Blocks) {
+        FlushBlocks(Cpu);
+    }
+
+    memset(&Cpu->Registers, 0, sizeof(Cpu->Registers));
+    memset(Cpu->Segments, 0, sizeof(Cpu->Segments));
+    Cpu->ip = 0;
+    Cpu->Flags = 0;
+    Cpu->Halted = 0;
+    Cpu->InstructionCount = 0;
+    Cpu->Clocks = 0;
+    memset(Cpu->Memory, 0, MemorySize);
+    memcpy(Cpu->Memory, Program, ProgramSize);
+    Cpu->ProgramEnd = ProgramSize;
+}
+
+void FreeCpu(Cpu_t *Cpu) {
+    free(Cpu->Memory);
+    free(Cpu->DecodeCache);
+    free(Cpu->CodeMap);
+    free(Cpu->Blocks);
+    free(Cpu->BlockMap);
+}
+
+void PrintCpuState(const Cpu_t *Cpu, const char *Heading) {
+    const char *WordNames[] = {"ax", "bx", "cx", "dx", "sp", "bp", "si", "di"};
+    const uint8_t WordOrder[] = {RegisterAx, RegisterBx, RegisterCx, RegisterDx,
+                                 RegisterSp, RegisterBp, RegisterSi, RegisterDi};
+    printf("%s:\n", Heading);
+    for (int i = 0; i < 8; i++) {
+        const uint16_t Value = Cpu->Registers.Words[WordOrder[i]];
+        printf("      %s: 0x%04x (%u)\n", WordNames[i], Value, Value);
+    }
+    for (int i = 0; i < 4; i++) {
+        printf("      %s: 0x%04x (%u)\n", GetSegmentRegisterStr(i), Cpu->Segments[i], Cpu->Segments[i]);
+    }
+    printf("      ip: 0x%04x (%u)\n", Cpu->ip, Cpu->ip);
+
+    const char FlagLetters[] = "C?P?A?ZSTIDO";
+    printf("   flags: ");
+    for (int Bit = 0; Bit < 12; Bit++) {
+        if ((Cpu->Flags >> Bit) & 0x1) {
+            printf("%c", FlagLetters[Bit]);
+        }
+    }
+    printf("\nExecuted %lu instructions\n", Cpu->InstructionCount);
+    if (Cpu->CountClocks) {
+        printf("Estimated %lu 8086 clocks\n", Cpu->Clocks);
+    }
+}
+
+void DumpMemory(const Cpu_t *Cpu, const char *DumpFile) {
+    FILE *DumpStream = fopen(DumpFile, "wb");
+    if (!DumpStream || (fwrite(Cpu->Memory, MemorySize, 1, DumpStream) != 1)) {
+        printf("[%s] ERROR: Could not write memory to %s\n", __func__, DumpFile);
+        exit(1);
+    }
+    fclose(DumpStream);
+}
+
+//*****************************************************************************
+// Trace Replay
+//*****************************************************************************
+// Replay never executes anything, it puts the recorded changes back. Every read is checked against the end of the
+// section it belongs to so a damaged trace stops with an error.
+void CheckTrace(const int Condition, const char *What) {
+    if (!Condition) {
+        printf("[%s] ERROR: Trace is truncated or corrupt, %s\n", __func__, What);
+        exit(1);
+    }
+}
+
+uint32_t GetVarint(const uint8_t **At, const uint8_t *End) {
+    uint32_t Value = 0;
+    for (int Shift = 0; Shift < 32; Shift += 7) {
+        CheckTrace(*At < End, "a step record runs off the end");
+        const uint8_t Byte = *(*At)++;
+        Value |= (uint32_t)(Byte & 0x7f) << Shift;
+        if (!(Byte & 0x80)) {
+            return Value;
+        }
+    }
+    CheckTrace(0, "a varint is too long");
+    return 0;
+}
+
+int32_t UnZigZag(const uint32_t Value) { return (int32_t)(Value >> 1) ^ -(int32_t)(Value & 1); }
+
+// Checks the header, footer and index all line up and returns the footer. Nothing after the program is aligned, so
+// the footer and index entries get copied out.
+TraceFooter_t GetTraceFooter(const FileInfo_t TraceInfo) {
+    const TraceHeader_t *Header = (const TraceHeader_t *)TraceInfo.Bin;
+    if ((TraceInfo.FileSize < (sizeof(TraceHeader_t) + sizeof(TraceFooter_t))) ||
+        memcmp(Header->Magic, TraceMagic, sizeof(Header->Magic))) {
+        printf("[%s] ERROR: Not an execution trace\n", __func__);
+        exit(1);
+    }
+    TraceFooter_t Footer;
+    memcpy(&Footer, TraceInfo.Bin + TraceInfo.FileSize - sizeof(TraceFooter_t), sizeof(Footer));
+    CheckTrace(!memcmp(Footer.Magic, TraceFooterMagic, sizeof(Footer.Magic)), "the footer is missing");
+    CheckTrace((Header->ProgramSize <= MemorySize) && Header->CheckpointInterval && Footer.CheckpointCount &&
+                   ((sizeof(TraceHeader_t) + Header->ProgramSize) <= Footer.IndexOffset) &&
+                   (Footer.CheckpointCount <= (TraceInfo.FileSize / sizeof(TraceCheckpoint_t))) &&
+                   ((Footer.IndexOffset + (Footer.CheckpointCount * sizeof(TraceCheckpoint_t)) +
+                     sizeof(TraceFooter_t)) == TraceInfo.FileSize),
+               "the header and footer don't match");
+    return Footer;
+}
+
+void ReadTraceCheckpoint(Cpu_t *Cpu, TraceState_t *State, const uint8_t **At, const uint8_t *End) {
+    uint32_t DirtyCount;
+    CheckTrace((size_t)(End - *At) >= (sizeof(TraceState_t) + sizeof(DirtyCount)), "a checkpoint is cut off");
+    memcpy(State, *At, sizeof(TraceState_t));
+    memcpy(&DirtyCount, *At + sizeof(TraceState_t), sizeof(DirtyCount));
+    *At += sizeof(TraceState_t) + sizeof(DirtyCount);
+    CheckTrace(DirtyCount <= TracePageCount, "a checkpoint has too many pages");
+    for (uint32_t i = 0; i < DirtyCount; i++) {
+        uint16_t Page;
+        CheckTrace((size_t)(End - *At) >= (sizeof(Page) + TracePageSize), "a checkpoint page is cut off");
+        memcpy(&Page, *At, sizeof(Page));
+        CheckTrace(Page < TracePageCount, "a checkpoint page is outside memory");
+        memcpy(Cpu->Memory + (Page * TracePageSize), *At + sizeof(Page), TracePageSize);
+        *At += sizeof(Page) + TracePageSize;
+    }
+}
+
+// Puts Cpu in the state it was in after Step steps of the traced run: the nearest checkpoint at or before Step, then
+// forward through at most a checkpoint interval of step records.
+void SeekTrace(Cpu_t *Cpu, const FileInfo_t TraceInfo, const uint64_t Step) {
+    const TraceHeader_t *Header = (const TraceHeader_t *)TraceInfo.Bin;
+    const TraceFooter_t Footer = GetTraceFooter(TraceInfo);
+    if (Step > Footer.StepCount) {
+        printf("[%s] ERROR: Step %lu is past the end of the trace, which has %lu\n", __func__, Step, Footer.StepCount);
+        exit(1);
+    }
+    uint64_t Index = Step / Header->CheckpointInterval;
+    Index = (Index < Footer.CheckpointCount) ? Index : (Footer.CheckpointCount - 1);
+    TraceCheckpoint_t Checkpoint;
+    memcpy(&Checkpoint, TraceInfo.Bin + Footer.IndexOffset + (Index * sizeof(Checkpoint)), sizeof(Checkpoint));
+    CheckTrace((Checkpoint.Step <= Step) && (Checkpoint.Offset < Footer.IndexOffset), "the index is wrong");
+
+    ResetCpu(Cpu, TraceInfo.Bin + sizeof(TraceHeader_t), Header->ProgramSize);
+    const uint8_t *At = TraceInfo.Bin + Checkpoint.Offset;
+    const uint8_t *End = TraceInfo.Bin + Footer.IndexOffset;
+    TraceState_t State;
+    ReadTraceCheckpoint(Cpu, &State, &At, End);
+    uint32_t LastWriteAddress = 0;
+    for (uint64_t Current = Checkpoint.Step; Current < Step; Current++) {
+        if ((Current != Checkpoint.Step) && !(Current % Header->CheckpointInterval)) {
+            ReadTraceCheckpoint(Cpu, &State, &At, End);
+            LastWriteAddress = 0;
+        }
+        State.ip += UnZigZag(GetVarint(&At, End));
+        const uint32_t Changed = GetVarint(&At, End);
+        for (int Field = 0; Field < TraceFieldCount; Field++) {
+            if (Changed & (1 << Field)) {
+                State.Fields[Field] += UnZigZag(GetVarint(&At, End));
+            }
+        }
+        if (Changed & (1 << TraceFieldCount)) {
+            const uint32_t WriteCount = GetVarint(&At, End);
+            for (uint32_t i = 0; i < WriteCount; i++) {
+                const uint32_t Address = LastWriteAddress + UnZigZag(GetVarint(&At, End));
+                CheckTrace((Address < MemorySize) && (At < End), "a write is outside memory");
+                Cpu->Memory[Address] = *At++;
+                LastWriteAddress = Address;
+            }
+        }
+    }
+    SetTraceState(Cpu, &State);
+    Cpu->InstructionCount = Step;
+}
+
+// Registers at the step and the instruction that runs next, if there is one.
+void PrintTraceStep(const Cpu_t *Cpu, const FileInfo_t TraceInfo) {
+    const uint64_t StepCount = GetTraceFooter(TraceInfo).StepCount;
+    printf("Step %lu of %lu\n", Cpu->InstructionCount, StepCount);
+    if (Cpu->InstructionCount < StepCount) {
+        const FileInfo_t MemoryInfo = {MemorySize, Cpu->Memory, 0};
+        Instruction_t Next;
+        DecodeInstruction(GetPhysicalAddress(Cpu->Segments[SegmentCs], Cpu->ip), MemoryInfo, &Next);
+        OutputBuffer_t Output = CreateOutputBuffer(1);
+        AppendStr(&Output, "    next: ");
+        FormatInstruction(&Output, &Next);
+        FlushOutput(&Output, STDOUT_FILENO);
+        free(Output.Data);
+    }
+    PrintCpuState(Cpu, "Registers");
+}
+
+//*****************************************************************************
+// Benchmark
+//*****************************************************************************
+// Used when --bench isn't given a bin. 200 passes of a 1000 iteration loop that mixes register and memory
+// arithmetic:
+//     mov ax, 4096 / mov ds, ax / mov dx, 200
+//     outer: mov cx, 1000
+//     inner: add ax, cx / mov [bx + si + 4], ax / xor bx, ax / adc si, [bx + si + 4] / loop inner
+//     dec dx / jne outer / hlt
+static const uint8_t BenchmarkKernel[] = {
+    0xb8, 0x00, 0x10, 0x8e, 0xd8, 0xba, 0xc8, 0x00, 0xb9, 0xe8, 0x03, 0x01, 0xc8, 0x89,
+    0x40, 0x04, 0x31, 0xc3, 0x13, 0x70, 0x04, 0xe2, 0xf4, 0x4a, 0x75, 0xee, 0xf4,
+};
+
+// Reruns the program from reset until at least a second has gone by and reports instructions per second.
+void BenchmarkRun(Cpu_t *Cpu, const uint8_t *Program, const size_t ProgramSize, const uint64_t Limit) {
+    const double MinSeconds = 1.0;
+    uint64_t Instructions = 0;
+    uint64_t Runs = 0;
+    double Elapsed = 0;
+    while (Elapsed < MinSeconds) {
+        ResetCpu(Cpu, Program, ProgramSize);
+        const double Start = GetSeconds();
+        RunProgram(Cpu, Limit);
+        Elapsed += GetSeconds() - Start;
+        Instructions += Cpu->InstructionCount;
+        Runs++;
+    }
+    printf("%lu runs, %lu instructions in %.3fs, %.1f M instructions/sec\n", Runs, Instructions, Elapsed,
+           ((double)Instructions / Elapsed) / 1e6);
+}
+
+int main(int argc, char *argv[]) {
+    int Benchmark = 0;
+    int UseDecodeCache = 1;
+    int UseBlocks = 1;
+    int CountClocks = 0;
+    uint64_t Limit = UINT64_MAX;
+    const char *DumpFile = NULL;
+    const char *TraceFile = NULL;
+    const char *ReplayFile = NULL;
+    int Seek = 0;
+    uint64_t SeekStep = 0;
+    int ArgIndex = 1;
+    for (; (ArgIndex < argc) && !strncmp(argv[ArgIndex], "--", 2); ArgIndex++) {
+        if (!strcmp(argv[ArgIndex], "--bench")) {
+            Benchmark = 1;
+        } else if (!strcmp(argv[ArgIndex], "--no-cache")) {
+            UseDecodeCache = 0;
+            UseBlocks = 0;
+        } else if (!strcmp(argv[ArgIndex], "--step")) {
+            UseBlocks = 0;
+        } else if (!strcmp(argv[ArgIndex], "--clocks")) {
+            // Clocks depend on what each instruction did, so this single steps
+            CountClocks = 1;
+            UseBlocks = 0;
+        } else if (!strcmp(argv[ArgIndex], "--limit") && ((ArgIndex + 1) < argc)) {
+            Limit = strtoull(argv[++ArgIndex], NULL, 0);
+        } else if (!strcmp(argv[ArgIndex], "--dump") && ((ArgIndex + 1) < argc)) {
+            DumpFile = argv[++ArgIndex];
+        } else if (!strcmp(argv[ArgIndex], "--trace") && ((ArgIndex + 1) < argc)) {
+            // Every step is recorded on its own, so this single steps too
+            TraceFile = argv[++ArgIndex];
+            UseBlocks = 0;
+        } else if (!strcmp(argv[ArgIndex], "--replay") && ((ArgIndex + 1) < argc)) {
+            ReplayFile = argv[++ArgIndex];
+        } else if (!strcmp(argv[ArgIndex], "--seek") && ((ArgIndex + 1) < argc)) {
+            Seek = 1;
+            SeekStep = strtoull(argv[++ArgIndex], NULL, 0);
+        } else {
+            printf("ERROR: Unknown option %s\n", argv[ArgIndex]);
+            exit(1);
+        }
+    }
+    if ((ArgIndex >= argc) && !Benchmark && !ReplayFile) {
+        printf("ERROR: Must provide path to input bin file on commandline.\n");
+        printf("Usage: %s [--bench] [--step] [--no-cache] [--clocks] [--limit <instructions>] [--dump <file>]\n"
+               "       [--trace <trace>] <bin>\n"
+               "   or: %s --replay <trace> [--seek <step>] [--dump <file>]\n",
+               argv[0], argv[0]);
+        printf("       --bench without a bin runs a built in loop\n");
+        printf("       --step runs one instruction at a time instead of as threaded basic blocks\n");
+        printf("       --no-cache also decodes every instruction again each time it runs\n");
+        printf("       --clocks single steps and estimates 8086 clocks for the run\n");
+        printf("       --trace records every step's register and memory changes, --replay shows the state after\n"
+               "               any step of the recorded run, the last one without --seek\n");
+        exit(1);
+    }
+    if (TraceFile && Benchmark) {
+        printf("ERROR: --trace records a single run, not --bench\n");
+        exit(1);
+    }
+
+    Cpu_t Cpu = {0};
+    Cpu.CountClocks = CountClocks;
+    Cpu.Memory = calloc(MemorySize, 1);
+    if (!Cpu.Memory) {
+        printf("ERROR: Could not malloc %u bytes for memory.\n", MemorySize);
+        exit(1);
+    }
+    if (UseDecodeCache) {
+        // calloc keeps this cheap, only the pages the program actually runs from get touched
+        Cpu.DecodeCache = calloc(MemorySize, sizeof(CachedInstruction_t));
+        Cpu.CodeMap = calloc(MemorySize, 1);
+        if (!Cpu.DecodeCache || !Cpu.CodeMap) {
+            printf("ERROR: Could not malloc the decode cache.\n");
+            exit(1);
+        }
+    }
+    if (UseBlocks) {
+        Cpu.Blocks = malloc(MaxBlocks * sizeof(Block_t));
+        Cpu.BlockMap = calloc(MemorySize, sizeof(Block_t *));
+        if (!Cpu.Blocks || !Cpu.BlockMap) {
+            printf("ERROR: Could not malloc the block cache.\n");
+            exit(1);
+        }
+    }
+
+    if (ReplayFile) {
+        const FileInfo_t TraceInfo = LoadBin(ReplayFile);
+        SeekTrace(&Cpu, TraceInfo, Seek ? SeekStep : GetTraceFooter(TraceInfo).StepCount);
+        PrintTraceStep(&Cpu, TraceInfo);
+        if (DumpFile) {
+            DumpMemory(&Cpu, DumpFile);
+        }
+        UnloadBin(TraceInfo);
+        FreeCpu(&Cpu);
+        return 0;
+    }
+
+    if (ArgIndex >= argc) {
+        BenchmarkRun(&Cpu, BenchmarkKernel, sizeof(BenchmarkKernel), Limit);
+        FreeCpu(&Cpu);
+        return 0;
+    }
+
+    const FileInfo_t FileInfo = LoadBin(argv[ArgIndex]);
+    if (FileInfo.FileSize > MemorySize) {
+        printf("ERROR: Bin is 0x%lx bytes, bigger than the 1 MiB address space.\n", FileInfo.FileSize);
+        exit(1);
+    }
+
+    if (Benchmark) {
+        BenchmarkRun(&Cpu, FileInfo.Bin, FileInfo.FileSize, Limit);
+    } else {
+        ResetCpu(&Cpu, FileInfo.Bin, FileInfo.FileSize);
+        if (TraceFile) {
+            OpenTrace(&Cpu, TraceFile, FileInfo.Bin, FileInfo.FileSize);
+        }
+        RunProgram(&Cpu, Limit);
+        if (TraceFile) {
+            CloseTrace(&Cpu, TraceFile);
+        }
+        PrintCpuState(&Cpu, "Final registers");
+        if (DumpFile) {
+            DumpMemory(&Cpu, DumpFile);
+        }
+    }
+
+    UnloadBin(FileInfo);
+    FreeCpu(&Cpu);
+    return 0;
+}
@@ -0,0 +1,964 @@
+#include <dirent.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "8086_decode.h"
+#include "lib8086decode.h"
+
+// Regression test for every decoder. Each reference listing in the listings directory sits next to its bin, named the
+// way nasm names its output, and every decoder that can handle that listing decodes the bin. Generated corpora have no
+// reference of their own. The engines are checked against lib8086decode on them, which only shows they agree since they
+// share the decoder core, and decoder3 --verify checks the core itself by encoding every record back to the bin's
+// bytes. All the runs go out in parallel as child processes, each is timed, and each listing is compared instruction
+// by instruction after both sides are brought to a canonical form, so only what was decoded matters and not how it was
+// printed. CPU time on the bigger bins is compared against a baseline the way bench8086 does it.
+#define MaxCases 256
+#define MaxEngineArgs 8
+#define MaxLineLength 256
+#define MaxLineOperands 4
+// Mnemonic words from a whole line plus every operand at its longest
+#define MaxCanonicalLength (MaxLineLength + 8 + (MaxLineOperands * 64))
+#define TimeoutSeconds 60
+// Startup swamps the run time of anything smaller, so throughput isn't shown for it
+#define MinThroughputSize (64 * 1024)
+// Runs over bins at least MinThroughputSize long are timed this many times and the best is kept
+#define TimingRepeats 5
+
+//*****************************************************************************
+// Engines
+//*****************************************************************************
+typedef enum {
+    EngineText = 0, // The listing on stdout
+    EngineRecords,  // decoder3 --format records on stdout
+    EngineVerify,   // Nothing to compare, the exit status says whether decoder3 --verify round tripped the bin
+} EngineOutput_t;
+
+typedef struct {
+    const char *Name;
+    const char *Args[MaxEngineArgs]; // The bin goes after these, no Args runs lib8086decode in the child instead
+    EngineOutput_t Output;
+    int HeaderLines; // Lines on stdout ahead of the listing
+    int LastListing; // Highest course listing it gets through, 0 for all of them
+} Engine_t;
+
+// A new decoder gets a line here
+static const Engine_t Engines[] = {
+    {"decoder1", {"./decoder1"}, EngineText, 0, 38},
+    {"decoder2", {"./decoder2"}, EngineText, 1, 39},
+    {"decoder3", {"./decoder3"}, EngineText, 0, 0},
+    {"decoder3 --stream", {"./decoder3", "--stream"}, EngineText, 0, 0},
+    {"decoder3 --parallel 4", {"./decoder3", "--parallel", "4"}, EngineText, 0, 0},
+    {"decoder3 --format records", {"./decoder3", "--format", "records"}, EngineRecords, 0, 0},
+    {"decoder3 --verify", {"./decoder3", "--verify"}, EngineVerify, 0, 0},
+    {"lib8086decode", {NULL}, EngineText, 0, 0},
+};
+#define EngineCount (sizeof(Engines) / sizeof(Engines[0]))
+
+// Same layout as decoder3's Structured Output section
+#define RecordsMagic "8086REC1"
+
+typedef struct {
+    char Magic[8];
+    uint32_t RecordSize;
+    uint32_t RecordCount;
+    uint64_t BinSize;
+} RecordsHeader_t;
+
+typedef struct {
+    uint32_t Offset;
+    uint8_t Length;
+    uint8_t Class;
+    uint8_t Mnemonic;
+    uint8_t Flags;
+    Operand_t Operands[2];
+    uint8_t Opcode;
+    uint8_t ModRM;
+    uint8_t SegmentOverride;
+    uint8_t Reserved;
+    int16_t Displacement;
+    uint16_t Immediate;
+    uint16_t Segment;
+    uint16_t Reserved2;
+} InstructionRecord_t;
+_Static_assert(sizeof(RecordsHeader_t) == 24, "RecordsHeader_t has to match decoder3");
+_Static_assert(sizeof(InstructionRecord_t) == 24, "InstructionRecord_t has to match decoder3");
+
+// The listing lib8086decode produces for a bin, in a malloc'd buffer.
+char *DecodeWithLibrary(const char *BinFile, size_t *Size) {
+    const FileInfo_t FileInfo = LoadBin(BinFile);
+    Instruction_t *Instructions = malloc((FileInfo.FileSize + 1) * sizeof(Instruction_t));
+    char *Text = malloc((FileInfo.FileSize + 1) * (MaxInstructionTextLength + 1));
+    if (!Instructions || !Text) {
+        printf("[%s] ERROR: Could not malloc a listing for %lu bytes.\n", __func__, FileInfo.FileSize);
+        exit(1);
+    }
+    size_t Count;
+    size_t Consumed;
+    const Lib8086Status_t Status =
+        Lib8086DecodeBatch(FileInfo.Bin, FileInfo.FileSize, Instructions, FileInfo.FileSize, &Count, &Consumed);
+    size_t Used = 0;
+    for (size_t i = 0; i < Count; i++) {
+        size_t Length;
+        Lib8086Format(&Instructions[i], Text + Used, MaxInstructionTextLength + 1, &Length);
+        Used += Length;
+        Text[Used++] = '\n';
+    }
+    if (Status != Lib8086Ok) {
+        Used += sprintf(Text + Used, "; %s at 0x%lx\n", Lib8086StatusStr(Status), Consumed);
+    }
+    free(Instructions);
+    UnloadBin(FileInfo);
+    *Size = Used;
+    return Text;
+}
+
+// Turns decoder3's records back into a listing so they compare like the others. Anything wrong with the records
+// themselves goes in Error and stops the conversion.
+char *FormatRecords(const char *Data, const size_t Size, const size_t BinSize, size_t *TextSize, char *Error,
+                    const size_t ErrorSize) {
+    RecordsHeader_t Header;
+    if (Size < sizeof(Header)) {
+        snprintf(Error, ErrorSize, "only %lu bytes of records", Size);
+        return NULL;
+    }
+    memcpy(&Header, Data, sizeof(Header));
+    if (memcmp(Header.Magic, RecordsMagic, sizeof(Header.Magic)) ||
+        (Header.RecordSize != sizeof(InstructionRecord_t)) ||
+        (Size != (sizeof(Header) + ((size_t)Header.RecordCount * sizeof(InstructionRecord_t))))) {
+        snprintf(Error, ErrorSize, "records header doesn't match a %lu byte file", Size);
+        return NULL;
+    }
+    if (Header.BinSize != BinSize) {
+        snprintf(Error, ErrorSize, "records are for a 0x%lx byte bin, not 0x%lx", Header.BinSize, BinSize);
+        return NULL;
+    }
+
+    OutputBuffer_t Output = CreateOutputBuffer(Header.RecordCount);
+    uint64_t ip = 0;
+    for (uint32_t i = 0; i < Header.RecordCount; i++) {
+        InstructionRecord_t Record;
+        memcpy(&Record, Data + sizeof(Header) + (i * sizeof(Record)), sizeof(Record));
+        if (Record.Offset != ip) {
+            snprintf(Error, ErrorSize, "record %u is at 0x%x, the one before it ends at 0x%lx", i, Record.Offset, ip);
+            free(Output.Data);
+            return NULL;
+        }
+        const Instruction_t Instruction = {
+            .Opcode = Record.Opcode,
+            .ModRM = Record.ModRM,
+            .Mnemonic = Record.Mnemonic,
+            .Length = Record.Length,
+            .Flags = Record.Flags,
+            .SegmentOverride = Record.SegmentOverride,
+            .Operands = {Record.Operands[0], Record.Operands[1]},
+            .Displacement = Record.Displacement,
+            .Immediate = Record.Immediate,
+            .Segment = Record.Segment,
+        };
+        FormatInstruction(&Output, &Instruction);
+        ip += Record.Length;
+    }
+    if (ip != BinSize) {
+        snprintf(Error, ErrorSize, "records end at 0x%lx", ip);
+        free(Output.Data);
+        return NULL;
+    }
+    *TextSize = Output.Used;
+    return Output.Data;
+}
+
+//*****************************************************************************
+// Canonical Form
+//*****************************************************************************
+// One instruction line becomes mnemonic, size and operands with everything a listing can spell more than one way
+// settled: case, spacing, comments, number bases, "+ -4" against "- 4", [bp] against [bp + 0], the order of the base
+// registers, nasm's alternate condition names, a size the register operand already implies, and immediates wrapped
+// to the width of the instruction so -12 and 244 are the same byte.
+typedef enum {
+    TokenEnd = 0,
+    TokenWord,
+    TokenNumber,
+    TokenChar,
+} TokenType_t;
+
+typedef struct {
+    TokenType_t Type;
+    char Text[32];
+    int64_t Value;
+} Token_t;
+
+typedef struct {
+    const char *At;
+    Token_t Token;
+} Tokenizer_t;
+
+typedef enum {
+    OperandText = 0, // Registers, memory, relative and far targets, already canonical
+    OperandNumber,   // Immediates, which need the instruction width first
+} LineOperandType_t;
+
+typedef struct {
+    LineOperandType_t Type;
+    char Text[64];
+    int64_t Value;
+} LineOperand_t;
+
+static const char *const RegisterNames[] = {
+    "al", "cl", "dl", "bl", "ah", "ch", "dh", "bh", "ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+};
+static const char *const SegmentRegisterNames[] = {"es", "cs", "ss", "ds"};
+static const char *const BaseRegisterNames[] = {"bx", "bp", "si", "di"};
+static const char *const ShiftMnemonics[] = {"rol", "ror", "rcl", "rcr", "shl", "shr", "sar"};
+
+// nasm's other names on the left, the one decoder3 prints on the right
+static const char *const MnemonicAliases[][2] = {
+    {"jz", "je"},          {"jnz", "jne"},        {"jnge", "jl"},        {"jng", "jle"},        {"jnae", "jb"},
+    {"jc", "jb"},          {"jna", "jbe"},        {"jpe", "jp"},         {"jge", "jnl"},        {"jnle", "jg"},
+    {"jae", "jnb"},        {"jnc", "jnb"},        {"jnbe", "ja"},        {"jpo", "jnp"},        {"loope", "loopz"},
+    {"loopne", "loopnz"},  {"sal", "shl"},        {"xlatb", "xlat"},     {"repe", "rep"},       {"repz", "rep"},
+    {"repnz", "repne"},    {"dword", "far"},
+};
+
+int FindName(const char *Name, const char *const *Names, const int Count) {
+    for (int i = 0; i < Count; i++) {
+        if (!strcmp(Name, Names[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int IsSegmentRegister(const char *Name) {
+    return FindName(Name, SegmentRegisterNames, 4) >= 0;
+}
+
+int IsRegister(const char *Name) {
+    return (FindName(Name, RegisterNames, 16) >= 0) || IsSegmentRegister(Name);
+}
+
+int IsSizeWord(const char *Name) {
+    return !strcmp(Name, "byte") || !strcmp(Name, "word") || !strcmp(Name, "far");
+}
+
+// Words that only say how nasm should encode something that has one encoding anyway
+int IsNoiseWord(const char *Name) {
+    return !strcmp(Name, "ptr") || !strcmp(Name, "short") || !strcmp(Name, "near");
+}
+
+void NextToken(Tokenizer_t *Tokenizer) {
+    const char *At = Tokenizer->At;
+    while ((*At == ' ') || (*At == '\t')) {
+        At++;
+    }
+    Token_t *Token = &Tokenizer->Token;
+    Token->Value = 0;
+    size_t Length = 0;
+    if (!*At) {
+        Token->Type = TokenEnd;
+    } else if (((*At >= 'a') && (*At <= 'z')) || (*At == '_')) {
+        Token->Type = TokenWord;
+        while ((((*At >= 'a') && (*At <= 'z')) || ((*At >= '0') && (*At <= '9')) || (*At == '_')) &&
+               (Length < (sizeof(Token->Text) - 1))) {
+            Token->Text[Length++] = *At++;
+        }
+    } else if ((*At >= '0') && (*At <= '9')) {
+        char *End;
+        Token->Type = TokenNumber;
+        // Only 0x is a base, a leading 0 isn't octal in a listing
+        const int IsHex = (At[0] == '0') && (At[1] == 'x');
+        Token->Value = strtoll(At, &End, IsHex ? 16 : 10);
+        Length = (size_t)(End - At) < (sizeof(Token->Text) - 1) ? (size_t)(End - At) : (sizeof(Token->Text) - 1);
+        memcpy(Token->Text, At, Length);
+        At = End;
+    } else {
+        Token->Type = TokenChar;
+        Token->Text[Length++] = *At++;
+    }
+    Token->Text[Length] = 0;
+    // Words in the alias table read as the name they stand for
+    const size_t AliasCount = sizeof(MnemonicAliases) / sizeof(MnemonicAliases[0]);
+    for (size_t a = 0; (Token->Type == TokenWord) && (a < AliasCount); a++) {
+        if (!strcmp(Token->Text, MnemonicAliases[a][0])) {
+            strcpy(Token->Text, MnemonicAliases[a][1]);
+        }
+    }
+    Tokenizer->At = At;
+}
+
+int IsChar(const Tokenizer_t *Tokenizer, const char Char) {
+    return (Tokenizer->Token.Type == TokenChar) && (Tokenizer->Token.Text[0] == Char);
+}
+
+// "[es:bx + si - 4]" with the tokenizer on the '['. The segment can also come ahead of the bracket, "es:[...]", in
+// which case the caller passes it in.
+void ParseMemory(Tokenizer_t *Tokenizer, const char *Segment, char *Text, const size_t TextSize) {
+    char SegmentName[4] = {0};
+    if (Segment) {
+        strcpy(SegmentName, Segment);
+    }
+    int Bases = 0;
+    char Others[32] = {0}; // "+ax+cx", registers that can't be a base kept as written so they can only ever mismatch
+    int64_t Displacement = 0;
+    int Sign = 1;
+    NextToken(Tokenizer);
+    while ((Tokenizer->Token.Type != TokenEnd) && !IsChar(Tokenizer, ']')) {
+        const Token_t *Token = &Tokenizer->Token;
+        if (IsChar(Tokenizer, '-')) {
+            Sign = -Sign;
+        } else if (Token->Type == TokenNumber) {
+            Displacement += Sign * Token->Value;
+            Sign = 1;
+        } else if ((Token->Type == TokenWord) && IsSegmentRegister(Token->Text)) {
+            strcpy(SegmentName, Token->Text);
+        } else if (Token->Type == TokenWord) {
+            const int Base = FindName(Token->Text, BaseRegisterNames, 4);
+            if (Base >= 0) {
+                Bases |= 1 << Base;
+            } else {
+                const size_t OthersUsed = strlen(Others);
+                snprintf(Others + OthersUsed, sizeof(Others) - OthersUsed, "+%s", Token->Text);
+            }
+            Sign = 1;
+        }
+        NextToken(Tokenizer);
+    }
+    NextToken(Tokenizer);
+
+    int Used = snprintf(Text, TextSize, "[%s%s", SegmentName, SegmentName[0] ? ":" : "");
+    int Terms = 0;
+    for (int b = 0; b < 4; b++) {
+        if (Bases & (1 << b)) {
+            Used += snprintf(Text + Used, TextSize - Used, "%s%s", Terms++ ? "+" : "", BaseRegisterNames[b]);
+        }
+    }
+    if (Others[0]) {
+        Used += snprintf(Text + Used, TextSize - Used, "%s", Others + (Terms++ ? 0 : 1));
+    }
+    // Addresses wrap at 64k, so a displacement of -1 and 0xffff are the same
+    if ((uint16_t)Displacement || !Terms) {
+        Used += snprintf(Text + Used, TextSize - Used, "%s0x%x", Terms ? "+" : "", (uint16_t)Displacement);
+    }
+    snprintf(Text + Used, TextSize - Used, "]");
+}
+
+// Writes the canonical form of one instruction line to Canonical.
+void CanonicalizeLine(const char *Line, const size_t LineLength, char *Canonical, const size_t CanonicalSize) {
+    char Lower[MaxLineLength];
+    size_t Length = 0;
+    for (size_t i = 0; (i < LineLength) && (Line[i] != ';') && (Length < (sizeof(Lower) - 1)); i++) {
+        Lower[Length++] = ((Line[i] >= 'A') && (Line[i] <= 'Z')) ? (Line[i] - 'A' + 'a') : Line[i];
+    }
+    Lower[Length] = 0;
+
+    Tokenizer_t Tokenizer = {Lower, {0}};
+    NextToken(&Tokenizer);
+    int Used = 0;
+    Canonical[0] = 0;
+
+    // Mnemonic and prefixes are the words up to the first operand. A segment register ahead of the mnemonic is an
+    // override prefix, "es movsb", rather than an operand.
+    int IsShift = 0;
+    int HaveMnemonic = 0;
+    while ((Tokenizer.Token.Type == TokenWord) &&
+           (!IsRegister(Tokenizer.Token.Text) || (!HaveMnemonic && IsSegmentRegister(Tokenizer.Token.Text))) &&
+           !IsSizeWord(Tokenizer.Token.Text) && !IsNoiseWord(Tokenizer.Token.Text)) {
+        IsShift |= FindName(Tokenizer.Token.Text, ShiftMnemonics, 7) >= 0;
+        HaveMnemonic |= !IsSegmentRegister(Tokenizer.Token.Text) && strcmp(Tokenizer.Token.Text, "lock") &&
+                        strcmp(Tokenizer.Token.Text, "rep") && strcmp(Tokenizer.Token.Text, "repne");
+        Used += snprintf(Canonical + Used, CanonicalSize - Used, "%s%s", Used ? " " : "", Tokenizer.Token.Text);
+        NextToken(&Tokenizer);
+    }
+
+    char Size[8] = {0};
+    LineOperand_t Operands[MaxLineOperands];
+    int OperandCount = 0;
+    int HasRegister = 0;
+    int HasByteRegister = 0;
+    while ((Tokenizer.Token.Type != TokenEnd) && (OperandCount < MaxLineOperands)) {
+        LineOperand_t *Operand = &Operands[OperandCount++];
+        Operand->Type = OperandText;
+        Operand->Text[0] = 0;
+        while ((Tokenizer.Token.Type != TokenEnd) && !IsChar(&Tokenizer, ',')) {
+            if (IsChar(&Tokenizer, '[')) {
+                ParseMemory(&Tokenizer, NULL, Operand->Text, sizeof(Operand->Text));
+                continue;
+            }
+            Token_t Token = Tokenizer.Token;
+            NextToken(&Tokenizer);
+            if ((Token.Type == TokenWord) && IsSizeWord(Token.Text)) {
+                strcpy(Size, Token.Text);
+            } else if ((Token.Type == TokenWord) && IsNoiseWord(Token.Text)) {
+                // Dropped
+            } else if ((Token.Type == TokenWord) && IsSegmentRegister(Token.Text) && IsChar(&Tokenizer, ':')) {
+                NextToken(&Tokenizer);
+                ParseMemory(&Tokenizer, Token.Text, Operand->Text, sizeof(Operand->Text));
+            } else if ((Token.Type == TokenWord) && IsRegister(Token.Text)) {
+                const int Register = FindName(Token.Text, RegisterNames, 16);
+                HasRegister = 1;
+                HasByteRegister |= (Register >= 0) && (Register < 8);
+                snprintf(Operand->Text, sizeof(Operand->Text), "%s", Token.Text);
+            } else if ((Token.Type == TokenChar) && (Token.Text[0] == '$')) {
+                // Relative to the start of the instruction, jumps wrap at 64k too
+                int64_t Offset = 0;
+                int Sign = 1;
+                while ((Tokenizer.Token.Type != TokenEnd) && !IsChar(&Tokenizer, ',')) {
+                    Sign = IsChar(&Tokenizer, '-') ? -Sign : Sign;
+                    Offset += (Tokenizer.Token.Type == TokenNumber) ? (Sign * Tokenizer.Token.Value) : 0;
+                    NextToken(&Tokenizer);
+                }
+                snprintf(Operand->Text, sizeof(Operand->Text), "$%+d", (int16_t)Offset);
+            } else if ((Token.Type == TokenNumber) || ((Token.Type == TokenChar) && (Token.Text[0] == '-'))) {
+                const int Negative = (Token.Type == TokenChar);
+                if (Negative && (Tokenizer.Token.Type == TokenNumber)) {
+                    Token = Tokenizer.Token;
+                    NextToken(&Tokenizer);
+                }
+                const int64_t Value = Negative ? -Token.Value : Token.Value;
+                if (IsChar(&Tokenizer, ':')) {
+                    // Far pointer, segment:offset
+                    NextToken(&Tokenizer);
+                    snprintf(Operand->Text, sizeof(Operand->Text), "0x%x:0x%x", (uint16_t)Value,
+                             (uint16_t)Tokenizer.Token.Value);
+                    NextToken(&Tokenizer);
+                } else {
+                    Operand->Type = OperandNumber;
+                    Operand->Value = Value;
+                }
+            } else {
+                // Something the canonical form doesn't know, kept as is so it can only ever mismatch
+                strncat(Operand->Text, Token.Text, sizeof(Operand->Text) - strlen(Operand->Text) - 1);
+            }
+        }
+        if (IsChar(&Tokenizer, ',')) {
+            NextToken(&Tokenizer);
+        }
+    }
+
+    // A register operand already gives the size, except for the count of a shift
+    if (Size[0] && !(HasRegister && !IsShift && strcmp(Size, "far"))) {
+        Used += snprintf(Canonical + Used, CanonicalSize - Used, " %s", Size);
+    }
+    const uint32_t ImmediateMask = (HasByteRegister || !strcmp(Size, "byte")) ? 0xff : 0xffff;
+    for (int o = 0; o < OperandCount; o++) {
+        Used += snprintf(Canonical + Used, CanonicalSize - Used, "%s", o ? "," : " ");
+        if (Operands[o].Type == OperandNumber) {
+            Used += snprintf(Canonical + Used, CanonicalSize - Used, "%u", (uint32_t)Operands[o].Value & ImmediateMask);
+        } else {
+            Used += snprintf(Canonical + Used, CanonicalSize - Used, "%s", Operands[o].Text);
+        }
+    }
+}
+
+typedef struct {
+    const char *At;
+    const char *End;
+    uint64_t Line; // 1 based line number of the last line returned
+} ListingCursor_t;
+
+// Moves to the next line with an instruction on it, or returns 0 at the end of the listing. Blank lines, comments
+// and the bits directive are all that get skipped, whatever else is on the line gets compared.
+int NextListingLine(ListingCursor_t *Cursor, const char **Line, size_t *LineLength) {
+    while (Cursor->At < Cursor->End) {
+        const char *Start = Cursor->At;
+        const char *End = memchr(Start, '\n', Cursor->End - Start);
+        End = End ? End : Cursor->End;
+        Cursor->At = (End < Cursor->End) ? (End + 1) : End;
+        Cursor->Line++;
+        const char *First = Start;
+        while ((First < End) && ((*First == ' ') || (*First == '\t') || (*First == '\r'))) {
+            First++;
+        }
+        if ((First < End) && (*First != ';') && ((End - First) < 5 || strncasecmp(First, "bits ", 5))) {
+            *Line = Start;
+            *LineLength = End - Start;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Walks the two listings in step. Returns 1 when they decode to the same instructions, otherwise 0 with the first
+// difference in Error.
+int CompareListings(const char *Reference, const size_t ReferenceSize, const char *Output, const size_t OutputSize,
+                    const int HeaderLines, char *Error, const size_t ErrorSize) {
+    ListingCursor_t Expected = {Reference, Reference + ReferenceSize, 0};
+    ListingCursor_t Actual = {Output, Output + OutputSize, 0};
+    for (int h = 0; (h < HeaderLines) && (Actual.At < Actual.End); h++) {
+        const char *End = memchr(Actual.At, '\n', Actual.End - Actual.At);
+        Actual.At = End ? (End + 1) : Actual.End;
+        Actual.Line++;
+    }
+
+    uint64_t Instructions = 0;
+    for (;;) {
+        const char *ExpectedLine;
+        const char *ActualLine;
+        size_t ExpectedLength;
+        size_t ActualLength;
+        const int HaveExpected = NextListingLine(&Expected, &ExpectedLine, &ExpectedLength);
+        const int HaveActual = NextListingLine(&Actual, &ActualLine, &ActualLength);
+        if (!HaveExpected && !HaveActual) {
+            return 1;
+        }
+        if (!HaveActual) {
+            snprintf(Error, ErrorSize, "output ends after %lu instructions, reference line %lu is \"%.*s\"",
+                     Instructions, Expected.Line, (int)ExpectedLength, ExpectedLine);
+            return 0;
+        }
+        if (!HaveExpected) {
+            snprintf(Error, ErrorSize, "output line %lu \"%.*s\" is past the end of the reference", Actual.Line,
+                     (int)ActualLength, ActualLine);
+            return 0;
+        }
+        // Most lines are written the same way on both sides and don't need the canonical form
+        if ((ExpectedLength != ActualLength) || memcmp(ExpectedLine, ActualLine, ActualLength)) {
+            char ExpectedCanonical[MaxCanonicalLength];
+            char ActualCanonical[MaxCanonicalLength];
+            CanonicalizeLine(ExpectedLine, ExpectedLength, ExpectedCanonical, sizeof(ExpectedCanonical));
+            CanonicalizeLine(ActualLine, ActualLength, ActualCanonical, sizeof(ActualCanonical));
+            if (strcmp(ExpectedCanonical, ActualCanonical)) {
+                snprintf(Error, ErrorSize, "reference line %lu \"%.*s\" came out as \"%.*s\"", Expected.Line,
+                         (int)ExpectedLength, ExpectedLine, (int)ActualLength, ActualLine);
+                return 0;
+            }
+        }
+        Instructions++;
+    }
+}
+
+//*****************************************************************************
+// Runs
+//*****************************************************************************
+typedef struct {
+    char Name[NAME_MAX + 1];
+    char BinFile[PATH_MAX];
+    char ReferenceFile[PATH_MAX]; // Empty for a generated corpus
+    int Listing;                  // Course listing number from the name, 0 if it isn't one
+    size_t BinSize;
+    char *Reference;
+    size_t ReferenceSize;
+} Case_t;
+
+typedef enum {
+    RunSkipped = 0,
+    RunPending,
+    RunRunning,
+    RunPassed,
+    RunFailed,
+} RunState_t;
+
+typedef struct {
+    Case_t *Case;
+    const Engine_t *Engine;
+    RunState_t State;
+    pid_t Pid;
+    FILE *Output;
+    FILE *Errors;
+    int Status;
+    double Start;
+    double Seconds;            // Wall clock
+    double CpuSeconds;         // User plus system, from the child's rusage
+    double BaselineCpuSeconds; // 0 when the baseline has nothing for this run
+    int Repeats;               // Times it has run, Seconds and CpuSeconds are the best of them
+    char Error[MaxLineLength * 3];
+} Run_t;
+
+char *ReadStream(FILE *Stream, size_t *Size) {
+    fseek(Stream, 0, SEEK_END);
+    const long Length = ftell(Stream);
+    rewind(Stream);
+    char *Data = malloc(Length + 1);
+    if (!Data || (fread(Data, 1, Length, Stream) != (size_t)Length)) {
+        printf("[%s] ERROR: Could not read back %ld bytes of output.\n", __func__, Length);
+        exit(1);
+    }
+    Data[Length] = 0;
+    *Size = Length;
+    return Data;
+}
+
+int EngineRuns(const Engine_t *Engine, const Case_t *Case) {
+    // A corpus is checked against lib8086decode, so running it there would only compare the library with itself
+    if (!Engine->Args[0] && !Case->ReferenceFile[0]) {
+        return 0;
+    }
+    return !Engine->LastListing || (Case->Listing && (Case->Listing <= Engine->LastListing));
+}
+
+void StartRun(Run_t *Run) {
+    Run->Output = tmpfile();
+    Run->Errors = tmpfile();
+    if (!Run->Output || !Run->Errors) {
+        printf("[%s] ERROR: Could not make temporary files for output.\n", __func__);
+        exit(1);
+    }
+    fflush(stdout);
+    Run->Start = GetSeconds();
+    Run->Pid = fork();
+    if (Run->Pid < 0) {
+        printf("[%s] ERROR: Could not fork for %s.\n", __func__, Run->Engine->Name);
+        exit(1);
+    }
+    if (!Run->Pid) {
+        dup2(fileno(Run->Output), STDOUT_FILENO);
+        dup2(fileno(Run->Errors), STDERR_FILENO);
+        // The default action kills it, and the alarm carries over exec
+        alarm(TimeoutSeconds);
+        if (!Run->Engine->Args[0]) {
+            size_t Size;
+            char *Text = DecodeWithLibrary(Run->Case->BinFile, &Size);
+            _exit((fwrite(Text, 1, Size, stdout) != Size) || fflush(stdout));
+        }
+        char *Argv[MaxEngineArgs + 2] = {0};
+        int Argc = 0;
+        for (; (Argc < MaxEngineArgs) && Run->Engine->Args[Argc]; Argc++) {
+            Argv[Argc] = (char *)Run->Engine->Args[Argc];
+        }
+        Argv[Argc] = Run->Case->BinFile;
+        execv(Argv[0], Argv);
+        fprintf(stderr, "could not run %s\n", Argv[0]);
+        _exit(127);
+    }
+    Run->State = RunRunning;
+}
+
+// Works out whether a finished run passed
+void CheckRun(Run_t *Run) {
+    Run->State = RunFailed;
+    if (WIFSIGNALED(Run->Status)) {
+        const int Signal = WTERMSIG(Run->Status);
+        if (Signal == SIGALRM) {
+            snprintf(Run->Error, sizeof(Run->Error), "timed out after %ds", TimeoutSeconds);
+        } else {
+            snprintf(Run->Error, sizeof(Run->Error), "killed by signal %d", Signal);
+        }
+        return;
+    }
+    if (WEXITSTATUS(Run->Status)) {
+        // The first line of whatever it had to say says why. --verify lists its mismatches on stdout.
+        size_t ErrorsSize;
+        char *Errors = ReadStream((Run->Engine->Output == EngineVerify) ? Run->Output : Run->Errors, &ErrorsSize);
+        Errors[strcspn(Errors, "\n")] = 0;
+        snprintf(Run->Error, sizeof(Run->Error), "exit status %d: %.*s", WEXITSTATUS(Run->Status), MaxLineLength,
+                 Errors);
+        free(Errors);
+        return;
+    }
+    if (Run->Engine->Output == EngineVerify) {
+        Run->State = RunPassed;
+        return;
+    }
+
+    size_t OutputSize;
+    char *Output = ReadStream(Run->Output, &OutputSize);
+    if (Run->Engine->Output == EngineRecords) {
+        char *Records = Output;
+        Output = FormatRecords(Records, OutputSize, Run->Case->BinSize, &OutputSize, Run->Error, sizeof(Run->Error));
+        free(Records);
+        if (!Output) {
+            return;
+        }
+    }
+    if (CompareListings(Run->Case->Reference, Run->Case->ReferenceSize, Output, OutputSize, Run->Engine->HeaderLines,
+                        Run->Error, sizeof(Run->Error))) {
+        Run->State = RunPassed;
+    }
+    free(Output);
+}
+
+// Keeps up to Jobs children going until every run is done. Each one is checked as it comes back so its output files
+// can go before the next starts.
+void RunAll(Run_t *Runs, const size_t RunCount, const int Jobs) {
+    size_t Next = 0;
+    int Running = 0;
+    for (;;) {
+        while ((Running < Jobs) && (Next < RunCount)) {
+            if (Runs[Next].State == RunPending) {
+                StartRun(&Runs[Next]);
+                Running++;
+            }
+            Next++;
+        }
+        if (!Running) {
+            break;
+        }
+
+        int Status;
+        struct rusage Usage;
+        const pid_t Pid = wait4(-1, &Status, 0, &Usage);
+        if (Pid < 0) {
+            printf("[%s] ERROR: Lost track of %d running decoders.\n", __func__, Running);
+            exit(1);
+        }
+        const double Now = GetSeconds();
+        for (size_t r = 0; r < RunCount; r++) {
+            Run_t *Run = &Runs[r];
+            if ((Run->State == RunRunning) && (Run->Pid == Pid)) {
+                const double Seconds = Now - Run->Start;
+                const double CpuSeconds = (double)(Usage.ru_utime.tv_sec + Usage.ru_stime.tv_sec) +
+                                          ((double)(Usage.ru_utime.tv_usec + Usage.ru_stime.tv_usec) / 1e6);
+                Run->Seconds = (Run->Repeats && (Run->Seconds < Seconds)) ? Run->Seconds : Seconds;
+                Run->CpuSeconds = (Run->Repeats && (Run->CpuSeconds < CpuSeconds)) ? Run->CpuSeconds : CpuSeconds;
+                Run->Repeats++;
+                Run->Status = Status;
+                CheckRun(Run);
+                fclose(Run->Output);
+                fclose(Run->Errors);
+                // Bigger bins go again straight away in the same slot and keep their best time
+                if ((Run->State == RunPassed) && (Run->Case->BinSize >= MinThroughputSize) &&
+                    (Run->Repeats < TimingRepeats)) {
+                    StartRun(Run);
+                } else {
+                    Running--;
+                }
+            }
+        }
+    }
+}
+
+//*****************************************************************************
+// Baseline
+//*****************************************************************************
+// One "<case> <bin size> <cpu seconds> <engine>" line per run. Only runs over at least MinThroughputSize bytes are
+// compared, on anything smaller the time is all process startup. A run that took more than RegressionThreshold more
+// CPU time than its line says is called out. Lines for a bin of another size are ignored.
+#define RegressionThreshold 0.15
+
+int LoadBaseline(const char *BaselineFile, Run_t *Runs, const size_t RunCount) {
+    FILE *Stream = fopen(BaselineFile, "r");
+    if (!Stream) {
+        return 0;
+    }
+    char Line[MaxLineLength];
+    while (fgets(Line, sizeof(Line), Stream)) {
+        char Name[NAME_MAX + 1];
+        size_t BinSize;
+        double CpuSeconds;
+        int EngineAt;
+        if (sscanf(Line, "%255s %lu %lf %n", Name, &BinSize, &CpuSeconds, &EngineAt) != 3) {
+            continue;
+        }
+        Line[strcspn(Line, "\n")] = 0;
+        for (size_t r = 0; r < RunCount; r++) {
+            Run_t *Run = &Runs[r];
+            if (!strcmp(Run->Case->Name, Name) && !strcmp(Run->Engine->Name, Line + EngineAt) &&
+                (Run->Case->BinSize == BinSize)) {
+                Run->BaselineCpuSeconds = CpuSeconds;
+            }
+        }
+    }
+    fclose(Stream);
+    return 1;
+}
+
+void SaveBaseline(const char *BaselineFile, const Run_t *Runs, const size_t RunCount) {
+    FILE *Stream = fopen(BaselineFile, "w");
+    if (!Stream) {
+        printf("[%s] ERROR: Could not open %s for write\n", __func__, BaselineFile);
+        exit(1);
+    }
+    for (size_t r = 0; r < RunCount; r++) {
+        const Run_t *Run = &Runs[r];
+        if (Run->State == RunPassed) {
+            fprintf(Stream, "%s %lu %.6f %s\n", Run->Case->Name, Run->Case->BinSize, Run->CpuSeconds,
+                    Run->Engine->Name);
+        }
+    }
+    fclose(Stream);
+}
+
+//*****************************************************************************
+// Cases
+//*****************************************************************************
+int HasSuffix(const char *Name, const char *Suffix) {
+    const size_t Length = strlen(Name);
+    const size_t SuffixLength = strlen(Suffix);
+    return (Length > SuffixLength) && !strcmp(Name + Length - SuffixLength, Suffix);
+}
+
+Case_t *AddCase(Case_t *Cases, size_t *CaseCount) {
+    if (*CaseCount == MaxCases) {
+        printf("[%s] ERROR: More than %d listings and corpora.\n", __func__, MaxCases);
+        exit(1);
+    }
+    Case_t *Case = &Cases[(*CaseCount)++];
+    memset(Case, 0, sizeof(*Case));
+    return Case;
+}
+
+// Every <name>.asm in the directory, with nasm's default output <name> as its bin
+void FindListings(const char *Directory, Case_t *Cases, size_t *CaseCount) {
+    struct dirent **Entries;
+    const int EntryCount = scandir(Directory, &Entries, NULL, alphasort);
+    if (EntryCount < 0) {
+        printf("[%s] ERROR: Could not read directory %s\n", __func__, Directory);
+        exit(1);
+    }
+    for (int e = 0; e < EntryCount; e++) {
+        const char *Name = Entries[e]->d_name;
+        if (HasSuffix(Name, ".asm")) {
+            Case_t *Case = AddCase(Cases, CaseCount);
+            snprintf(Case->Name, sizeof(Case->Name), "%.*s", (int)(strlen(Name) - 4), Name);
+            snprintf(Case->ReferenceFile, sizeof(Case->ReferenceFile), "%s/%s", Directory, Name);
+            snprintf(Case->BinFile, sizeof(Case->BinFile), "%s/%s", Directory, Case->Name);
+            sscanf(Case->Name, "listing_%d", &Case->Listing);
+        }
+        free(Entries[e]);
+    }
+    free(Entries);
+}
+
+void LoadReference(Case_t *Case) {
+    if (access(Case->BinFile, R_OK)) {
+        printf("ERROR: %s has no bin, assemble it with nasm %s\n", Case->Name, Case->ReferenceFile);
+        exit(1);
+    }
+    FILE *Stream = fopen(Case->BinFile, "rb");
+    fseek(Stream, 0, SEEK_END);
+    Case->BinSize = ftell(Stream);
+    fclose(Stream);
+
+    if (Case->ReferenceFile[0]) {
+        Stream = fopen(Case->ReferenceFile, "rb");
+        if (!Stream) {
+            printf("[%s] ERROR: Could not open %s for read\n", __func__, Case->ReferenceFile);
+            exit(1);
+        }
+        Case->Reference = ReadStream(Stream, &Case->ReferenceSize);
+        fclose(Stream);
+    } else {
+        Case->Reference = DecodeWithLibrary(Case->BinFile, &Case->ReferenceSize);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int Jobs = 0;
+    const char *ListingDirectory = NULL;
+    const char *BaselineFile = NULL;
+    int SaveAsBaseline = 0;
+    int FailOnRegression = 0;
+    Case_t *Cases = calloc(MaxCases, sizeof(Case_t));
+    size_t CaseCount = 0;
+    if (!Cases) {
+        printf("ERROR: Could not malloc %d cases.\n", MaxCases);
+        exit(1);
+    }
+    for (int ArgIndex = 1; ArgIndex < argc; ArgIndex++) {
+        if (!strcmp(argv[ArgIndex], "--jobs") && ((ArgIndex + 1) < argc)) {
+            Jobs = atoi(argv[++ArgIndex]);
+        } else if (!strcmp(argv[ArgIndex], "--baseline") && ((ArgIndex + 1) < argc)) {
+            BaselineFile = argv[++ArgIndex];
+        } else if (!strcmp(argv[ArgIndex], "--save-baseline")) {
+            SaveAsBaseline = 1;
+        } else if (!strcmp(argv[ArgIndex], "--fail-on-regression")) {
+            FailOnRegression = 1;
+        } else if (!strcmp(argv[ArgIndex], "--corpus") && ((ArgIndex + 1) < argc)) {
+            Case_t *Case = AddCase(Cases, &CaseCount);
+            const char *BinFile = argv[++ArgIndex];
+            const char *Slash = strrchr(BinFile, '/');
+            snprintf(Case->Name, sizeof(Case->Name), "%s", Slash ? (Slash + 1) : BinFile);
+            snprintf(Case->BinFile, sizeof(Case->BinFile), "%s", BinFile);
+        } else if (!strncmp(argv[ArgIndex], "--", 2) || ListingDirectory) {
+            printf("ERROR: Unknown option %s\n", argv[ArgIndex]);
+            printf("Usage: %s [--jobs <n>] [--baseline <file>] [--save-baseline] [--fail-on-regression]\n"
+                   "       [--corpus <bin>]... [<listing directory>]\n",
+                   argv[0]);
+            printf("       --jobs runs that many decoders at once, 0 means one per core\n");
+            printf("       --baseline compares CPU times with the file, or saves them to it if it doesn't exist\n");
+            printf("       --fail-on-regression exits non-zero when a run is slower than the baseline allows\n");
+            printf("       --corpus adds a bin without a reference, checked against lib8086decode and --verify\n");
+            exit(1);
+        } else {
+            ListingDirectory = argv[ArgIndex];
+        }
+    }
+    if (ListingDirectory) {
+        FindListings(ListingDirectory, Cases, &CaseCount);
+    }
+    if (!CaseCount) {
+        printf("ERROR: Nothing to test, give a listing directory or a corpus.\n");
+        exit(1);
+    }
+    if (Jobs <= 0) {
+        const long Cores = sysconf(_SC_NPROCESSORS_ONLN);
+        Jobs = (Cores > 0) ? (int)Cores : 1;
+    }
+
+    Run_t *Runs = calloc(CaseCount * EngineCount, sizeof(Run_t));
+    if (!Runs) {
+        printf("ERROR: Could not malloc %lu runs.\n", CaseCount * EngineCount);
+        exit(1);
+    }
+    for (size_t c = 0; c < CaseCount; c++) {
+        LoadReference(&Cases[c]);
+        for (size_t e = 0; e < EngineCount; e++) {
+            Run_t *Run = &Runs[(c * EngineCount) + e];
+            Run->Case = &Cases[c];
+            Run->Engine = &Engines[e];
+            Run->State = EngineRuns(Run->Engine, Run->Case) ? RunPending : RunSkipped;
+        }
+    }
+
+    const int HaveBaseline =
+        BaselineFile && !SaveAsBaseline && LoadBaseline(BaselineFile, Runs, CaseCount * EngineCount);
+
+    const double Start = GetSeconds();
+    RunAll(Runs, CaseCount * EngineCount, Jobs);
+    const double Seconds = GetSeconds() - Start;
+
+    int Passed = 0;
+    int Failed = 0;
+    int Regressions = 0;
+    for (size_t c = 0; c < CaseCount; c++) {
+        const Case_t *Case = &Cases[c];
+        printf("%s (%lu bytes, %s)\n", Case->Name, Case->BinSize,
+               Case->ReferenceFile[0] ? "reference listing" : "against lib8086decode and --verify");
+        for (size_t e = 0; e < EngineCount; e++) {
+            const Run_t *Run = &Runs[(c * EngineCount) + e];
+            if (Run->State == RunSkipped) {
+                continue;
+            }
+            const int Ok = (Run->State == RunPassed);
+            Passed += Ok;
+            Failed += !Ok;
+            printf("    %-26s %-6s %9.2f ms %9.2f ms cpu", Run->Engine->Name, Ok ? "ok" : "FAILED",
+                   Run->Seconds * 1e3, Run->CpuSeconds * 1e3);
+            if (Case->BinSize >= MinThroughputSize) {
+                printf(" %9.1f MB/s", ((double)Case->BinSize / Run->Seconds) / 1e6);
+                if (Ok && Run->BaselineCpuSeconds) {
+                    const double Change = (Run->CpuSeconds / Run->BaselineCpuSeconds) - 1;
+                    printf("  %+.1f%% vs baseline%s", Change * 100,
+                           (Change > RegressionThreshold) ? "  REGRESSION" : "");
+                    Regressions += Change > RegressionThreshold;
+                }
+            }
+            printf("\n");
+            if (!Ok) {
+                printf("        %s\n", Run->Error);
+            }
+        }
+    }
+    printf("%d of %d runs passed in %.2fs, %d at a time\n", Passed, Passed + Failed, Seconds, Jobs);
+    if (HaveBaseline) {
+        printf("%d run(s) more than %.0f%% slower than the baseline\n", Regressions, RegressionThreshold * 100);
+    }
+    // Never overwrite a baseline without being asked to, and never save one from a run that failed
+    if (BaselineFile && !Failed && (SaveAsBaseline || access(BaselineFile, F_OK))) {
+        SaveBaseline(BaselineFile, Runs, CaseCount * EngineCount);
+        printf("Saved baseline to %s\n", BaselineFile);
+    }
+
+    for (size_t c = 0; c < CaseCount; c++) {
+        free(Cases[c].Reference);
+    }
+    free(Runs);
+    free(Cases);
+    return (Failed || (FailOnRegression && Regressions)) ? 1 : 0;
+}
@@ -0,0 +1,97 @@
+#include <string.h>
+
+#include "8086_decode.h"
+#include "lib8086decode.h"
+
+const char *Lib8086StatusStr(const Lib8086Status_t Status) {
+    switch (Status) {
+    case Lib8086Ok:
+        return "ok";
+    case Lib8086Truncated:
+        return "instruction runs past the end of the buffer";
+    case Lib8086NoRoom:
+        return "text buffer too small";
+    case Lib8086BadArgument:
+        return "bad argument";
+    default:
+        return "unknown status";
+    }
+}
+
+// DecodeInstruction exits when it reads past the bin. The prescan works out the length from at most the first
+// MaxInstructionLength bytes without reading outside them, so decoding only starts once it's known to fit. The handlers
+// can still read further than the length says (an undefined group encoding reads its displacement before it turns
+// into a 1 byte db), so they get a zero padded copy that always has MaxInstructionLength bytes.
+Lib8086Status_t Lib8086DecodeOne(const uint8_t *Bytes, const size_t Size, Instruction_t *Instruction,
+                                 uint16_t *Length) {
+    if (!Bytes || !Instruction || !Length) {
+        return Lib8086BadArgument;
+    }
+    const size_t Window = (Size < MaxInstructionLength) ? Size : MaxInstructionLength;
+    uint8_t Padded[MaxInstructionLength] = {0};
+    memcpy(Padded, Bytes, Window);
+    const FileInfo_t WindowInfo = {Window, Padded, 0};
+    uint8_t Lengths[MaxInstructionLength];
+    uint64_t ResolvedSize;
+    PrescanLengthsScalar(WindowInfo, 0, Window, Lengths);
+    if (!ResolveInstructionLengths(Lengths, Window, &ResolvedSize)) {
+        return Lib8086Truncated;
+    }
+
+    const FileInfo_t PaddedInfo = {MaxInstructionLength, Padded, 0};
+    *Length = DecodeInstruction(0, PaddedInfo, Instruction);
+    return Lib8086Ok;
+}
+
+// Decodes up to MaxCount instructions back to back from the start of Bytes. Count gets how many were decoded and
+// Consumed the bytes they cover, also when stopping at a truncated instruction, so a caller streaming through a
+// larger buffer can carry the rest over to the next call.
+Lib8086Status_t Lib8086DecodeBatch(const uint8_t *Bytes, const size_t Size, Instruction_t *Instructions,
+                                   const size_t MaxCount, size_t *Count, size_t *Consumed) {
+    if (!Bytes || !Instructions || !Count || !Consumed) {
+        return Lib8086BadArgument;
+    }
+    const FileInfo_t FileInfo = {Size, Bytes, 0};
+    size_t Decoded = 0;
+    size_t ip = 0;
+    Lib8086Status_t Status = Lib8086Ok;
+    // Anything starting this far from the end can't run off it, so only the tail needs checking
+    const size_t SafeEnd = (Size > MaxInstructionLength) ? (Size - MaxInstructionLength) : 0;
+    while ((Decoded < MaxCount) && (ip < Size)) {
+        uint16_t Length;
+        if (ip < SafeEnd) {
+            Length = DecodeInstruction(ip, FileInfo, &Instructions[Decoded]);
+        } else {
+            Status = Lib8086DecodeOne(Bytes + ip, Size - ip, &Instructions[Decoded], &Length);
+            if (Status != Lib8086Ok) {
+                break;
+            }
+        }
+        ip += Length;
+        Decoded++;
+    }
+    *Count = Decoded;
+    *Consumed = ip;
+    return Status;
+}
+
+// Writes the instruction the way the decoders list it, NUL terminated and without the newline.
+Lib8086Status_t Lib8086Format(const Instruction_t *Instruction, char *Text, const size_t TextSize,
+                              size_t *TextLength) {
+    if (!Instruction || !Text) {
+        return Lib8086BadArgument;
+    }
+    char Line[MaxInstructionTextLength + 1];
+    OutputBuffer_t Output = {Line, 0, sizeof(Line)};
+    FormatInstruction(&Output, Instruction);
+    const size_t Length = Output.Used - 1;
+    if ((Length + 1) > TextSize) {
+        return Lib8086NoRoom;
+    }
+    memcpy(Text, Line, Length);
+    Text[Length] = 0;
+    if (TextLength) {
+        *TextLength = Length;
+    }
+    return Lib8086Ok;
+}
@@ -0,0 +1,193 @@
+#ifndef LIB8086DECODE_H
+#define LIB8086DECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Decoding for other programs to call in-process. Everything works on buffers the caller owns: nothing is allocated,
+// nothing is kept between calls and nothing exits, so any number of threads can call in at once. Errors come back as
+// the return value and leave the outputs untouched.
+//
+//     Instruction_t Instruction;
+//     uint16_t Length;
+//     char Text[MaxInstructionTextLength];
+//     for (size_t ip = 0; Lib8086DecodeOne(Bytes + ip, Size - ip, &Instruction, &Length) == Lib8086Ok; ip += Length) {
+//         Lib8086Format(&Instruction, Text, sizeof(Text), NULL);
+//         puts(Text);
+//     }
+
+// lib8086decode.so is built with -fvisibility=hidden, so these entry points are all it exports and the decoder core
+// behind them can't collide with anything in the program that loads it.
+#define LIB8086_API __attribute__((visibility("default")))
+
+//*****************************************************************************
+// Instruction Records
+//*****************************************************************************
+// Name, text, class. The class column is for the decoder's own tables.
+#define MNEMONICS(X)                                                                                                   \
+    X(Db, "db", ClassInvalid)                                                                                          \
+    X(Mov, "mov", ClassMov)                                                                                            \
+    X(Push, "push", ClassStack)                                                                                        \
+    X(Pop, "pop", ClassStack)                                                                                          \
+    X(Xchg, "xchg", ClassMov)                                                                                          \
+    X(In, "in", ClassIO)                                                                                               \
+    X(Out, "out", ClassIO)                                                                                             \
+    X(Xlat, "xlat", ClassMov)                                                                                          \
+    X(Lea, "lea", ClassMov)                                                                                            \
+    X(Lds, "lds", ClassMov)                                                                                            \
+    X(Les, "les", ClassMov)                                                                                            \
+    X(Lahf, "lahf", ClassFlag)                                                                                         \
+    X(Sahf, "sahf", ClassFlag)                                                                                         \
+    X(Pushf, "pushf", ClassStack)                                                                                      \
+    X(Popf, "popf", ClassStack)                                                                                        \
+    X(Add, "add", ClassArithmetic)                                                                                     \
+    X(Adc, "adc", ClassArithmetic)                                                                                     \
+    X(Inc, "inc", ClassArithmetic)                                                                                     \
+    X(Aaa, "aaa", ClassArithmetic)                                                                                     \
+    X(Daa, "daa", ClassArithmetic)                                                                                     \
+    X(Sub, "sub", ClassArithmetic)                                                                                     \
+    X(Sbb, "sbb", ClassArithmetic)                                                                                     \
+    X(Dec, "dec", ClassArithmetic)                                                                                     \
+    X(Neg, "neg", ClassArithmetic)                                                                                     \
+    X(Cmp, "cmp", ClassArithmetic)                                                                                     \
+    X(Aas, "aas", ClassArithmetic)                                                                                     \
+    X(Das, "das", ClassArithmetic)                                                                                     \
+    X(Mul, "mul", ClassArithmetic)                                                                                     \
+    X(Imul, "imul", ClassArithmetic)                                                                                   \
+    X(Aam, "aam", ClassArithmetic)                                                                                     \
+    X(Div, "div", ClassArithmetic)                                                                                     \
+    X(Idiv, "idiv", ClassArithmetic)                                                                                   \
+    X(Aad, "aad", ClassArithmetic)                                                                                     \
+    X(Cbw, "cbw", ClassArithmetic)                                                                                     \
+    X(Cwd, "cwd", ClassArithmetic)                                                                                     \
+    X(Not, "not", ClassLogic)                                                                                          \
+    X(And, "and", ClassLogic)                                                                                          \
+    X(Test, "test", ClassLogic)                                                                                        \
+    X(Or, "or", ClassLogic)                                                                                            \
+    X(Xor, "xor", ClassLogic)                                                                                          \
+    X(Shl, "shl", ClassShift)                                                                                          \
+    X(Shr, "shr", ClassShift)                                                                                          \
+    X(Sar, "sar", ClassShift)                                                                                          \
+    X(Rol, "rol", ClassShift)                                                                                          \
+    X(Ror, "ror", ClassShift)                                                                                          \
+    X(Rcl, "rcl", ClassShift)                                                                                          \
+    X(Rcr, "rcr", ClassShift)                                                                                          \
+    X(Movs, "movs", ClassString)                                                                                       \
+    X(Cmps, "cmps", ClassString)                                                                                       \
+    X(Scas, "scas", ClassString)                                                                                       \
+    X(Lods, "lods", ClassString)                                                                                       \
+    X(Stos, "stos", ClassString)                                                                                       \
+    X(Call, "call", ClassCall)                                                                                         \
+    X(Jmp, "jmp", ClassJump)                                                                                           \
+    X(Ret, "ret", ClassReturn)                                                                                         \
+    X(Retf, "retf", ClassReturn)                                                                                       \
+    X(Jo, "jo", ClassConditionalJump)                                                                                  \
+    X(Jno, "jno", ClassConditionalJump)                                                                                \
+    X(Jb, "jb", ClassConditionalJump)                                                                                  \
+    X(Jnb, "jnb", ClassConditionalJump)                                                                                \
+    X(Je, "je", ClassConditionalJump)                                                                                  \
+    X(Jne, "jne", ClassConditionalJump)                                                                                \
+    X(Jbe, "jbe", ClassConditionalJump)                                                                                \
+    X(Ja, "ja", ClassConditionalJump)                                                                                  \
+    X(Js, "js", ClassConditionalJump)                                                                                  \
+    X(Jns, "jns", ClassConditionalJump)                                                                                \
+    X(Jp, "jp", ClassConditionalJump)                                                                                  \
+    X(Jnp, "jnp", ClassConditionalJump)                                                                                \
+    X(Jl, "jl", ClassConditionalJump)                                                                                  \
+    X(Jnl, "jnl", ClassConditionalJump)                                                                                \
+    X(Jle, "jle", ClassConditionalJump)                                                                                \
+    X(Jg, "jg", ClassConditionalJump)                                                                                  \
+    X(Loopnz, "loopnz", ClassConditionalJump)                                                                          \
+    X(Loopz, "loopz", ClassConditionalJump)                                                                            \
+    X(Loop, "loop", ClassConditionalJump)                                                                              \
+    X(Jcxz, "jcxz", ClassConditionalJump)                                                                              \
+    X(Int, "int", ClassInterrupt)                                                                                      \
+    X(Int3, "int3", ClassInterrupt)                                                                                    \
+    X(Into, "into", ClassInterrupt)                                                                                    \
+    X(Iret, "iret", ClassReturn)                                                                                       \
+    X(Clc, "clc", ClassFlag)                                                                                           \
+    X(Cmc, "cmc", ClassFlag)                                                                                           \
+    X(Stc, "stc", ClassFlag)                                                                                           \
+    X(Cld, "cld", ClassFlag)                                                                                           \
+    X(Std, "std", ClassFlag)                                                                                           \
+    X(Cli, "cli", ClassFlag)                                                                                           \
+    X(Sti, "sti", ClassFlag)                                                                                           \
+    X(Hlt, "hlt", ClassControl)                                                                                        \
+    X(Wait, "wait", ClassControl)                                                                                      \
+    X(Esc, "esc", ClassControl)                                                                                        \
+    X(Nop, "nop", ClassControl)
+
+#define MNEMONIC_ENUM(Name, Text, Class) Mnemonic##Name,
+typedef enum { MNEMONICS(MNEMONIC_ENUM) MnemonicCount } Mnemonic_t;
+#undef MNEMONIC_ENUM
+
+typedef enum {
+    OperandNone = 0,
+    OperandRegister,        // Index is Reg | (Word << 3), the layout of Table 4-9
+    OperandSegmentRegister, // Index is es, cs, ss, ds
+    OperandMemory,          // Index is r/m for mod 00, r/m + 8 for mod 01/10. See EffectiveAddressDirect
+    OperandImmediate,       // Index is an ImmediateKind_t, value is in Instruction_t.Immediate
+    OperandRelative,        // Instruction_t.Immediate is the signed offset from the end of the instruction
+    OperandFarPointer,      // Instruction_t.Segment:Instruction_t.Immediate
+} OperandType_t;
+
+// mod 00 with r/m 110 is a direct address instead of [bp]. See asterisk below Table 4-8
+#define EffectiveAddressDirect 6
+#define EffectiveAddressDisplacement 8
+
+typedef enum {
+    ImmediateByte = 0, // Printed as a signed byte
+    ImmediateWord,     // Printed as a signed word
+    ImmediateUnsigned, // Ports, interrupt numbers, stack adjustments...
+} ImmediateKind_t;
+
+#define InstWide 0x01
+#define InstLock 0x02
+#define InstRep 0x04
+#define InstRepne 0x08
+#define InstSegment 0x10
+#define InstFar 0x20
+
+typedef struct {
+    uint8_t Type;
+    uint8_t Index;
+} Operand_t;
+
+// Everything the decoder knows about one instruction. Kept at 16 bytes so records pack tightly in arrays.
+typedef struct {
+    uint8_t Opcode;
+    uint8_t ModRM;
+    uint8_t Mnemonic;
+    uint8_t Length; // Including prefixes
+    uint8_t Flags;
+    uint8_t SegmentOverride;
+    Operand_t Operands[2];
+    int16_t Displacement;
+    uint16_t Immediate;
+    uint16_t Segment;
+} Instruction_t;
+_Static_assert(sizeof(Instruction_t) == 16, "Instruction_t should stay 16 bytes");
+
+// Longest line FormatInstruction can produce is "lock repne " + a far/sized memory operand + a far pointer, which
+// comes in well under this.
+#define MaxInstructionTextLength 64
+
+typedef enum {
+    Lib8086Ok = 0,
+    Lib8086Truncated,   // The instruction runs past the end of the buffer
+    Lib8086NoRoom,      // The text doesn't fit in the caller's buffer
+    Lib8086BadArgument, // A NULL pointer where one isn't allowed
+} Lib8086Status_t;
+
+//*****************************************************************************
+// Functions
+//*****************************************************************************
+LIB8086_API const char *Lib8086StatusStr(const Lib8086Status_t Status);
+LIB8086_API Lib8086Status_t Lib8086DecodeOne(const uint8_t *Bytes, const size_t Size, Instruction_t *Instruction,
+                                             uint16_t *Length);
+LIB8086_API Lib8086Status_t Lib8086DecodeBatch(const uint8_t *Bytes, const size_t Size, Instruction_t *Instructions,
+                                               const size_t MaxCount, size_t *Count, size_t *Consumed);
+LIB8086_API Lib8086Status_t Lib8086Format(const Instruction_t *Instruction, char *Text, const size_t TextSize,
+                                          size_t *TextLength);
+
+#endif
@@ -0,0 +1,5 @@
+; Listing 37: one register to register mov
+
+bits 16
+
+mov cx, bx
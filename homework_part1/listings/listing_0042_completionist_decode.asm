@@ -0,0 +1,148 @@
+; Listing 42: at least one of every instruction decoder3 knows
+
+bits 16
+
+add bx, [bx+si]
+add bx, [bp]
+add si, 2
+add bp, 2
+add cx, 8
+add bx, [bp + 0]
+add cx, [bx + 2]
+add bh, [bp + si + 4]
+add di, [bp + di + 6]
+add byte [bx+si], ch
+add word [bp], bx
+add byte [bp + si + 4], 29
+add word [bx + di - 1000], 300
+add ax, 1000
+add al, -30
+add al, 9
+sub bx, [bx+si]
+sub word [1234], 5
+cmp byte [bx], 34
+cmp ax, 1000
+adc ax, bx
+sbb cl, dl
+and al, 0x0f
+or word [bx], 0x1234
+xor si, si
+test al, 4
+test ax, 0x1234
+test byte [bx], 7
+test [bx], cx
+xchg ax, dx
+xchg [bx+si], cl
+xchg bx, cx
+inc ax
+inc byte [bx]
+dec word [bp+2]
+dec si
+push ax
+push word [bx]
+push es
+push cs
+pop ds
+pop word [bx+4]
+pop di
+mov es, ax
+mov ax, ds
+mov word [bx], ss
+lea bx, [bp+si+4]
+lds si, [bx]
+les di, [bp+8]
+neg byte [bx]
+not ax
+mul cl
+imul word [bx]
+div bl
+idiv cx
+shl ax, 1
+shr byte [bx], 1
+sar dx, cl
+rol byte [bx+4], cl
+ror ax, 1
+rcl bl, 1
+rcr word [bp], cl
+cbw
+cwd
+aaa
+daa
+aas
+das
+aam
+aad
+xlat
+lahf
+sahf
+pushf
+popf
+movsb
+movsw
+cmpsb
+scasw
+lodsb
+stosw
+rep movsb
+repne scasb
+rep stosw
+lock xchg [bx], ax
+mov al, [es:bx]
+mov [cs:bx+si+4], ax
+cs movsb
+es lodsb
+es xlat
+rep es movsw
+in al, 200
+in ax, dx
+out 44, ax
+out dx, al
+int 0x21
+int3
+into
+iret
+clc
+cmc
+stc
+cld
+std
+cli
+sti
+hlt
+wait
+nop
+ret
+ret 8
+retf
+retf 4
+call word [bx]
+jmp word [bx+si]
+call far [bx]
+jmp far [bp+2]
+jmp ax
+call si
+call 0x1234:0x5678
+jmp 0x1234:0x5678
+je $+0
+jl $-2
+jle $-4
+jb $-6
+jbe $-8
+jp $-10
+jo $-12
+js $-14
+jne $-16
+jnl $-18
+jg $-20
+jnb $-22
+ja $-24
+jnp $-26
+jno $-28
+jns $-30
+loop $-32
+loope $-34
+loopnz $-36
+jcxz $-38
+jmp $-40
+jmp $-278
+call $-281
@@ -0,0 +1,27 @@
+; idiv quotients the 8086 can't hold raise interrupt 0. The handler at 60 counts them in cx, so sim8086 should end
+; with cx = 4 and the last, valid, divide in ax/dx.
+bits 16
+
+mov word [0], 60
+mov word [2], 0
+mov dx, 0x8000
+mov ax, 0
+mov bx, -1
+idiv bx
+mov dx, -1
+mov ax, 0x8000
+mov bx, 1
+idiv bx
+mov ax, -128
+mov bl, -1
+idiv bl
+mov ax, -128
+mov bl, 1
+idiv bl
+mov dx, -1
+mov ax, 0x8001
+mov bx, 1
+idiv bx
+hlt
+inc cx
+iret